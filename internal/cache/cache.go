@@ -1,123 +1,591 @@
 package cache
 
 import (
-	"dns-resolver/internal/metrics"
+	"encoding/binary"
 	"fmt"
 	"log"
-	"strings"
+	"math/rand"
+	"runtime"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"dns-resolver/internal/interfaces"
+	"dns-resolver/internal/logging"
+	"dns-resolver/internal/metrics"
 
 	"github.com/dgraph-io/ristretto"
 	"github.com/miekg/dns"
 )
 
-// CacheItem represents an item in the cache.
+// CacheItem represents an item in the cache. The response is kept pre-packed so
+// that a hit is a copy plus an ID and TTL patch instead of a deep copy and a pack.
 type CacheItem struct {
-	Msg                  *dns.Msg
+	Wire                 []byte   // packed response with the TTLs as received
+	TTLOffsets           []uint16 // offsets of the TTL fields in Wire
+	Stored               time.Time
 	Expiration           time.Time
 	StaleWhileRevalidate time.Duration
+
+	cost   int64     // bytes charged against the cache's memory budget
+	qtype  uint16    // query type, for the per-type byte breakdown
+	retain time.Time // when Ristretto drops the item
+
+	// ECS: an answer scoped to a client subnet has its scope prefix length;
+	// the item under the question's unscoped key is then a marker listing the
+	// scopes at which answers are cached.
+	scope  uint8
+	scopes *scopeSet
+
+	hits        atomic.Uint32 // lookups answered from the item
+	prefetching atomic.Bool   // the item has been queued for prefetch
 }
 
-// Cache is a thread-safe, sharded DNS cache with Ristretto.
+// Cache is a thread-safe, sharded DNS cache with Ristretto. It has two tiers:
+// whole responses, and the RRsets of positive answers for composing responses
+// to questions not cached as such. Their capacities are memory budgets in bytes;
+// each response costs its packed size plus overhead. The hottest responses are
+// also kept in a small lock-free L1 in front of Ristretto. Answers to ECS
+// queries are partitioned by the client subnet scope they were returned for.
 type Cache struct {
+	l1       l1Cache
+	l2Hits   atomic.Uint64
+	misses   atomic.Uint64
 	cache    *ristretto.Cache
+	rrsets   *rrsetCache
+	bytes    atomic.Int64
 	resolver interfaces.CacheResolver
 	metrics  *metrics.Metrics
+	denials  *denialCache
 	msgPool  sync.Pool
 	minTTL   time.Duration
 	maxTTL   time.Duration
+
+	// Serve-stale (RFC 8767): expired entries are kept for maxStale so that they
+	// can answer, with staleTTL, when the upstream fails.
+	maxStale time.Duration
+	staleTTL time.Duration
+
+	// Entries with at least prefetchHits hits are queued on prefetches for
+	// refresh shortly before they expire.
+	prefetchHits uint32
+	prefetches   chan Key
+
+	journal *Journal
 }
 
-// NewCache creates and returns a new Cache with Ristretto.
-func NewCache(size int, minTTL, maxTTL time.Duration, m *metrics.Metrics) (*Cache, error) {
-	if size <= 0 {
-		size = DefaultCacheSize
+// NewCache creates and returns a new Cache with Ristretto that holds up to
+// maxBytes bytes of responses and rrsetBytes bytes of RRsets.
+func NewCache(maxBytes, rrsetBytes int64, minTTL, maxTTL time.Duration, m *metrics.Metrics) (*Cache, error) {
+	if maxBytes <= 0 {
+		maxBytes = DefaultMessageCacheSize
 	}
-
-	ristrettoCache, err := ristretto.NewCache(&ristretto.Config{
-		NumCounters: int64(size * 10), // Recommended value from Ristretto docs
-		MaxCost:     int64(size),
-		BufferItems: 64, // Default value
-		Metrics:     true,
-		OnEvict: func(item *ristretto.Item) {
-			if item.Value != nil {
-				if cacheItem, ok := item.Value.(*CacheItem); ok {
-					if cacheItem.Msg != nil {
-						// Here you might want to put the dns.Msg back into a sync.Pool
-						// For now, we'll just let it be garbage collected.
-					}
-				}
-			}
-			m.IncrementCacheEvictions()
-		},
-	})
-	if err != nil {
-		return nil, fmt.Errorf("failed to create ristretto cache: %w", err)
+	if rrsetBytes <= 0 {
+		rrsetBytes = DefaultRRsetCacheSize
 	}
 
 	c := &Cache{
-		cache:   ristrettoCache,
 		metrics: m,
+		denials: newDenialCache(),
 		msgPool: sync.Pool{
 			New: func() interface{} {
 				return new(dns.Msg)
 			},
 		},
-		minTTL: minTTL,
-		maxTTL: maxTTL,
+		minTTL:     minTTL,
+		maxTTL:     maxTTL,
+		prefetches: make(chan Key, prefetchQueueSize),
+	}
+
+	ristrettoCache, err := ristretto.NewCache(&ristretto.Config{
+		// Ristretto recommends ten counters per item it expects to hold.
+		NumCounters:        maxBytes / averageItemCost * 10,
+		MaxCost:            maxBytes,
+		BufferItems:        64, // Default value
+		Metrics:            true,
+		KeyToHash:          keyToHash,
+		IgnoreInternalCost: true, // itemOverhead accounts for it
+		OnEvict:            c.onEvict,
+		OnExit:             c.onExit,
+	})
+	if err != nil {
+		return nil, fmt.Errorf("failed to create ristretto cache: %w", err)
+	}
+	c.cache = ristrettoCache
+	m.SetCacheMaxBytes(maxBytes)
+
+	if c.rrsets, err = newRRsetCache(rrsetBytes, maxTTL, m); err != nil {
+		ristrettoCache.Close()
+		return nil, err
 	}
 
 	return c, nil
 }
 
-// Close gracefully closes the cache.
+// onEvict is called by Ristretto for items dropped to make room and for expired
+// items it cleans up.
+func (c *Cache) onEvict(item *ristretto.Item) {
+	c.metrics.IncrementCacheEvictions()
+	if ci, ok := item.Value.(*CacheItem); ok && time.Now().Before(ci.retain) {
+		c.metrics.RecordCachePressureEviction(qtypeLabel(ci.qtype), ci.cost)
+	}
+}
+
+// onExit is called by Ristretto whenever an item leaves the cache: evicted,
+// expired, rejected by the admission policy, deleted or replaced.
+func (c *Cache) onExit(value interface{}) {
+	if item, ok := value.(*CacheItem); ok {
+		c.charge(item, -item.cost)
+	}
+}
+
+// charge adds delta bytes for item to the live byte counts.
+func (c *Cache) charge(item *CacheItem, delta int64) {
+	c.bytes.Add(delta)
+	c.metrics.AddCacheBytes(qtypeLabel(item.qtype), delta)
+	if item.scope > 0 {
+		c.metrics.AddECSCacheBytes(delta)
+	}
+}
+
+// Bytes returns the number of bytes charged for the items in the cache.
+func (c *Cache) Bytes() int64 {
+	return c.bytes.Load()
+}
+
+// itemCost returns the bytes charged for an item holding wire and offsets.
+func itemCost(wire []byte, offsets []uint16) int64 {
+	return int64(cap(wire)+2*cap(offsets)) + itemOverhead
+}
+
+func qtypeLabel(qtype uint16) string {
+	if s, ok := dns.TypeToString[qtype]; ok {
+		return s
+	}
+	return "OTHER"
+}
+
+// Close gracefully closes the cache and its journal.
 func (c *Cache) Close() {
 	if c.cache != nil {
 		c.cache.Close()
 	}
+	if c.rrsets != nil {
+		c.rrsets.close()
+	}
+	if c.journal != nil {
+		if err := c.journal.Close(); err != nil {
+			log.Printf("Failed to close cache journal: %v", err)
+		}
+	}
+}
+
+// SetJournal makes the cache write every entry it stores to j, which it then
+// owns and closes. Restore from j first.
+func (c *Cache) SetJournal(j *Journal) {
+	c.journal = j
+}
+
+// Restore loads the unexpired entries of j into the cache, decoding and
+// inserting them on all CPUs, and returns how many were loaded.
+func (c *Cache) Restore(j *Journal) (int, error) {
+	records := make(chan journalRecord, journalQueueSize)
+	var loaded atomic.Int64
+	var wg sync.WaitGroup
+	for i := 0; i < runtime.GOMAXPROCS(0); i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for rec := range records {
+				key, item, err := decodeRecord(rec)
+				if err != nil {
+					c.metrics.IncrementLMDBErrors()
+					log.Printf("Skipping cache journal record for key %q: %v", key.String(), err)
+					continue
+				}
+				c.insert(&key, item)
+				c.metrics.IncrementLMDBCacheLoads()
+				loaded.Add(1)
+			}
+		}()
+	}
+
+	err := j.scan(time.Now(), records)
+	close(records)
+	wg.Wait()
+	c.cache.Wait()
+	if err != nil {
+		c.metrics.IncrementLMDBErrors()
+		return int(loaded.Load()), fmt.Errorf("failed to read cache journal: %w", err)
+	}
+	return int(loaded.Load()), nil
+}
+
+// SetServeStale keeps expired entries for maxStale past their expiry, for
+// answering with a TTL of ttl when the upstream fails (RFC 8767). A maxStale of
+// zero disables serve-stale. It only affects entries set afterwards.
+func (c *Cache) SetServeStale(maxStale, ttl time.Duration) {
+	c.maxStale = maxStale
+	c.staleTTL = ttl
 }
 
-func (c *Cache) Get(key string) (*dns.Msg, bool, bool) {
-	value, found := c.cache.Get(key)
+// SetPrefetch enables prefetching of entries that have been hit at least minHits
+// times; zero disables it. Due entries are queued on Prefetches.
+func (c *Cache) SetPrefetch(minHits uint32) {
+	c.prefetchHits = minHits
+}
+
+// Prefetches returns the queue of keys due for a refresh before they expire.
+func (c *Cache) Prefetches() <-chan Key {
+	return c.prefetches
+}
+
+// get returns the item stored for key, fresh or not.
+func (c *Cache) get(key *Key) *CacheItem {
+	h := key.hash()
+	value, found := c.cache.Get(h)
+	keyHashPool.Put(h)
 	if !found {
-		c.metrics.IncrementCacheMisses()
-		return nil, false, false
+		return nil
 	}
 
 	item, ok := value.(*CacheItem)
 	if !ok {
-		c.metrics.IncrementCacheMisses() // Treat as a miss if the type is wrong
-		log.Printf("Cache item for key %s has wrong type", key)
+		// Treat as a miss if the type is wrong
+		logging.Errorf(logging.CategoryCache, "Cache item for key %q has wrong type", key.String())
+		return nil
+	}
+	return item
+}
+
+// find returns the live item for key and whether it is past its TTL but within
+// its stale-while-revalidate window. It records no metrics.
+func (c *Cache) find(key *Key) (*CacheItem, bool, bool) {
+	item := c.get(key)
+	if item == nil {
 		return nil, false, false
 	}
 
-	if time.Now().After(item.Expiration) {
-		if item.StaleWhileRevalidate > 0 && time.Now().Before(item.Expiration.Add(item.StaleWhileRevalidate)) {
-			c.metrics.IncrementCacheHits()
-			// Return a deep copy to prevent race conditions
-			msgCopy := item.Msg.Copy()
-			return msgCopy, true, true // Stale
+	now := time.Now()
+	if now.After(item.Expiration) {
+		if item.StaleWhileRevalidate > 0 && now.Before(item.Expiration.Add(item.StaleWhileRevalidate)) {
+			return item, true, true // Stale
+		}
+		if !now.Before(item.Expiration.Add(c.maxStale)) {
+			c.Del(key)
 		}
-		c.cache.Del(key)
-		c.metrics.IncrementCacheMisses()
+		// Otherwise keep it around for GetStale.
 		return nil, false, false
 	}
+	return item, true, false // Not stale
+}
+
+// findStale returns the item for key if it has expired no longer than the
+// serve-stale period ago.
+func (c *Cache) findStale(key *Key) *CacheItem {
+	if c.maxStale <= 0 {
+		return nil
+	}
+	item := c.get(key)
+	if item != nil && item.scopes != nil {
+		return c.findStaleScoped(key, item)
+	}
+	if item == nil || !time.Now().Before(item.Expiration.Add(c.maxStale)) {
+		return nil
+	}
+	return item
+}
+
+// lookup returns the live item for key and whether it is being served stale.
+// When key itself isn't cached it tries to synthesize a negative answer instead,
+// returned as synth. qname is passed on to synthesize.
+// Together with GetWire it is the hit path and must not allocate.
+//
+// L1 hits are only counted in the L1's striped counters, which TierStats adds
+// up; everything else is counted as it happens.
+func (c *Cache) lookup(key *Key, qname []byte) (item *CacheItem, synth *dns.Msg, stale bool) {
+	now := time.Now()
+	if item := c.l1.get(key, now); item != nil {
+		c.schedulePrefetch(key, item, now)
+		return item, nil, false
+	}
+	if item, found, stale := c.find(key); found {
+		if item.scopes != nil {
+			// Answers for the question depend on the client's subnet. Scoped
+			// answers are neither promoted nor prefetched: both work by key.
+			if item, stale = c.findScoped(key, item); item != nil {
+				c.l2Hits.Add(1)
+				c.metrics.IncrementCacheHits()
+				return item, nil, stale
+			}
+			c.misses.Add(1)
+			c.metrics.IncrementCacheMisses()
+			return nil, nil, false
+		}
+		c.l2Hits.Add(1)
+		c.metrics.IncrementCacheHits()
+		if !stale {
+			if hits := item.hits.Add(1); hits >= l1PromoteHits {
+				c.l1.promote(key, item, now)
+			}
+			c.schedulePrefetch(key, item, now)
+		}
+		return item, nil, stale
+	}
+	if synth = c.synthesize(key, qname); synth != nil {
+		c.l2Hits.Add(1)
+		c.metrics.IncrementCacheHits()
+		return nil, synth, false
+	}
+	c.misses.Add(1)
+	c.metrics.IncrementCacheMisses()
+	return nil, nil, false
+}
 
-	c.metrics.IncrementCacheHits()
-	// Return a deep copy to prevent race conditions
-	msgCopy := item.Msg.Copy()
-	return msgCopy, true, false // Not stale
+// TierStats returns the lookups answered by the L1, by Ristretto and the RRset
+// and negative caches behind it (L2), and those that missed.
+func (c *Cache) TierStats() (l1Hits, l2Hits, misses uint64) {
+	return c.l1.hitCount(), c.l2Hits.Load(), c.misses.Load()
 }
 
-func (c *Cache) Set(key string, msg *dns.Msg, swr time.Duration) {
-	if msg.Rcode == dns.RcodeServerFailure || msg.Rcode == dns.RcodeNameError {
+// schedulePrefetch queues key for a refresh once item is popular and in the
+// last prefetchWindow of its TTL. Within the window the chance of queueing it
+// rises from nothing to certain at expiry, which spreads out the refreshes of
+// entries cached at the same time. Each item is queued at most once. Hits
+// served from the L1 aren't counted, so popularity is as of promotion.
+func (c *Cache) schedulePrefetch(key *Key, item *CacheItem, now time.Time) {
+	if c.prefetchHits == 0 || item.hits.Load() < c.prefetchHits {
+		return
+	}
+	window := time.Duration(float64(item.Expiration.Sub(item.Stored)) * prefetchWindow)
+	left := item.Expiration.Sub(now)
+	if window <= 0 || left > window {
+		return
+	}
+	if left > 0 && rand.Int63n(int64(window)) < int64(left) {
 		return
 	}
+	if !item.prefetching.CompareAndSwap(false, true) {
+		return
+	}
+	select {
+	case c.prefetches <- *key:
+	default:
+		// The queue is full; let a later hit try again.
+		item.prefetching.Store(false)
+	}
+}
 
-	ttl := time.Duration(getMinTTL(msg)) * time.Second
+// synthesize builds an answer for key from cached RRsets, or a negative answer
+// from an NXDOMAIN cached for its name or an ancestor (RFC 8020) or from cached
+// DNSSEC-validated NSEC/NSEC3 records (RFC 8198). qname is the client's
+// wire-format question name, if known.
+func (c *Cache) synthesize(key *Key, qname []byte) *dns.Msg {
+	if msg := c.rrsets.compose(key, qname, time.Now()); msg != nil {
+		c.metrics.IncrementRRsetAnswers()
+		// Keep the composed answer, so that asking again is a plain hit.
+		c.setMessage(key, msg, 0)
+		return msg
+	}
+	if item := c.nxdomainCut(key); item != nil {
+		msg, err := item.unpack()
+		if err == nil {
+			msg.Question = []dns.Question{questionFor(key, qname)}
+			msg.Answer = nil
+			c.metrics.IncrementNXDomainCutHits()
+			return msg
+		}
+		logging.Errorf(logging.CategoryCache, "Failed to unpack cached NXDOMAIN for key %q: %v", key.String(), err)
+	}
+	if msg := c.denials.synthesize(key, qname, time.Now()); msg != nil {
+		c.metrics.RecordAggressiveNSEC(dns.RcodeToString[msg.Rcode])
+		return msg
+	}
+	return nil
+}
+
+// age returns how many whole seconds the item has been in the cache.
+func (item *CacheItem) age() uint32 {
+	return uint32(time.Since(item.Stored) / time.Second)
+}
+
+// Get returns a freshly unpacked copy of the cached response with its TTLs aged.
+// An answer scoped to the key's client subnet carries an ECS option with its
+// scope; other cached answers have no OPT record.
+func (c *Cache) Get(key *Key) (*dns.Msg, bool, bool) {
+	item, synth, stale := c.lookup(key, nil)
+	if synth != nil {
+		return synth, true, false
+	}
+	if item == nil {
+		return nil, false, false
+	}
+
+	msg, err := item.unpack()
+	if err != nil {
+		logging.Errorf(logging.CategoryCache, "Failed to unpack cached response for key %q: %v", key.String(), err)
+		c.Del(key)
+		return nil, false, false
+	}
+	if item.scope > 0 {
+		setScope(msg, key, item.scope)
+	}
+	return msg, true, stale
+}
+
+// unpack returns a copy of the cached response with its TTLs aged.
+func (item *CacheItem) unpack() (*dns.Msg, error) {
+	wire := make([]byte, len(item.Wire))
+	copy(wire, item.Wire)
+	patchWire(wire, item.TTLOffsets, binary.BigEndian.Uint16(item.Wire), item.age())
+
+	msg := new(dns.Msg)
+	if err := msg.Unpack(wire); err != nil {
+		return nil, err
+	}
+	return msg, nil
+}
+
+// GetStale returns a copy of the cached response for key even if it has expired,
+// as long as that was within the serve-stale period. Every TTL in it is set to the
+// serve-stale TTL. It is meant for answering when the upstream fails.
+func (c *Cache) GetStale(key *Key) (*dns.Msg, bool) {
+	item := c.findStale(key)
+	if item == nil {
+		return nil, false
+	}
+
+	wire := make([]byte, len(item.Wire))
+	copy(wire, item.Wire)
+	setWireTTLs(wire, item.TTLOffsets, c.staleTTLSeconds())
+
+	msg := new(dns.Msg)
+	if err := msg.Unpack(wire); err != nil {
+		logging.Errorf(logging.CategoryCache, "Failed to unpack stale response for key %q: %v", key.String(), err)
+		return nil, false
+	}
+	if item.scope > 0 {
+		setScope(msg, key, item.scope)
+	}
+	return msg, true
+}
+
+// GetStaleWire is the wire-format counterpart of GetStale; id and qname are
+// handled as by GetWire.
+func (c *Cache) GetStaleWire(key *Key, id uint16, qname []byte, buf []byte) ([]byte, bool) {
+	item := c.findStale(key)
+	if item == nil {
+		return nil, false
+	}
+
+	wire := append(buf[:0], item.Wire...)
+	binary.BigEndian.PutUint16(wire, id)
+	setWireTTLs(wire, item.TTLOffsets, c.staleTTLSeconds())
+	if len(wire) >= headerLen+len(qname) {
+		copy(wire[headerLen:], qname)
+	}
+	return wire, true
+}
+
+func (c *Cache) staleTTLSeconds() uint32 {
+	return uint32(c.staleTTL / time.Second)
+}
+
+// GetWire copies the cached response for key into buf, sets its ID to id and ages
+// its TTLs. When qname is the client's wire-format question name it replaces the
+// cached one, so the reply echoes the client's letter case. The result can be
+// written to a client as is. buf is grown if needed.
+func (c *Cache) GetWire(key *Key, id uint16, qname []byte, buf []byte) ([]byte, bool, bool) {
+	item, synth, stale := c.lookup(key, qname)
+	if synth != nil {
+		synth.Id = id
+		wire, err := synth.PackBuffer(buf)
+		if err != nil {
+			logging.Errorf(logging.CategoryCache, "Failed to pack synthesized answer for key %q: %v", key.String(), err)
+			return nil, false, false
+		}
+		return wire, true, false
+	}
+	if item == nil {
+		return nil, false, false
+	}
+
+	wire := append(buf[:0], item.Wire...)
+	patchWire(wire, item.TTLOffsets, id, item.age())
+	if len(wire) >= headerLen+len(qname) {
+		copy(wire[headerLen:], qname)
+	}
+	return wire, true, stale
+}
+
+// Set caches msg as the answer for key. Positive answers live for their smallest
+// answer TTL. Negative answers (NXDOMAIN and NODATA) are cached with their
+// authority section for the RFC 2308 negative TTL, and only when they carry an
+// SOA. An NXDOMAIN for the query name itself also answers queries for any type of
+// that name and of names below it (RFC 8020). The RRsets of positive answers to
+// queries without CD are also cached on their own, for composing answers to other
+// questions.
+//
+// A response to an ECS query with a non-zero scope is cached for the key's client
+// subnet truncated to that scope (RFC 7871, section 7.3.1) and answers only
+// clients within it. The OPT record is never cached.
+func (c *Cache) Set(key *Key, msg *dns.Msg, swr time.Duration) {
+	if scope, ok := responseScope(msg); ok {
+		msg = withoutOPT(msg)
+		if key.client.prefix > 0 {
+			if scope > key.client.prefix {
+				scope = key.client.prefix
+			}
+			c.metrics.RecordECSAnswer(scope)
+			if scope > 0 {
+				scoped := key.withScope(scope)
+				c.setMessage(&scoped, msg, swr)
+				return
+			}
+		}
+	}
+	if !c.setMessage(key, msg, swr) {
+		return
+	}
+	// RRset keys don't carry CD, so answers that skipped validation must not
+	// answer for anyone else.
+	if msg.Rcode == dns.RcodeSuccess && !isNegative(msg) && !key.CD() {
+		c.rrsets.add(msg, time.Now())
+	}
+}
+
+// setMessage caches msg in the message tier and reports whether it was cacheable.
+func (c *Cache) setMessage(key *Key, msg *dns.Msg, swr time.Duration) bool {
+	if msg.Rcode != dns.RcodeSuccess && msg.Rcode != dns.RcodeNameError {
+		return false
+	}
+
+	var ttl32 uint32
+	if isNegative(msg) {
+		var ok bool
+		if ttl32, ok = negativeTTL(msg); !ok {
+			return false
+		}
+	} else {
+		ttl32 = getMinTTL(msg)
+	}
+
+	// Pack a shallow copy so that enabling compression doesn't write to a message
+	// other goroutines may be reading.
+	packed := *msg
+	packed.Compress = true
+	wire, err := packed.Pack()
+	if err != nil {
+		logging.Errorf(logging.CategoryCache, "Failed to pack response for key %q: %v", key.String(), err)
+		return false
+	}
+	offsets, err := ttlOffsets(wire)
+	if err != nil {
+		logging.Errorf(logging.CategoryCache, "Failed to index packed response for key %q: %v", key.String(), err)
+		return false
+	}
+
+	ttl := time.Duration(ttl32) * time.Second
 	if ttl < c.minTTL {
 		ttl = c.minTTL
 	}
@@ -125,28 +593,100 @@ func (c *Cache) Set(key string, msg *dns.Msg, swr time.Duration) {
 		ttl = c.maxTTL
 	}
 
-	expiration := time.Now().Add(ttl)
+	// The TTL for Ristretto should be the total lifetime of the item, including
+	// the time it may still be served stale.
+	totalTTL := ttl + swr
+	if swr < c.maxStale {
+		totalTTL = ttl + c.maxStale
+	}
 
+	now := time.Now()
 	item := &CacheItem{
-		Msg:                  msg.Copy(), // Store a copy to avoid race conditions
-		Expiration:           expiration,
+		Wire:                 wire,
+		TTLOffsets:           offsets,
+		Stored:               now,
+		Expiration:           now.Add(ttl),
 		StaleWhileRevalidate: swr,
+		cost:                 itemCost(wire, offsets),
+		qtype:                key.qtype(),
+		retain:               now.Add(totalTTL),
+	}
+	c.insert(key, item)
+	if c.journal != nil {
+		c.journal.record(key, item)
 	}
 
-	// The cost is 1, as we are not sizing items individually for this cache.
-	// The TTL for Ristretto should be the total lifetime of the item.
-	totalTTL := ttl + swr
-	c.cache.SetWithTTL(key, item, 1, totalTTL)
+	if msg.AuthenticatedData && isNegative(msg) && !key.scoped() {
+		c.denials.add(msg, now)
+	}
+	return true
 }
 
-func (c *Cache) SetResolver(r interfaces.CacheResolver) {
-	c.resolver = r
+// insert stores item under key for the rest of its retention. An NXDOMAIN
+// without a CNAME in front is for the query name, so it is also stored as the
+// name's NXDOMAIN cut marker. An answer scoped to a client subnet is listed in
+// the question's scope marker instead.
+func (c *Cache) insert(key *Key, item *CacheItem) {
+	ttl := time.Until(item.retain)
+	if ttl <= 0 {
+		return
+	}
+	if key.scoped() {
+		_, item.scope = key.scope()
+		c.store(key, item, ttl)
+		c.addScope(key, item)
+		return
+	}
+	c.store(key, item, ttl)
+	c.l1.replace(key, item)
+
+	if isNXDomainWire(item.Wire) {
+		// The marker shares the response, so it is only charged its overhead.
+		marker := &CacheItem{
+			Wire:                 item.Wire,
+			TTLOffsets:           item.TTLOffsets,
+			Stored:               item.Stored,
+			Expiration:           item.Expiration,
+			StaleWhileRevalidate: item.StaleWhileRevalidate,
+			cost:                 itemOverhead,
+			qtype:                item.qtype,
+			retain:               item.retain,
+		}
+		cutKey := key.nxdomainKey()
+		c.store(&cutKey, marker, ttl)
+	}
 }
 
-func Key(q dns.Question) string {
-	return fmt.Sprintf("%s:%d:%d", strings.ToLower(q.Name), q.Qtype, q.Qclass)
+// store hands item to Ristretto and charges it to the byte counts, unless the
+// write was dropped. Items Ristretto later rejects are uncharged by onExit.
+func (c *Cache) store(key *Key, item *CacheItem, ttl time.Duration) {
+	h := key.hash()
+	// Charge first: onExit may run before SetWithTTL returns.
+	c.charge(item, item.cost)
+	if !c.cache.SetWithTTL(h, item, item.cost, ttl) {
+		c.charge(item, -item.cost)
+	}
+	keyHashPool.Put(h)
 }
 
+// Del removes the entry for key.
+func (c *Cache) Del(key *Key) {
+	c.l1.replace(key, nil)
+	h := key.hash()
+	c.cache.Del(h)
+	keyHashPool.Put(h)
+}
+
+// Wait blocks until writes buffered by Set have been applied.
+func (c *Cache) Wait() {
+	c.cache.Wait()
+}
+
+func (c *Cache) SetResolver(r interfaces.CacheResolver) {
+	c.resolver = r
+}
+
+// getMinTTL returns the smallest TTL in the answer section of a positive response.
 func getMinTTL(msg *dns.Msg) uint32 {
 	var minTTL uint32 = 0
 
@@ -157,12 +697,6 @@ func getMinTTL(msg *dns.Msg) uint32 {
 				minTTL = rr.Header().Ttl
 			}
 		}
-	} else if len(msg.Ns) > 0 {
-		for _, rr := range msg.Ns {
-			if soa, ok := rr.(*dns.SOA); ok {
-				return soa.Minttl
-			}
-		}
 	}
 
 	if minTTL == 0 {
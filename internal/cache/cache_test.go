@@ -1,7 +1,10 @@
 package cache
 
 import (
+	"dns-resolver/internal/dnswire"
 	"dns-resolver/internal/metrics"
+	"net"
+	"path/filepath"
 	"strconv"
 	"testing"
 	"time"
@@ -15,7 +18,7 @@ func newTestCache(t *testing.T) (*Cache, func()) {
 	t.Helper()
 
 	m := metrics.NewMetrics()
-	cache, err := NewCache(128, 0, 3600*time.Second, m)
+	cache, err := NewCache(1<<20, 1<<20, 0, 3600*time.Second, m)
 	assert.NoError(t, err)
 
 	cleanup := func() {
@@ -41,15 +44,15 @@ func TestCacheSetAndGet(t *testing.T) {
 	defer cleanup()
 
 	q := dns.Question{Name: "example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
-	key := Key(q)
+	key := NewKey(q)
 	msg := createTestMsg("example.com.", 60, "1.2.3.4")
 
-	c.Set(key, msg, 0)
+	c.Set(&key, msg, 0)
 
 	// Ristretto is eventually consistent, so we might need a short wait
 	time.Sleep(10 * time.Millisecond)
 
-	retrievedMsg, found, revalidate := c.Get(key)
+	retrievedMsg, found, revalidate := c.Get(&key)
 	assert.True(t, found, "expected to find message in cache, but didn't")
 	assert.False(t, revalidate, "expected revalidate to be false for a fresh entry")
 	assert.NotNil(t, retrievedMsg, "retrieved message was nil")
@@ -60,9 +63,9 @@ func TestCacheNotFound(t *testing.T) {
 	defer cleanup()
 
 	q := dns.Question{Name: "notfound.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
-	key := Key(q)
+	key := NewKey(q)
 
-	_, found, _ := c.Get(key)
+	_, found, _ := c.Get(&key)
 	assert.False(t, found, "expected to not find message in cache, but did")
 }
 
@@ -71,14 +74,14 @@ func TestCacheExpiration(t *testing.T) {
 	defer cleanup()
 
 	q := dns.Question{Name: "shortlived.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
-	key := Key(q)
+	key := NewKey(q)
 	msg := createTestMsg("shortlived.com.", 1, "2.3.4.5")
 
-	c.Set(key, msg, 0)
+	c.Set(&key, msg, 0)
 
 	time.Sleep(1100 * time.Millisecond)
 
-	_, found, _ := c.Get(key)
+	_, found, _ := c.Get(&key)
 	assert.False(t, found, "expected message to be expired and not found, but it was found")
 }
 
@@ -87,17 +90,17 @@ func TestCacheStaleWhileRevalidate(t *testing.T) {
 	defer cleanup()
 
 	q := dns.Question{Name: "stale.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
-	key := Key(q)
+	key := NewKey(q)
 	// TTL of 1 second, SWR of 5 seconds
 	msg := createTestMsg("stale.com.", 1, "3.4.5.6")
 	swrDuration := 5 * time.Second
 
-	c.Set(key, msg, swrDuration)
+	c.Set(&key, msg, swrDuration)
 
 	// Wait for item to become stale but not fully expired from SWR window
 	time.Sleep(1100 * time.Millisecond)
 
-	retrievedMsg, found, revalidate := c.Get(key)
+	retrievedMsg, found, revalidate := c.Get(&key)
 	assert.True(t, found, "expected to get stale message, but got nothing")
 	assert.True(t, revalidate, "expected revalidate to be true for a stale entry")
 	assert.NotNil(t, retrievedMsg, "retrieved stale message was nil")
@@ -107,6 +110,707 @@ func TestCacheStaleWhileRevalidate(t *testing.T) {
 	time.Sleep(swrDuration)
 
 	// After the SWR window, the item should be gone
-	_, found, _ = c.Get(key)
+	_, found, _ = c.Get(&key)
 	assert.False(t, found, "expected message to be expired and not found after SWR window, but it was found")
 }
+
+func TestCacheServeStale(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+	c.SetServeStale(5*time.Second, 30*time.Second)
+
+	q := dns.Question{Name: "servestale.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
+	key := NewKey(q)
+	c.Set(&key, createTestMsg("servestale.com.", 1, "5.6.7.8"), 0)
+	c.Wait()
+
+	_, found := c.GetStale(&key)
+	assert.True(t, found, "expected a fresh entry to be servable as stale too")
+
+	time.Sleep(1100 * time.Millisecond)
+
+	// Expired entries are misses for normal lookups but stay around for serve-stale.
+	_, found, _ = c.Get(&key)
+	assert.False(t, found, "expected an expired entry to be a miss")
+
+	msg, found := c.GetStale(&key)
+	if assert.True(t, found, "expected an expired entry within max-stale") && assert.Len(t, msg.Answer, 1) {
+		assert.Equal(t, uint32(30), msg.Answer[0].Header().Ttl, "expected the serve-stale TTL")
+	}
+
+	wire, found := c.GetStaleWire(&key, 0xBEEF, nil, nil)
+	assert.True(t, found)
+	got := new(dns.Msg)
+	assert.NoError(t, got.Unpack(wire))
+	assert.Equal(t, uint16(0xBEEF), got.Id, "expected the ID to be patched")
+
+	c.SetServeStale(0, 30*time.Second)
+	_, found = c.GetStale(&key)
+	assert.False(t, found, "expected serve-stale to be disabled")
+}
+
+func TestCachePrefetch(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+	c.SetPrefetch(2)
+
+	hotKey := NewKey(dns.Question{Name: "hot.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	coldKey := NewKey(dns.Question{Name: "cold.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	c.Set(&hotKey, createTestMsg("hot.com.", 2, "1.1.1.1"), 0)
+	c.Set(&coldKey, createTestMsg("cold.com.", 2, "2.2.2.2"), 0)
+	c.Wait()
+
+	// Outside the last tenth of the TTL, popularity alone doesn't queue anything.
+	for i := 0; i < 10; i++ {
+		c.Get(&hotKey)
+	}
+	assert.Empty(t, c.Prefetches())
+
+	time.Sleep(1850 * time.Millisecond)
+
+	// Within it, the chance of queueing is at least a quarter per hit.
+	c.Get(&coldKey)
+	for i := 0; i < 100; i++ {
+		c.Get(&hotKey)
+	}
+	if assert.Len(t, c.Prefetches(), 1, "expected the hot entry to be queued exactly once") {
+		key := <-c.Prefetches()
+		assert.Equal(t, hotKey, key)
+		assert.Equal(t, dns.Question{Name: "hot.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}, key.Question())
+	}
+}
+
+func TestCacheL1(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	key := NewKey(dns.Question{Name: "l1.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	c.Set(&key, createTestMsg("l1.com.", 60, "1.1.1.1"), 0)
+	c.Wait()
+
+	for i := 0; i < l1PromoteHits+10; i++ {
+		_, found, _ := c.Get(&key)
+		assert.True(t, found)
+	}
+	l1Hits, l2Hits, misses := c.TierStats()
+	assert.Equal(t, uint64(l1PromoteHits), l2Hits, "expected hits behind the L1 until promotion")
+	assert.Equal(t, uint64(10), l1Hits, "expected the L1 to answer after promotion")
+	assert.Zero(t, misses)
+
+	// Replacing the entry replaces it in the L1 as well.
+	c.Set(&key, createTestMsg("l1.com.", 60, "2.2.2.2"), 0)
+	msg, found, _ := c.Get(&key)
+	if assert.True(t, found) && assert.Len(t, msg.Answer, 1) {
+		assert.Equal(t, "2.2.2.2", msg.Answer[0].(*dns.A).A.String())
+	}
+
+	c.Del(&key)
+	c.Wait()
+	before, _, _ := c.TierStats()
+	c.Get(&key)
+	after, _, _ := c.TierStats()
+	assert.Equal(t, before, after, "expected a deleted entry to leave the L1")
+}
+
+func TestCacheECSScopes(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	q := dns.Question{Name: "cdn.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
+	keyFor := func(addr string) Key {
+		k := NewKey(q)
+		k.SetClientSubnet(1, 24, net.ParseIP(addr))
+		return k
+	}
+	answer := func(addr string, scope uint8) *dns.Msg {
+		msg := createTestMsg(q.Name, 60, addr)
+		msg.SetEdns0(4096, false)
+		msg.IsEdns0().Option = []dns.EDNS0{&dns.EDNS0_SUBNET{Code: dns.EDNS0SUBNET, Family: 1, SourceNetmask: 24, SourceScope: scope}}
+		return msg
+	}
+
+	east, west := keyFor("192.0.2.10"), keyFor("198.51.100.10")
+	c.Set(&east, answer("10.0.0.1", 24), 0)
+	c.Wait()
+	c.Set(&west, answer("10.0.0.2", 16), 0)
+	c.Wait()
+
+	// Any client in a cached subnet gets its answer, with the scope.
+	neighbour := keyFor("192.0.2.200")
+	msg, found, _ := c.Get(&neighbour)
+	if assert.True(t, found) && assert.Len(t, msg.Answer, 1) {
+		assert.Equal(t, "10.0.0.1", msg.Answer[0].(*dns.A).A.String())
+		if opt := msg.IsEdns0(); assert.NotNil(t, opt) {
+			assert.Equal(t, uint8(24), opt.Option[0].(*dns.EDNS0_SUBNET).SourceScope)
+		}
+	}
+	wider := keyFor("198.51.7.7")
+	msg, found, _ = c.Get(&wider)
+	if assert.True(t, found) && assert.Len(t, msg.Answer, 1) {
+		assert.Equal(t, "10.0.0.2", msg.Answer[0].(*dns.A).A.String())
+	}
+
+	// Clients elsewhere, or without a subnet, miss.
+	other := keyFor("203.0.113.1")
+	_, found, _ = c.Get(&other)
+	assert.False(t, found)
+	plain := NewKey(q)
+	_, found, _ = c.Get(&plain)
+	assert.False(t, found)
+
+	// A global answer serves everyone again, without an OPT record.
+	c.Set(&other, answer("10.0.0.3", 0), 0)
+	c.Wait()
+	msg, found, _ = c.Get(&plain)
+	if assert.True(t, found) {
+		assert.Nil(t, msg.IsEdns0())
+	}
+}
+
+func TestCacheByteAccounting(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	small := createTestMsg("small.com.", 60, "1.1.1.1")
+	big := createTestMsg("big.com.", 60, "2.2.2.2")
+	for i := 0; i < 50; i++ {
+		rr, _ := dns.NewRR("big.com. 60 IN TXT \"" + strconv.Itoa(i) + " padding padding padding padding\"")
+		big.Answer = append(big.Answer, rr)
+	}
+
+	smallKey := NewKey(dns.Question{Name: "small.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	bigKey := NewKey(dns.Question{Name: "big.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	c.Set(&smallKey, small, 0)
+	c.Set(&bigKey, big, 0)
+	c.Wait()
+
+	smallItem, _, _ := c.find(&smallKey)
+	bigItem, _, _ := c.find(&bigKey)
+	if !assert.NotNil(t, smallItem) || !assert.NotNil(t, bigItem) {
+		return
+	}
+	assert.Greater(t, bigItem.cost, smallItem.cost, "expected cost to follow the packed size")
+	assert.Equal(t, smallItem.cost+bigItem.cost, c.Bytes())
+
+	// Replacing an entry swaps its charge rather than adding to it.
+	c.Set(&smallKey, small, 0)
+	c.Wait()
+	assert.Equal(t, smallItem.cost+bigItem.cost, c.Bytes())
+
+	c.Del(&bigKey)
+	c.Wait()
+	assert.Equal(t, smallItem.cost, c.Bytes())
+}
+
+func TestCacheJournalRestore(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "cache.lmdb")
+	key := NewKey(dns.Question{Name: "journal.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	nxKey := NewKey(dns.Question{Name: "gone.journal.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	belowKey := NewKey(dns.Question{Name: "deeper.gone.journal.com.", Qtype: dns.TypeMX, Qclass: dns.ClassINET})
+
+	j, err := OpenJournal(path, metrics.NewMetrics())
+	if !assert.NoError(t, err) {
+		return
+	}
+	c, _ := newTestCache(t)
+	c.SetJournal(j)
+	c.Set(&key, createTestMsg("journal.com.", 300, "6.7.8.9"), 0)
+	c.Set(&nxKey, createNegativeMsg("gone.journal.com.", dns.TypeA, dns.RcodeNameError, 300, 300), 0)
+	c.Close() // flushes and closes the journal
+	// A late Set, as from a lookup still in flight at shutdown, is dropped.
+	c.Set(&key, createTestMsg("journal.com.", 300, "6.7.8.9"), 0)
+
+	time.Sleep(1100 * time.Millisecond)
+
+	j, err = OpenJournal(path, metrics.NewMetrics())
+	if !assert.NoError(t, err) {
+		return
+	}
+	restored, cleanup := newTestCache(t)
+	defer cleanup()
+	n, err := restored.Restore(j)
+	assert.NoError(t, err)
+	assert.Equal(t, 2, n)
+	assert.NoError(t, j.Close())
+
+	msg, found, _ := restored.Get(&key)
+	if assert.True(t, found, "expected the journaled entry to be restored") && assert.Len(t, msg.Answer, 1) {
+		assert.Less(t, msg.Answer[0].Header().Ttl, uint32(300), "expected the TTL to keep counting down")
+	}
+	_, found, _ = restored.Get(&belowKey)
+	assert.True(t, found, "expected the restored NXDOMAIN to cut off names below it")
+}
+
+func TestCacheComposesFromRRsets(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	rr := func(s string) dns.RR {
+		rr, err := dns.NewRR(s)
+		assert.NoError(t, err)
+		return rr
+	}
+
+	// One response teaches www's CNAME and its target's address...
+	www := new(dns.Msg)
+	www.SetQuestion("www.example.com.", dns.TypeA)
+	www.Answer = []dns.RR{
+		rr("www.example.com. 300 IN CNAME web.example.net."),
+		rr("web.example.net. 300 IN A 192.0.2.1"),
+	}
+	wwwKey := NewKey(www.Question[0])
+	c.Set(&wwwKey, www, 0)
+
+	// ...another one a CNAME pointing at www.
+	alias := new(dns.Msg)
+	alias.SetQuestion("alias.example.org.", dns.TypeCNAME)
+	alias.Answer = []dns.RR{rr("alias.example.org. 300 IN CNAME WWW.example.com.")}
+	aliasCNAMEKey := NewKey(alias.Question[0])
+	c.Set(&aliasCNAMEKey, alias, 0)
+	c.Wait()
+
+	webKey := NewKey(dns.Question{Name: "web.example.net.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	msg, found, _ := c.Get(&webKey)
+	if assert.True(t, found, "expected the target's address to answer on its own") && assert.Len(t, msg.Answer, 1) {
+		assert.Equal(t, "web.example.net.", msg.Question[0].Name)
+	}
+
+	aliasKey := NewKey(dns.Question{Name: "alias.example.org.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	msg, found, _ = c.Get(&aliasKey)
+	if assert.True(t, found, "expected the chain to be composed") && assert.Len(t, msg.Answer, 3) {
+		assert.Equal(t, dns.TypeCNAME, msg.Answer[0].Header().Rrtype)
+		assert.Equal(t, dns.TypeCNAME, msg.Answer[1].Header().Rrtype)
+		assert.Equal(t, "192.0.2.1", msg.Answer[2].(*dns.A).A.String())
+	}
+
+	// The composed answer is kept in the message tier.
+	c.Wait()
+	item, found, _ := c.find(&aliasKey)
+	assert.True(t, found)
+	assert.NotNil(t, item)
+
+	// A chain with a missing link isn't answered.
+	mxKey := NewKey(dns.Question{Name: "alias.example.org.", Qtype: dns.TypeMX, Qclass: dns.ClassINET})
+	_, found, _ = c.Get(&mxKey)
+	assert.False(t, found)
+}
+
+func TestCacheRRsetsKeepDNSSECApart(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	// A validated answer to a non-DO query, its signatures stripped.
+	stripped := createTestMsg("signed.example.com.", 300, "192.0.2.1")
+	stripped.AuthenticatedData = true
+	plainKey := NewKey(stripped.Question[0])
+	c.Set(&plainKey, stripped, 0)
+
+	// An answer to a CD query, which skipped validation.
+	unchecked := createTestMsg("unchecked.example.com.", 300, "192.0.2.2")
+	cdKey := NewKey(unchecked.Question[0])
+	cdKey.setFlags(false, true)
+	c.Set(&cdKey, unchecked, 0)
+	c.Wait()
+
+	doKey := plainKey
+	doKey.setFlags(true, false)
+	_, found, _ := c.Get(&doKey)
+	assert.False(t, found, "expected no secure answer without signatures for a DO query")
+
+	otherKey := NewKey(unchecked.Question[0])
+	_, found, _ = c.Get(&otherKey)
+	assert.False(t, found, "expected a CD answer not to answer queries without CD")
+}
+
+func TestCacheGetWire(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	q := dns.Question{Name: "wire.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
+	key := NewKey(q)
+	msg := createTestMsg("wire.com.", 60, "4.5.6.7")
+	msg.SetEdns0(4096, true)
+
+	c.Set(&key, msg, 0)
+	c.cache.Wait()
+
+	wire, found, revalidate := c.GetWire(&key, 0xBEEF, nil, nil)
+	assert.True(t, found, "expected to find message in cache, but didn't")
+	assert.False(t, revalidate, "expected revalidate to be false for a fresh entry")
+
+	got := new(dns.Msg)
+	assert.NoError(t, got.Unpack(wire))
+	assert.Equal(t, uint16(0xBEEF), got.Id, "expected the ID to be patched")
+	if assert.Len(t, got.Answer, 1) {
+		assert.LessOrEqual(t, got.Answer[0].Header().Ttl, uint32(60))
+	}
+	assert.NotNil(t, got.IsEdns0(), "expected the OPT record to survive the TTL patch")
+}
+
+// createNegativeMsg returns a negative answer for qname carrying an SOA with the
+// given TTL and MINIMUM.
+func createNegativeMsg(qname string, qtype uint16, rcode int, soaTTL, minimum uint32) *dns.Msg {
+	msg := new(dns.Msg)
+	msg.SetQuestion(dns.Fqdn(qname), qtype)
+	msg.Rcode = rcode
+	soa, _ := dns.NewRR("example.com. " + strconv.Itoa(int(soaTTL)) + " IN SOA ns1.example.com. hostmaster.example.com. 1 7200 3600 1209600 " + strconv.Itoa(int(minimum)))
+	msg.Ns = []dns.RR{soa}
+	return msg
+}
+
+func TestNegativeTTL(t *testing.T) {
+	ttl, ok := negativeTTL(createNegativeMsg("a.example.com.", dns.TypeA, dns.RcodeNameError, 3600, 300))
+	assert.True(t, ok)
+	assert.Equal(t, uint32(300), ttl, "MINIMUM below the SOA TTL should win")
+
+	ttl, ok = negativeTTL(createNegativeMsg("a.example.com.", dns.TypeA, dns.RcodeNameError, 120, 300))
+	assert.True(t, ok)
+	assert.Equal(t, uint32(120), ttl, "SOA TTL below MINIMUM should win")
+
+	_, ok = negativeTTL(createTestMsg("a.example.com.", 60, ""))
+	assert.False(t, ok, "a negative answer without SOA has no negative TTL")
+}
+
+func TestCacheNegativeAnswers(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	nodata := createNegativeMsg("nodata.example.com.", dns.TypeAAAA, dns.RcodeSuccess, 3600, 300)
+	nodataKey := NewKey(nodata.Question[0])
+	c.Set(&nodataKey, nodata, 0)
+
+	noSOA := createTestMsg("nosoa.example.com.", 60, "")
+	noSOA.Rcode = dns.RcodeNameError
+	noSOAKey := NewKey(noSOA.Question[0])
+	c.Set(&noSOAKey, noSOA, 0)
+	c.Wait()
+
+	got, found, _ := c.Get(&nodataKey)
+	assert.True(t, found, "expected NODATA to be cached")
+	assert.Equal(t, dns.RcodeSuccess, got.Rcode)
+	assert.Empty(t, got.Answer)
+	assert.Len(t, got.Ns, 1, "expected the authority section to be preserved")
+
+	_, found, _ = c.Get(&noSOAKey)
+	assert.False(t, found, "negative answers without SOA must not be cached")
+}
+
+func TestCacheNXDOMAINCut(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	nx := createNegativeMsg("gone.example.com.", dns.TypeA, dns.RcodeNameError, 3600, 300)
+	key := NewKey(nx.Question[0])
+	c.Set(&key, nx, 0)
+	c.Wait()
+
+	// Other types of the name and names below it are answered by the cut.
+	for _, q := range []dns.Question{
+		{Name: "gone.example.com.", Qtype: dns.TypeMX, Qclass: dns.ClassINET},
+		{Name: "deep.below.GONE.example.com.", Qtype: dns.TypeAAAA, Qclass: dns.ClassINET},
+	} {
+		k := NewKey(q)
+		got, found, revalidate := c.Get(&k)
+		assert.True(t, found, q.Name)
+		assert.False(t, revalidate, q.Name)
+		assert.Equal(t, dns.RcodeNameError, got.Rcode, q.Name)
+		assert.Equal(t, q.Qtype, got.Question[0].Qtype, q.Name)
+		assert.True(t, dns.CanonicalName(q.Name) == dns.CanonicalName(got.Question[0].Name), q.Name)
+		assert.Len(t, got.Ns, 1, q.Name)
+
+		client := new(dns.Msg)
+		client.SetQuestion(q.Name, q.Qtype)
+		packed, err := client.Pack()
+		assert.NoError(t, err)
+		wire, found, _ := c.GetWire(&k, 0xBEEF, packed[headerLen:len(packed)-4], nil)
+		assert.True(t, found, q.Name)
+		reply := new(dns.Msg)
+		assert.NoError(t, reply.Unpack(wire))
+		assert.Equal(t, uint16(0xBEEF), reply.Id)
+		assert.Equal(t, q.Name, reply.Question[0].Name, "expected the client's letter case")
+	}
+
+	// Siblings and the parent are not.
+	for _, name := range []string{"other.example.com.", "example.com."} {
+		k := NewKey(dns.Question{Name: name, Qtype: dns.TypeA, Qclass: dns.ClassINET})
+		_, found, _ := c.Get(&k)
+		assert.False(t, found, name)
+	}
+}
+
+func TestCanonicalCompare(t *testing.T) {
+	// The canonical order example from RFC 4034, section 6.1.
+	names := []string{"example.", "a.example.", "yljkjljk.a.example.", "z.a.example.", "zabc.a.example.", "z.example.", "\001.z.example.", "*.z.example.", "\200.z.example."}
+	for i := 1; i < len(names); i++ {
+		a, ok := wireName(names[i-1])
+		assert.True(t, ok)
+		b, ok := wireName(names[i])
+		assert.True(t, ok)
+		assert.Negative(t, canonicalCompare(a, b), "%s < %s", names[i-1], names[i])
+		assert.Positive(t, canonicalCompare(b, a), "%s > %s", names[i], names[i-1])
+	}
+}
+
+func TestCacheAggressiveNSEC(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	nx := createNegativeMsg("b.example.com.", dns.TypeA, dns.RcodeNameError, 3600, 300)
+	apex, _ := dns.NewRR("example.com. 3600 IN NSEC a.example.com. NS SOA RRSIG NSEC")
+	a, _ := dns.NewRR("a.example.com. 3600 IN NSEC m.example.com. A RRSIG NSEC")
+	nx.Ns = append(nx.Ns, a, apex)
+
+	// Unvalidated denials are only cached as themselves.
+	key := NewKey(nx.Question[0])
+	c.Set(&key, nx, 0)
+	c.Wait()
+	other := NewKey(dns.Question{Name: "c.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	_, found, _ := c.Get(&other)
+	assert.False(t, found, "expected no synthesis from an unvalidated answer")
+
+	nx.AuthenticatedData = true
+	c.Set(&key, nx, 0)
+	c.Wait()
+
+	got, found, _ := c.Get(&other)
+	assert.True(t, found, "expected NXDOMAIN synthesized from the covering NSEC")
+	assert.Equal(t, dns.RcodeNameError, got.Rcode)
+	assert.False(t, got.AuthenticatedData, "expected no AD bit without DO")
+	assert.Equal(t, "c.example.com.", got.Question[0].Name)
+	assert.Len(t, got.Ns, 1, "expected only the SOA without DO")
+
+	otherDO := other
+	otherDO.setFlags(true, false)
+	got, found, _ = c.Get(&otherDO)
+	assert.True(t, found)
+	assert.True(t, got.AuthenticatedData)
+	assert.Len(t, got.Ns, 3, "expected the SOA and both NSEC records")
+
+	nodata := NewKey(dns.Question{Name: "a.example.com.", Qtype: dns.TypeMX, Qclass: dns.ClassINET})
+	got, found, _ = c.Get(&nodata)
+	assert.True(t, found, "expected NODATA synthesized from the matching NSEC")
+	assert.Equal(t, dns.RcodeSuccess, got.Rcode)
+	assert.Empty(t, got.Answer)
+
+	for _, q := range []dns.Question{
+		{Name: "a.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}, // the type exists
+		{Name: "z.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}, // no covering NSEC
+	} {
+		k := NewKey(q)
+		_, found, _ := c.Get(&k)
+		assert.False(t, found, q.Name)
+	}
+}
+
+func TestCacheAggressiveDelegationDenial(t *testing.T) {
+	// Denial records matching a delegation point come from the parent side of
+	// the cut; they only prove there is no DS.
+	hash := func(name string) string { return dns.HashName(name, dns.SHA1, 0, "") }
+	nsec3 := func(owner string, types ...uint16) dns.RR {
+		return &dns.NSEC3{
+			Hdr:        dns.RR_Header{Name: hash(owner) + ".example.com.", Rrtype: dns.TypeNSEC3, Class: dns.ClassINET, Ttl: 3600},
+			Hash:       dns.SHA1,
+			HashLength: 20,
+			NextDomain: "VVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVV",
+			TypeBitMap: types,
+		}
+	}
+	nsec := func(s string) dns.RR {
+		rr, _ := dns.NewRR(s)
+		return rr
+	}
+
+	for _, tc := range []struct {
+		name    string
+		records []dns.RR
+	}{
+		{"NSEC", []dns.RR{
+			nsec("sub.example.com. 3600 IN NSEC tld.example.com. NS RRSIG NSEC"),
+			nsec("dn.example.com. 3600 IN NSEC sub.example.com. DNAME RRSIG NSEC"),
+		}},
+		{"NSEC3", []dns.RR{
+			nsec3("sub.example.com.", dns.TypeNS, dns.TypeRRSIG),
+			nsec3("dn.example.com.", dns.TypeDNAME, dns.TypeRRSIG),
+		}},
+	} {
+		t.Run(tc.name, func(t *testing.T) {
+			c, cleanup := newTestCache(t)
+			defer cleanup()
+
+			nodata := createNegativeMsg("other.example.com.", dns.TypeA, dns.RcodeSuccess, 3600, 300)
+			nodata.Ns = append(nodata.Ns, tc.records...)
+			nodata.AuthenticatedData = true
+			key := NewKey(nodata.Question[0])
+			c.Set(&key, nodata, 0)
+			c.Wait()
+
+			for _, name := range []string{"sub.example.com.", "dn.example.com."} {
+				a := NewKey(dns.Question{Name: name, Qtype: dns.TypeA, Qclass: dns.ClassINET})
+				_, found, _ := c.Get(&a)
+				assert.False(t, found, "expected no NODATA for %s A from the parent side", name)
+
+				ds := NewKey(dns.Question{Name: name, Qtype: dns.TypeDS, Qclass: dns.ClassINET})
+				got, found, _ := c.Get(&ds)
+				assert.True(t, found, "expected NODATA for %s DS", name)
+				if found {
+					assert.Equal(t, dns.RcodeSuccess, got.Rcode)
+					assert.Empty(t, got.Answer)
+				}
+			}
+		})
+	}
+}
+
+func TestCacheAggressiveNSEC3BelowDelegation(t *testing.T) {
+	c, cleanup := newTestCache(t)
+	defer cleanup()
+
+	hash := func(name string) string { return dns.HashName(name, dns.SHA1, 0, "") }
+	nsec3 := func(owner, next string, types ...uint16) dns.RR {
+		return &dns.NSEC3{
+			Hdr:        dns.RR_Header{Name: owner + ".example.com.", Rrtype: dns.TypeNSEC3, Class: dns.ClassINET, Ttl: 3600},
+			Hash:       dns.SHA1,
+			HashLength: 20,
+			NextDomain: next,
+			TypeBitMap: types,
+		}
+	}
+
+	// Every hash but those of the two names below falls in a range without
+	// opt-out; sub is an unsigned delegation, plain an ordinary name.
+	nx := createNegativeMsg("other.example.com.", dns.TypeA, dns.RcodeNameError, 3600, 300)
+	nx.Ns = append(nx.Ns,
+		nsec3("00000000000000000000000000000000", "VVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVV", dns.TypeNS, dns.TypeSOA),
+		nsec3(hash("sub.example.com."), "VVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVV", dns.TypeNS),
+		nsec3(hash("plain.example.com."), "VVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVV", dns.TypeA, dns.TypeRRSIG),
+	)
+	nx.AuthenticatedData = true
+	key := NewKey(nx.Question[0])
+	c.Set(&key, nx, 0)
+	c.Wait()
+
+	plain := NewKey(dns.Question{Name: "www.plain.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	got, found, _ := c.Get(&plain)
+	if assert.True(t, found, "expected NXDOMAIN below an ordinary closest encloser") {
+		assert.Equal(t, dns.RcodeNameError, got.Rcode)
+	}
+
+	// The names below the delegation live in the child zone.
+	below := NewKey(dns.Question{Name: "www.sub.example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+	_, found, _ = c.Get(&below)
+	assert.False(t, found, "expected no NXDOMAIN below a delegation")
+}
+
+func TestKeyFromWireMatchesKey(t *testing.T) {
+	msg := new(dns.Msg)
+	msg.SetQuestion("MiXeD.Example.COM.", dns.TypeMX)
+	msg.SetEdns0(4096, true)
+	wire, err := msg.Pack()
+	assert.NoError(t, err)
+
+	var q dnswire.Query
+	assert.True(t, dnswire.ParseQuery(wire, &q))
+	assert.Equal(t, KeyFromMsg(msg), KeyFromWire(&q))
+
+	lower := new(dns.Msg)
+	lower.SetQuestion("mixed.example.com.", dns.TypeMX)
+	lower.SetEdns0(4096, true)
+	assert.Equal(t, KeyFromMsg(lower), KeyFromWire(&q))
+}
+
+func TestKeySeparatesFlagsAndScope(t *testing.T) {
+	q := dns.Question{Name: "example.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
+	plain := NewKey(q)
+
+	do := plain
+	do.setFlags(true, false)
+	cd := plain
+	cd.setFlags(false, true)
+	scoped := do
+	scoped.SetScope(1, 24, []byte{192, 0, 2, 77})
+	sameScope := do
+	sameScope.SetScope(1, 24, []byte{192, 0, 2, 200})
+
+	keys := []Key{plain, do, cd, scoped}
+	for i := range keys {
+		for j := range keys {
+			if i != j {
+				assert.NotEqual(t, keys[i].Bytes(), keys[j].Bytes())
+			}
+		}
+		assert.Equal(t, q, keys[i].Question())
+	}
+	assert.True(t, do.DO())
+	assert.True(t, scoped.DO())
+	assert.True(t, cd.CD())
+	assert.Equal(t, scoped.Bytes(), sameScope.Bytes(), "addresses in one subnet share a key")
+
+	decoded, ok := keyFromBytes(scoped.Bytes())
+	assert.True(t, ok)
+	assert.Equal(t, scoped, decoded)
+	_, ok = keyFromBytes(scoped.Bytes()[:5])
+	assert.False(t, ok)
+}
+
+func TestTTLOffsetsSkipsOPT(t *testing.T) {
+	msg := createTestMsg("offsets.com.", 300, "5.6.7.8")
+	msg.SetEdns0(4096, true)
+	msg.Compress = true
+	wire, err := msg.Pack()
+	assert.NoError(t, err)
+
+	offsets, err := ttlOffsets(wire)
+	assert.NoError(t, err)
+	assert.Len(t, offsets, 1, "expected one TTL offset for the A record and none for OPT")
+
+	patchWire(wire, offsets, 1, 100)
+	got := new(dns.Msg)
+	assert.NoError(t, got.Unpack(wire))
+	assert.Equal(t, uint32(200), got.Answer[0].Header().Ttl)
+}
+
+func benchmarkCacheHit(b *testing.B, get func(c *Cache, key *Key, buf []byte)) {
+	m := metrics.NewMetrics()
+	c, err := NewCache(1<<20, 1<<20, 0, 3600*time.Second, m)
+	if err != nil {
+		b.Fatalf("Failed to create cache: %v", err)
+	}
+	defer c.Close()
+
+	q := dns.Question{Name: "bench.com.", Qtype: dns.TypeA, Qclass: dns.ClassINET}
+	key := NewKey(q)
+	msg := createTestMsg("bench.com.", 3600, "6.7.8.9")
+	msg.SetEdns0(4096, true)
+	c.Set(&key, msg, 0)
+	c.cache.Wait()
+
+	buf := make([]byte, 0, dns.DefaultMsgSize)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		get(c, &key, buf)
+	}
+}
+
+// BenchmarkCacheGet measures a hit that materialises a dns.Msg and packs it for the client.
+func BenchmarkCacheGet(b *testing.B) {
+	benchmarkCacheHit(b, func(c *Cache, key *Key, buf []byte) {
+		msg, found, _ := c.Get(key)
+		if !found {
+			b.Fatal("expected a cache hit")
+		}
+		msg.Id = 1
+		if _, err := msg.PackBuffer(buf); err != nil {
+			b.Fatal(err)
+		}
+	})
+}
+
+// BenchmarkCacheGetWire measures a hit served from the wire-format entry.
+func BenchmarkCacheGetWire(b *testing.B) {
+	benchmarkCacheHit(b, func(c *Cache, key *Key, buf []byte) {
+		if _, found, _ := c.GetWire(key, 1, nil, buf); !found {
+			b.Fatal("expected a cache hit")
+		}
+	})
+}
@@ -1,11 +1,62 @@
 package cache
 
+import "time"
+
 const (
-	// DefaultCacheSize is the default number of items the cache can hold.
-	DefaultCacheSize = 10000
+	// DefaultMessageCacheSize is the default memory budget of the message cache.
+	DefaultMessageCacheSize = 64 << 20
+	// DefaultRRsetCacheSize is the default memory budget of the RRset cache.
+	DefaultRRsetCacheSize = 32 << 20
+
+	// itemOverhead approximates the memory an entry takes besides its packed
+	// response: the CacheItem and Ristretto's store, policy and expiry records.
+	itemOverhead = 320
+	// rrOverhead approximates the memory a cached resource record takes besides
+	// its wire length.
+	rrOverhead = 96
+	// averageItemCost is the expected cost of an entry, used to size Ristretto's
+	// admission counters from the memory budget.
+	averageItemCost = 512
 	// DefaultShards is the default number of shards for the cache.
 	DefaultShards = 32
 
+	// maxDenialZones bounds the number of zones whose NSEC/NSEC3 records are kept
+	// for aggressive negative caching.
+	maxDenialZones = 10000
+	// maxDenialRecordsPerZone bounds the NSEC or NSEC3 records kept per zone.
+	maxDenialRecordsPerZone = 1024
+	// maxNSEC3Iterations is the most NSEC3 hash iterations a zone may use for its
+	// records to be kept; hashing every miss must stay cheap (RFC 9276).
+	maxNSEC3Iterations = 150
+
+	// maxCNAMEChain is the most CNAME links followed composing an answer from
+	// cached RRsets.
+	maxCNAMEChain = 8
+
+	// l1Slots is the number of entries the L1 holds; a power of two.
+	l1Slots = 4096
+	// L1 hits are counted on l1Stripes counters, picked by l1StripeBits of hash.
+	l1StripeBits = 6
+	l1Stripes    = 1 << l1StripeBits
+	// l1PromoteHits is how many L2 hits make an entry a candidate for the L1.
+	l1PromoteHits = 8
+
+	// prefetchWindow is the final fraction of an entry's TTL in which a hit may
+	// queue it for prefetch.
+	prefetchWindow = 0.1
+	// prefetchQueueSize bounds the keys waiting to be prefetched.
+	prefetchQueueSize = 1024
+
+	// journalMapSize is the largest the cache journal's LMDB file may grow.
+	journalMapSize = 1 << 30
+	// journalQueueSize bounds the entries waiting to be written to the journal.
+	journalQueueSize = 4096
+	// journalBatchSize is the most entries written in one journal transaction.
+	journalBatchSize = 256
+	// journalSweepInterval is how often expired entries are deleted from the
+	// journal and it is synced to disk.
+	journalSweepInterval = 5 * time.Minute
+
 	// SlruProbationFraction is the fraction of the cache size allocated to the probation segment.
 	SlruProbationFraction = 0.8
 )
\ No newline at end of file
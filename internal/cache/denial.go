@@ -0,0 +1,525 @@
+package cache
+
+import (
+	"bytes"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// denialCache keeps the NSEC and NSEC3 records of DNSSEC-validated negative
+// answers, per zone, so that later queries for names they cover can be answered
+// without going upstream (aggressive use of the DNSSEC-validated cache, RFC 8198).
+// A flood of random subdomains of one signed zone then costs a handful of
+// upstream queries instead of one each.
+type denialCache struct {
+	mu    sync.RWMutex
+	zones map[string]*denialZone // keyed by lowercased wire-format zone name
+}
+
+// denialZone holds the denial records of one zone, each kept sorted so the record
+// covering a name is found by binary search.
+type denialZone struct {
+	name       []byte
+	soa        dns.RR
+	soaSigs    []dns.RR
+	soaExpires time.Time
+	nsec       []nsecRange  // in canonical order of owner name
+	nsec3      []nsec3Range // in order of owner hash
+}
+
+type nsecRange struct {
+	owner, next []byte // lowercased wire-format names
+	rr          *dns.NSEC
+	sigs        []dns.RR
+	expires     time.Time
+}
+
+type nsec3Range struct {
+	owner, next string // upper-case base32hex hashes
+	rr          *dns.NSEC3
+	sigs        []dns.RR
+	expires     time.Time
+}
+
+func newDenialCache() *denialCache {
+	return &denialCache{zones: make(map[string]*denialZone)}
+}
+
+// add records the NSEC and NSEC3 records of a validated negative answer. Each is
+// kept no longer than the answer's negative TTL (RFC 8198, section 5.4).
+func (d *denialCache) add(msg *dns.Msg, now time.Time) {
+	var soa *dns.SOA
+	for _, rr := range msg.Ns {
+		if s, ok := rr.(*dns.SOA); ok {
+			soa = s
+			break
+		}
+	}
+	if soa == nil {
+		return
+	}
+	zone, ok := wireName(soa.Hdr.Name)
+	if !ok {
+		return
+	}
+	negTTL, _ := negativeTTL(msg)
+
+	sigs := make(map[string][]dns.RR)
+	for _, rr := range msg.Ns {
+		if sig, ok := rr.(*dns.RRSIG); ok {
+			k := sigKey(sig.Hdr.Name, sig.TypeCovered)
+			sigs[k] = append(sigs[k], sig)
+		}
+	}
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	z, ok := d.zones[string(zone)]
+	if !ok {
+		if len(d.zones) >= maxDenialZones {
+			d.purge(now)
+			if len(d.zones) >= maxDenialZones {
+				return
+			}
+		}
+		z = &denialZone{name: zone}
+		d.zones[string(zone)] = z
+	}
+	z.soa = soa
+	z.soaSigs = sigs[sigKey(soa.Hdr.Name, dns.TypeSOA)]
+	z.soaExpires = now.Add(time.Duration(negTTL) * time.Second)
+
+	for _, rr := range msg.Ns {
+		ttl := rr.Header().Ttl
+		if ttl > negTTL {
+			ttl = negTTL
+		}
+		expires := now.Add(time.Duration(ttl) * time.Second)
+
+		switch rr := rr.(type) {
+		case *dns.NSEC:
+			owner, ok1 := wireName(rr.Hdr.Name)
+			next, ok2 := wireName(rr.NextDomain)
+			if !ok1 || !ok2 || !isSubdomain(owner, zone) {
+				continue
+			}
+			z.addNSEC(nsecRange{owner: owner, next: next, rr: rr, sigs: sigs[sigKey(rr.Hdr.Name, dns.TypeNSEC)], expires: expires}, now)
+		case *dns.NSEC3:
+			if rr.Hash != dns.SHA1 || rr.Iterations > maxNSEC3Iterations {
+				continue
+			}
+			dot := strings.IndexByte(rr.Hdr.Name, '.')
+			if dot <= 0 || !strings.EqualFold(dns.Fqdn(rr.Hdr.Name[dot+1:]), soa.Hdr.Name) {
+				continue
+			}
+			z.addNSEC3(nsec3Range{
+				owner:   strings.ToUpper(rr.Hdr.Name[:dot]),
+				next:    strings.ToUpper(rr.NextDomain),
+				rr:      rr,
+				sigs:    sigs[sigKey(rr.Hdr.Name, dns.TypeNSEC3)],
+				expires: expires,
+			}, now)
+		}
+	}
+}
+
+func (z *denialZone) addNSEC(r nsecRange, now time.Time) {
+	i := sort.Search(len(z.nsec), func(i int) bool { return canonicalCompare(z.nsec[i].owner, r.owner) >= 0 })
+	if i < len(z.nsec) && bytes.Equal(z.nsec[i].owner, r.owner) {
+		z.nsec[i] = r
+		return
+	}
+	if len(z.nsec) >= maxDenialRecordsPerZone {
+		z.nsec = purgeExpired(z.nsec, now, func(r nsecRange) time.Time { return r.expires })
+		if len(z.nsec) >= maxDenialRecordsPerZone {
+			return
+		}
+		i = sort.Search(len(z.nsec), func(i int) bool { return canonicalCompare(z.nsec[i].owner, r.owner) >= 0 })
+	}
+	z.nsec = append(z.nsec, nsecRange{})
+	copy(z.nsec[i+1:], z.nsec[i:])
+	z.nsec[i] = r
+}
+
+func (z *denialZone) addNSEC3(r nsec3Range, now time.Time) {
+	i := sort.Search(len(z.nsec3), func(i int) bool { return z.nsec3[i].owner >= r.owner })
+	if i < len(z.nsec3) && z.nsec3[i].owner == r.owner {
+		z.nsec3[i] = r
+		return
+	}
+	if len(z.nsec3) >= maxDenialRecordsPerZone {
+		z.nsec3 = purgeExpired(z.nsec3, now, func(r nsec3Range) time.Time { return r.expires })
+		if len(z.nsec3) >= maxDenialRecordsPerZone {
+			return
+		}
+		i = sort.Search(len(z.nsec3), func(i int) bool { return z.nsec3[i].owner >= r.owner })
+	}
+	z.nsec3 = append(z.nsec3, nsec3Range{})
+	copy(z.nsec3[i+1:], z.nsec3[i:])
+	z.nsec3[i] = r
+}
+
+func purgeExpired[T any](records []T, now time.Time, expires func(T) time.Time) []T {
+	kept := records[:0]
+	for _, r := range records {
+		if now.Before(expires(r)) {
+			kept = append(kept, r)
+		}
+	}
+	return kept
+}
+
+// purge drops zones whose SOA has expired. Called with d.mu held.
+func (d *denialCache) purge(now time.Time) {
+	for k, z := range d.zones {
+		if !now.Before(z.soaExpires) {
+			delete(d.zones, k)
+		}
+	}
+}
+
+// synthesize returns an NXDOMAIN or NODATA answer for key proven by cached
+// denial records, or nil. qname is the client's wire-format question name, if
+// known. The proof, with its signatures, and the AD bit are only included for DO
+// keys.
+func (d *denialCache) synthesize(key *Key, qname []byte, now time.Time) *dns.Msg {
+	name, qtype := key.name(), key.qtype()
+
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+
+	var z *denialZone
+	for off := 0; off < len(name); off += int(name[off]) + 1 {
+		if z = d.zones[string(name[off:])]; z != nil || name[off] == 0 {
+			break
+		}
+	}
+	if z == nil || !now.Before(z.soaExpires) {
+		return nil
+	}
+
+	rcode, proof := z.proveNSEC(name, qtype, now)
+	if proof == nil {
+		rcode, proof = z.proveNSEC3(name, qtype, now)
+	}
+	if proof == nil {
+		return nil
+	}
+
+	msg := new(dns.Msg)
+	msg.Response = true
+	msg.RecursionDesired = true
+	msg.RecursionAvailable = true
+	msg.Rcode = rcode
+	msg.Question = []dns.Question{questionFor(key, qname)}
+
+	remaining := uint32(z.soaExpires.Sub(now) / time.Second)
+	msg.Ns = appendWithTTL(msg.Ns, remaining, z.soa)
+	if !key.DO() {
+		// Like any answer to a client that didn't set DO: no DNSSEC records,
+		// and no AD bit (RFC 6840, section 5.8).
+		return msg
+	}
+	msg.AuthenticatedData = true
+	msg.Ns = appendWithTTL(msg.Ns, remaining, z.soaSigs...)
+	for _, rrs := range proof {
+		msg.Ns = appendWithTTL(msg.Ns, remaining, rrs...)
+	}
+	return msg
+}
+
+// proveNSEC looks for NSEC records proving that name has no qtype records
+// (NODATA) or doesn't exist (NXDOMAIN). It returns the proving records, each
+// followed by its signatures, or nil.
+func (z *denialZone) proveNSEC(name []byte, qtype uint16, now time.Time) (int, [][]dns.RR) {
+	if len(z.nsec) == 0 {
+		return 0, nil
+	}
+	if r := z.nsecAt(name, now); r != nil {
+		if !provesNoData(r.rr.TypeBitMap, qtype) {
+			return 0, nil
+		}
+		return dns.RcodeSuccess, [][]dns.RR{r.records()}
+	}
+
+	r := z.nsecCovering(name, now)
+	if r == nil {
+		return 0, nil
+	}
+	// An NSEC at a delegation point or DNAME above name says nothing about the
+	// names below it (RFC 8198, section 5.1).
+	if isSubdomain(name, r.owner) && atCut(r.rr.TypeBitMap) {
+		return 0, nil
+	}
+
+	// The name doesn't exist; a wildcard at its closest encloser would still
+	// answer for it, so that must be denied too.
+	ce := commonSuffix(name, r.owner)
+	if c := commonSuffix(name, r.next); len(c) > len(ce) {
+		ce = c
+	}
+	wildcard := append([]byte{1, '*'}, ce...)
+	if z.nsecAt(wildcard, now) != nil {
+		return 0, nil
+	}
+	w := z.nsecCovering(wildcard, now)
+	if w == nil {
+		return 0, nil
+	}
+	proof := [][]dns.RR{r.records()}
+	if w != r {
+		proof = append(proof, w.records())
+	}
+	return dns.RcodeNameError, proof
+}
+
+// provesNoData reports whether an NSEC or NSEC3 record with bitmap, matching
+// the query name, proves that it has no qtype records. At a delegation point or
+// a DNAME the record comes from the parent side and only speaks for DS (RFC 4035,
+// section 2.3; RFC 8198, section 5.1).
+func provesNoData(bitmap []uint16, qtype uint16) bool {
+	if hasType(bitmap, qtype) || hasType(bitmap, dns.TypeCNAME) {
+		return false
+	}
+	if atCut(bitmap) {
+		return qtype == dns.TypeDS
+	}
+	return true
+}
+
+// atCut reports whether an NSEC or NSEC3 record with bitmap sits at a
+// delegation point or a DNAME, where the names below belong elsewhere.
+func atCut(bitmap []uint16) bool {
+	return hasType(bitmap, dns.TypeDNAME) || (hasType(bitmap, dns.TypeNS) && !hasType(bitmap, dns.TypeSOA))
+}
+
+func (z *denialZone) nsecAt(name []byte, now time.Time) *nsecRange {
+	i := sort.Search(len(z.nsec), func(i int) bool { return canonicalCompare(z.nsec[i].owner, name) >= 0 })
+	if i < len(z.nsec) && bytes.Equal(z.nsec[i].owner, name) && now.Before(z.nsec[i].expires) {
+		return &z.nsec[i]
+	}
+	return nil
+}
+
+// nsecCovering returns the NSEC whose owner sorts before name and whose next name
+// sorts after it, wrapping around at the end of the zone.
+func (z *denialZone) nsecCovering(name []byte, now time.Time) *nsecRange {
+	i := sort.Search(len(z.nsec), func(i int) bool { return canonicalCompare(z.nsec[i].owner, name) >= 0 }) - 1
+	if i < 0 {
+		i = len(z.nsec) - 1
+	}
+	r := &z.nsec[i]
+	if !now.Before(r.expires) {
+		return nil
+	}
+	after := canonicalCompare(r.owner, name) < 0
+	before := canonicalCompare(name, r.next) < 0
+	if canonicalCompare(r.owner, r.next) < 0 {
+		if after && before {
+			return r
+		}
+	} else if after || before { // the last NSEC of the zone points back at the apex
+		return r
+	}
+	return nil
+}
+
+func (r *nsecRange) records() []dns.RR {
+	return append([]dns.RR{r.rr}, r.sigs...)
+}
+
+// proveNSEC3 is proveNSEC for zones signed with NSEC3 (RFC 5155, sections 8.4-8.6).
+func (z *denialZone) proveNSEC3(name []byte, qtype uint16, now time.Time) (int, [][]dns.RR) {
+	if len(z.nsec3) == 0 {
+		return 0, nil
+	}
+	params := z.nsec3[0].rr
+	hash := func(wire []byte) string {
+		n, _, err := dns.UnpackDomainName(wire, 0)
+		if err != nil {
+			return ""
+		}
+		return dns.HashName(n, params.Hash, params.Iterations, params.Salt)
+	}
+
+	h := hash(name)
+	if h == "" {
+		return 0, nil
+	}
+	if r := z.nsec3Matching(h, now); r != nil {
+		if !provesNoData(r.rr.TypeBitMap, qtype) {
+			return 0, nil
+		}
+		return dns.RcodeSuccess, [][]dns.RR{r.records()}
+	}
+
+	// Closest encloser proof: the nearest ancestor that exists, and a covered
+	// "next closer" name one label below it.
+	nextCloser := name
+	for off := int(name[0]) + 1; off < len(name) && len(name[off:]) >= len(z.name); off += int(name[off]) + 1 {
+		ce := name[off:]
+		match := z.nsec3Matching(hash(ce), now)
+		if match == nil {
+			nextCloser = ce
+			continue
+		}
+		// Like an NSEC, a closest encloser at a delegation point or DNAME
+		// proves nothing below it (RFC 5155, section 8.3).
+		if atCut(match.rr.TypeBitMap) {
+			return 0, nil
+		}
+		covering := z.nsec3Covering(hash(nextCloser), now)
+		// Opt-out ranges may hide unsigned delegations (RFC 8198, section 4.3).
+		if covering == nil || covering.rr.Flags&1 != 0 {
+			return 0, nil
+		}
+		wildcard := append([]byte{1, '*'}, ce...)
+		wh := hash(wildcard)
+		w := z.nsec3Covering(wh, now)
+		if w == nil || z.nsec3Matching(wh, now) != nil {
+			return 0, nil
+		}
+		proof := [][]dns.RR{match.records(), covering.records()}
+		if w != covering && w != match {
+			proof = append(proof, w.records())
+		}
+		return dns.RcodeNameError, proof
+	}
+	return 0, nil
+}
+
+func (z *denialZone) nsec3Matching(hash string, now time.Time) *nsec3Range {
+	i := sort.Search(len(z.nsec3), func(i int) bool { return z.nsec3[i].owner >= hash })
+	if i < len(z.nsec3) && z.nsec3[i].owner == hash && now.Before(z.nsec3[i].expires) {
+		return &z.nsec3[i]
+	}
+	return nil
+}
+
+func (z *denialZone) nsec3Covering(hash string, now time.Time) *nsec3Range {
+	if hash == "" {
+		return nil
+	}
+	i := sort.Search(len(z.nsec3), func(i int) bool { return z.nsec3[i].owner >= hash }) - 1
+	if i < 0 {
+		i = len(z.nsec3) - 1
+	}
+	r := &z.nsec3[i]
+	if !now.Before(r.expires) {
+		return nil
+	}
+	if r.owner < r.next {
+		if r.owner < hash && hash < r.next {
+			return r
+		}
+	} else if r.owner < hash || hash < r.next {
+		return r
+	}
+	return nil
+}
+
+func (r *nsec3Range) records() []dns.RR {
+	return append([]dns.RR{r.rr}, r.sigs...)
+}
+
+// appendWithTTL appends copies of rrs with their TTL lowered to at most ttl.
+func appendWithTTL(dst []dns.RR, ttl uint32, rrs ...dns.RR) []dns.RR {
+	for _, rr := range rrs {
+		rr = dns.Copy(rr)
+		if rr.Header().Ttl > ttl {
+			rr.Header().Ttl = ttl
+		}
+		dst = append(dst, rr)
+	}
+	return dst
+}
+
+func hasType(bitmap []uint16, t uint16) bool {
+	for _, b := range bitmap {
+		if b == t {
+			return true
+		}
+	}
+	return false
+}
+
+func sigKey(owner string, covered uint16) string {
+	return strings.ToLower(dns.Fqdn(owner)) + "/" + dns.TypeToString[covered]
+}
+
+// wireName returns name in lowercased wire format.
+func wireName(name string) ([]byte, bool) {
+	var buf [255]byte
+	n, err := dns.PackDomainName(dns.Fqdn(name), buf[:], 0, nil, false)
+	if err != nil {
+		return nil, false
+	}
+	wire := append([]byte(nil), buf[:n]...)
+	for i, b := range wire {
+		// Length octets are at most 63 and so never fall in the A-Z range.
+		if b >= 'A' && b <= 'Z' {
+			wire[i] = b + 'a' - 'A'
+		}
+	}
+	return wire, true
+}
+
+// labels returns the offsets of the labels of a wire-format name, root excluded.
+func labels(name []byte, offs []int) []int {
+	for off := 0; off < len(name) && name[off] != 0; off += int(name[off]) + 1 {
+		offs = append(offs, off)
+	}
+	return offs
+}
+
+func label(name []byte, off int) []byte {
+	return name[off+1 : off+1+int(name[off])]
+}
+
+// canonicalCompare orders lowercased wire-format names as DNSSEC does (RFC 4034,
+// section 6.1): label by label from the root, shorter names first.
+func canonicalCompare(a, b []byte) int {
+	var abuf, bbuf [128]int
+	al, bl := labels(a, abuf[:0]), labels(b, bbuf[:0])
+	for i, j := len(al)-1, len(bl)-1; i >= 0 && j >= 0; i, j = i-1, j-1 {
+		if c := bytes.Compare(label(a, al[i]), label(b, bl[j])); c != 0 {
+			return c
+		}
+	}
+	return len(al) - len(bl)
+}
+
+// commonSuffix returns the longest common ancestor of name and other, as a
+// suffix of name.
+func commonSuffix(name, other []byte) []byte {
+	var nbuf, obuf [128]int
+	nl, ol := labels(name, nbuf[:0]), labels(other, obuf[:0])
+	i, j := len(nl)-1, len(ol)-1
+	for ; i >= 0 && j >= 0; i, j = i-1, j-1 {
+		if !bytes.Equal(label(name, nl[i]), label(other, ol[j])) {
+			break
+		}
+	}
+	if i+1 < len(nl) {
+		return name[nl[i+1]:]
+	}
+	return name[len(name)-1:] // the root
+}
+
+// isSubdomain reports whether name is at or below parent.
+func isSubdomain(name, parent []byte) bool {
+	for off := 0; off < len(name); off += int(name[off]) + 1 {
+		if bytes.Equal(name[off:], parent) {
+			return true
+		}
+		if name[off] == 0 {
+			break
+		}
+	}
+	return false
+}
@@ -0,0 +1,153 @@
+package cache
+
+import (
+	"net"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// ECS address families (RFC 7871, section 6).
+const (
+	ecsFamilyIPv4 = 1
+	ecsFamilyIPv6 = 2
+)
+
+// scopeSet is the set of ECS scope prefix lengths, per address family, at which
+// answers for a question are cached.
+type scopeSet [2][3]uint64
+
+func (s *scopeSet) add(family uint16, prefix uint8) {
+	if (family == ecsFamilyIPv4 || family == ecsFamilyIPv6) && prefix <= 128 {
+		s[family-1][prefix/64] |= 1 << (prefix % 64)
+	}
+}
+
+func (s *scopeSet) has(family uint16, prefix uint8) bool {
+	if family != ecsFamilyIPv4 && family != ecsFamilyIPv6 || prefix > 128 {
+		return false
+	}
+	return s[family-1][prefix/64]&(1<<(prefix%64)) != 0
+}
+
+// findECS returns the ECS option in opt, if any.
+func findECS(opt *dns.OPT) *dns.EDNS0_SUBNET {
+	for _, o := range opt.Option {
+		if ecs, ok := o.(*dns.EDNS0_SUBNET); ok {
+			return ecs
+		}
+	}
+	return nil
+}
+
+// responseScope returns the scope prefix length of the ECS option in msg and
+// whether msg has an OPT record at all.
+func responseScope(msg *dns.Msg) (uint8, bool) {
+	opt := msg.IsEdns0()
+	if opt == nil {
+		return 0, false
+	}
+	if ecs := findECS(opt); ecs != nil {
+		return ecs.SourceScope, true
+	}
+	return 0, true
+}
+
+// withoutOPT returns a shallow copy of msg without its OPT record. Cached
+// answers are served to clients with and without EDNS alike.
+func withoutOPT(msg *dns.Msg) *dns.Msg {
+	stripped := *msg
+	stripped.Extra = make([]dns.RR, 0, len(msg.Extra))
+	for _, rr := range msg.Extra {
+		if rr.Header().Rrtype != dns.TypeOPT {
+			stripped.Extra = append(stripped.Extra, rr)
+		}
+	}
+	return &stripped
+}
+
+// setScope adds an OPT record to msg with an ECS option for key's client
+// subnet and scope prefix length.
+func setScope(msg *dns.Msg, key *Key, scope uint8) {
+	addr := net.IP(key.client.addr[:16])
+	if key.client.family == ecsFamilyIPv4 {
+		addr = net.IP(key.client.addr[:4])
+	}
+	opt := &dns.OPT{Hdr: dns.RR_Header{Name: ".", Rrtype: dns.TypeOPT}}
+	opt.SetUDPSize(dns.DefaultMsgSize)
+	opt.Option = []dns.EDNS0{&dns.EDNS0_SUBNET{
+		Code:          dns.EDNS0SUBNET,
+		Family:        key.client.family,
+		SourceNetmask: key.client.prefix,
+		SourceScope:   scope,
+		Address:       addr,
+	}}
+	msg.Extra = append(msg.Extra, opt)
+}
+
+// findScoped returns the live item cached for key's client subnet at one of
+// the scopes listed by marker, preferring the longest, and whether it is
+// stale. It returns nil if there is none.
+func (c *Cache) findScoped(key *Key, marker *CacheItem) (*CacheItem, bool) {
+	for p := key.client.prefix; p > 0; p-- {
+		if !marker.scopes.has(key.client.family, p) {
+			continue
+		}
+		scoped := key.withScope(p)
+		if item, found, stale := c.find(&scoped); found {
+			return item, stale
+		}
+	}
+	return nil, false
+}
+
+// findStaleScoped is the serve-stale counterpart of findScoped.
+func (c *Cache) findStaleScoped(key *Key, marker *CacheItem) *CacheItem {
+	now := time.Now()
+	for p := key.client.prefix; p > 0; p-- {
+		if !marker.scopes.has(key.client.family, p) {
+			continue
+		}
+		scoped := key.withScope(p)
+		if item := c.get(&scoped); item != nil && now.Before(item.Expiration.Add(c.maxStale)) {
+			return item
+		}
+	}
+	return nil
+}
+
+// addScope records in the marker kept under the unscoped key that an answer
+// for it is cached at the scope of key, a scoped key, so that lookups know
+// which subnets to try. The marker lives as long as the longest-retained
+// answer it lists. Concurrent updates may lose a scope; its answer then misses
+// and is resolved and cached again, adding the scope back.
+func (c *Cache) addScope(key *Key, item *CacheItem) {
+	base := key.unscoped()
+	family, prefix := key.scope()
+	var scopes scopeSet
+	retain := item.retain
+	if old := c.get(&base); old != nil && old.scopes != nil && time.Now().Before(old.retain) {
+		if old.scopes.has(family, prefix) && !old.retain.Before(retain) {
+			return
+		}
+		scopes = *old.scopes
+		if old.retain.After(retain) {
+			retain = old.retain
+		}
+	}
+	scopes.add(family, prefix)
+
+	marker := &CacheItem{
+		Stored:     item.Stored,
+		Expiration: retain,
+		cost:       itemOverhead,
+		qtype:      item.qtype,
+		retain:     retain,
+		scopes:     &scopes,
+	}
+	// A global answer for the question no longer applies to every client.
+	c.l1.replace(&base, nil)
+	if ttl := time.Until(retain); ttl > 0 {
+		c.store(&base, marker, ttl)
+	}
+}
@@ -0,0 +1,287 @@
+package cache
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"log"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/bmatsuo/lmdb-go/lmdb"
+)
+
+// journalHeaderLen is the length of the timestamps in front of the packed
+// response in a journal record: stored, expiration, retain and the
+// stale-while-revalidate window, each as nanoseconds.
+const journalHeaderLen = 4 * 8
+
+var errBadRecord = errors.New("malformed cache journal record")
+
+// Journal persists cache entries to an LMDB environment so that a restarted
+// resolver comes back with a warm cache. Entries are written behind the cache
+// by a single goroutine in batched transactions; writes that can't keep up are
+// dropped rather than slowing down Set.
+type Journal struct {
+	env     *lmdb.Env
+	dbi     lmdb.DBI
+	metrics *metrics.Metrics
+	entries chan journalEntry // never closed, so that a late record can't panic
+	stop    chan struct{}
+	done    chan struct{}
+}
+
+type journalEntry struct {
+	key  Key
+	item *CacheItem
+}
+
+// OpenJournal opens or creates the cache journal at path, a single LMDB file.
+func OpenJournal(path string, m *metrics.Metrics) (*Journal, error) {
+	env, err := lmdb.NewEnv()
+	if err != nil {
+		return nil, fmt.Errorf("failed to create lmdb environment: %w", err)
+	}
+	if err := env.SetMapSize(journalMapSize); err != nil {
+		env.Close()
+		return nil, fmt.Errorf("failed to set lmdb map size: %w", err)
+	}
+	// A cache can afford to lose its last writes in a system crash, so skip the
+	// fsync on every commit; the periodic sweep syncs instead.
+	if err := env.Open(path, lmdb.NoSubdir|lmdb.NoSync, 0o644); err != nil {
+		env.Close()
+		return nil, fmt.Errorf("failed to open lmdb environment at %s: %w", path, err)
+	}
+
+	var dbi lmdb.DBI
+	err = env.Update(func(txn *lmdb.Txn) (err error) {
+		dbi, err = txn.OpenRoot(0)
+		return err
+	})
+	if err != nil {
+		env.Close()
+		return nil, fmt.Errorf("failed to open lmdb database: %w", err)
+	}
+
+	j := &Journal{
+		env:     env,
+		dbi:     dbi,
+		metrics: m,
+		entries: make(chan journalEntry, journalQueueSize),
+		stop:    make(chan struct{}),
+		done:    make(chan struct{}),
+	}
+	go j.run()
+	return j, nil
+}
+
+// Close flushes queued writes and closes the journal. Entries recorded while or
+// after it closes are dropped.
+func (j *Journal) Close() error {
+	close(j.stop)
+	<-j.done
+	if err := j.env.Sync(true); err != nil {
+		log.Printf("Failed to sync cache journal: %v", err)
+	}
+	return j.env.Close()
+}
+
+// record queues item to be written under key.
+func (j *Journal) record(key *Key, item *CacheItem) {
+	select {
+	case <-j.stop:
+		return
+	default:
+	}
+	select {
+	case j.entries <- journalEntry{key: *key, item: item}:
+	default:
+		j.metrics.IncrementLMDBJournalDrops()
+	}
+}
+
+// run writes queued entries in batches and periodically sweeps out expired ones.
+func (j *Journal) run() {
+	defer close(j.done)
+
+	sweep := time.NewTicker(journalSweepInterval)
+	defer sweep.Stop()
+
+	batch := make([]journalEntry, 0, journalBatchSize)
+	for {
+		select {
+		case e := <-j.entries:
+			j.write(j.fill(append(batch[:0], e)))
+		case <-j.stop:
+			// Flush what was queued before Close; later records are dropped.
+			for n := len(j.entries); n > 0; n -= len(batch) {
+				if batch = j.fill(batch[:0]); len(batch) == 0 {
+					break
+				}
+				j.write(batch)
+			}
+			return
+		case <-sweep.C:
+			j.sweep(time.Now())
+			if err := j.env.Sync(true); err != nil {
+				log.Printf("Failed to sync cache journal: %v", err)
+			}
+		}
+	}
+}
+
+// fill appends queued entries to batch, without waiting, until it is full.
+func (j *Journal) fill(batch []journalEntry) []journalEntry {
+	for len(batch) < journalBatchSize {
+		select {
+		case e := <-j.entries:
+			batch = append(batch, e)
+		default:
+			return batch
+		}
+	}
+	return batch
+}
+
+// write puts a batch of entries in one transaction.
+func (j *Journal) write(batch []journalEntry) {
+	var buf []byte
+	err := j.env.Update(func(txn *lmdb.Txn) error {
+		for i := range batch {
+			buf = encodeRecord(buf[:0], batch[i].item)
+			if err := txn.Put(j.dbi, batch[i].key.Bytes(), buf, 0); err != nil {
+				return err
+			}
+		}
+		return nil
+	})
+	if err != nil {
+		j.metrics.IncrementLMDBErrors()
+		log.Printf("Failed to write %d entries to cache journal: %v", len(batch), err)
+		if lmdb.IsMapFull(err) {
+			// Start over rather than stop journaling; the cache refills it.
+			j.clear()
+		}
+		return
+	}
+	j.metrics.AddLMDBWrites(len(batch))
+}
+
+// sweep deletes the records whose retention ended before now.
+func (j *Journal) sweep(now time.Time) {
+	var expired [][]byte
+	err := j.env.View(func(txn *lmdb.Txn) error {
+		txn.RawRead = true
+		return j.each(txn, func(key, value []byte) {
+			if len(value) < journalHeaderLen || !now.Before(recordRetain(value)) {
+				expired = append(expired, append([]byte(nil), key...))
+			}
+		})
+	})
+	if err == nil && len(expired) > 0 {
+		err = j.env.Update(func(txn *lmdb.Txn) error {
+			for _, key := range expired {
+				if err := txn.Del(j.dbi, key, nil); err != nil && !lmdb.IsNotFound(err) {
+					return err
+				}
+			}
+			return nil
+		})
+	}
+	if err != nil {
+		j.metrics.IncrementLMDBErrors()
+		log.Printf("Failed to sweep cache journal: %v", err)
+	}
+}
+
+func (j *Journal) clear() {
+	err := j.env.Update(func(txn *lmdb.Txn) error {
+		return txn.Drop(j.dbi, false)
+	})
+	if err != nil {
+		j.metrics.IncrementLMDBErrors()
+		log.Printf("Failed to clear cache journal: %v", err)
+	}
+}
+
+// scan sends every record still within its retention to records as a copy.
+func (j *Journal) scan(now time.Time, records chan<- journalRecord) error {
+	return j.env.View(func(txn *lmdb.Txn) error {
+		txn.RawRead = true
+		return j.each(txn, func(key, value []byte) {
+			if len(value) < journalHeaderLen || !now.Before(recordRetain(value)) {
+				return
+			}
+			records <- journalRecord{
+				key:   append([]byte(nil), key...),
+				value: append([]byte(nil), value...),
+			}
+		})
+	})
+}
+
+// each calls fn with every key and value in the journal. With RawRead they
+// alias the map and are only valid during the call.
+func (j *Journal) each(txn *lmdb.Txn, fn func(key, value []byte)) error {
+	cur, err := txn.OpenCursor(j.dbi)
+	if err != nil {
+		return err
+	}
+	defer cur.Close()
+
+	for op := uint(lmdb.First); ; op = lmdb.Next {
+		key, value, err := cur.Get(nil, nil, op)
+		if lmdb.IsNotFound(err) {
+			return nil
+		}
+		if err != nil {
+			return err
+		}
+		fn(key, value)
+	}
+}
+
+// journalRecord is a raw record read back from the journal.
+type journalRecord struct {
+	key, value []byte
+}
+
+func encodeRecord(dst []byte, item *CacheItem) []byte {
+	dst = binary.BigEndian.AppendUint64(dst, uint64(item.Stored.UnixNano()))
+	dst = binary.BigEndian.AppendUint64(dst, uint64(item.Expiration.UnixNano()))
+	dst = binary.BigEndian.AppendUint64(dst, uint64(item.retain.UnixNano()))
+	dst = binary.BigEndian.AppendUint64(dst, uint64(item.StaleWhileRevalidate))
+	return append(dst, item.Wire...)
+}
+
+func recordRetain(value []byte) time.Time {
+	return time.Unix(0, int64(binary.BigEndian.Uint64(value[16:])))
+}
+
+// decodeRecord rebuilds the cache entry for a journal record. The entry keeps
+// its original timestamps, so its TTLs carry on counting down from where they
+// were rather than starting over.
+func decodeRecord(rec journalRecord) (Key, *CacheItem, error) {
+	key, ok := keyFromBytes(rec.key)
+	if !ok || len(rec.value) < journalHeaderLen+headerLen {
+		return key, nil, errBadRecord
+	}
+
+	wire := rec.value[journalHeaderLen:]
+	offsets, err := ttlOffsets(wire)
+	if err != nil {
+		return key, nil, err
+	}
+	v := rec.value
+	return key, &CacheItem{
+		Wire:                 wire,
+		TTLOffsets:           offsets,
+		Stored:               time.Unix(0, int64(binary.BigEndian.Uint64(v))),
+		Expiration:           time.Unix(0, int64(binary.BigEndian.Uint64(v[8:]))),
+		retain:               time.Unix(0, int64(binary.BigEndian.Uint64(v[16:]))),
+		StaleWhileRevalidate: time.Duration(binary.BigEndian.Uint64(v[24:])),
+		cost:                 itemCost(wire, offsets),
+		qtype:                key.qtype(),
+	}, nil
+}
@@ -0,0 +1,285 @@
+package cache
+
+import (
+	"net"
+	"sync"
+
+	"dns-resolver/internal/dnswire"
+
+	"github.com/cespare/xxhash/v2"
+	"github.com/dgraph-io/ristretto/z"
+	"github.com/miekg/dns"
+)
+
+const (
+	keyFlagDO = 1 << iota // the client set the DNSSEC OK bit
+	keyFlagCD             // the client set Checking Disabled
+)
+
+// maxScopeLen is the longest client subnet scope in a key: family, source
+// prefix length and up to 16 address bytes.
+const maxScopeLen = 2 + 16
+
+// Key identifies a cache entry: the lowercased wire-format qname followed by the
+// query type and class, the DO and CD bits and, for answers scoped to a client
+// subnet (ECS), the subnet. Answers that differ by any of these never share an
+// entry. It is a fixed-size value, so building one on the stack and looking it up
+// doesn't allocate. A query's key is built once and used for singleflight, the
+// cache tiers and the journal alike.
+type Key struct {
+	buf     [dnswire.MaxNameLen + 4 + 1 + maxScopeLen]byte
+	n       int // length of the key in buf
+	nameLen int
+
+	// client is the subnet an ECS query was sent on behalf of. It isn't part of
+	// the key; it selects which of the scoped entries for the key may answer.
+	client clientSubnet
+}
+
+// clientSubnet is the source of an ECS option: family, prefix length and the
+// address truncated to it.
+type clientSubnet struct {
+	family uint16
+	prefix uint8
+	addr   [16]byte
+}
+
+// NewKey returns the cache key for a question asked without DO or CD. Queries
+// parsed straight off the wire get their key from KeyFromWire, unpacked ones from
+// KeyFromMsg.
+func NewKey(q dns.Question) Key {
+	var k Key
+	n, err := dns.PackDomainName(q.Name, k.buf[:dnswire.MaxNameLen], 0, nil, false)
+	if err != nil {
+		// Names that can't be packed never arrive off the wire; key them by text.
+		n = copy(k.buf[:dnswire.MaxNameLen], q.Name)
+	}
+	k.set(k.buf[:n], q.Qtype, q.Qclass)
+	return k
+}
+
+// KeyFromMsg returns the cache key for the first question of req, with its DO and
+// CD bits. If req carries an ECS option, the key also records its subnet.
+func KeyFromMsg(req *dns.Msg) Key {
+	k := NewKey(req.Question[0])
+	opt := req.IsEdns0()
+	k.setFlags(opt != nil && opt.Do(), req.CheckingDisabled)
+	if opt != nil {
+		if ecs := findECS(opt); ecs != nil {
+			k.SetClientSubnet(ecs.Family, ecs.SourceNetmask, ecs.Address)
+		}
+	}
+	return k
+}
+
+// KeyFromWire returns the cache key for a query parsed by dnswire.ParseQuery.
+func KeyFromWire(q *dnswire.Query) Key {
+	var k Key
+	k.set(q.WireName(), q.Qtype, q.Qclass)
+	k.setFlags(q.DO, q.CD)
+	return k
+}
+
+// set makes k the key for name, qtype and qclass, without flags or scope.
+func (k *Key) set(name []byte, qtype, qclass uint16) {
+	n := copy(k.buf[:], name)
+	for i, b := range k.buf[:n] {
+		// Length octets are at most 63 and so never fall in the A-Z range.
+		if b >= 'A' && b <= 'Z' {
+			k.buf[i] = b + 'a' - 'A'
+		}
+	}
+	k.buf[n], k.buf[n+1] = byte(qtype>>8), byte(qtype)
+	k.buf[n+2], k.buf[n+3] = byte(qclass>>8), byte(qclass)
+	k.buf[n+4] = 0
+	k.nameLen = n
+	k.n = n + 5
+}
+
+func (k *Key) setFlags(do, cd bool) {
+	var flags byte
+	if do {
+		flags |= keyFlagDO
+	}
+	if cd {
+		flags |= keyFlagCD
+	}
+	k.buf[k.nameLen+4] = flags
+}
+
+// SetScope scopes k to a client subnet: an ECS family (1 for IPv4, 2 for IPv6),
+// prefix length and address, which is truncated to the prefix.
+func (k *Key) SetScope(family uint16, prefix uint8, addr []byte) {
+	off := k.nameLen + 5
+	want := (int(prefix) + 7) / 8
+	n := want
+	if n > len(addr) {
+		n = len(addr)
+	}
+	if n > maxScopeLen-2 {
+		n = maxScopeLen - 2
+	}
+	k.buf[off], k.buf[off+1] = byte(family), prefix
+	copy(k.buf[off+2:], addr[:n])
+	if rem := prefix % 8; rem != 0 && n == want {
+		k.buf[off+1+n] &= 0xFF << (8 - rem)
+	}
+	k.n = off + 2 + n
+}
+
+// SetClientSubnet records the ECS source subnet the query is for, so that
+// lookups can find answers scoped to it. A prefix of zero means none.
+func (k *Key) SetClientSubnet(family uint16, prefix uint8, addr net.IP) {
+	if family == ecsFamilyIPv4 {
+		addr = addr.To4()
+	} else {
+		addr = addr.To16()
+	}
+	if bits := uint8(len(addr) * 8); prefix > bits {
+		prefix = bits
+	}
+	k.client = clientSubnet{family: family, prefix: prefix}
+	copy(k.client.addr[:], addr)
+}
+
+// scoped reports whether k is the key of an answer scoped to a client subnet.
+func (k *Key) scoped() bool {
+	return k.n > k.nameLen+5
+}
+
+// scope returns the ECS family and scope prefix length of a scoped key.
+func (k *Key) scope() (uint16, uint8) {
+	return uint16(k.buf[k.nameLen+5]), k.buf[k.nameLen+6]
+}
+
+// withScope returns the key of the answer for k's client subnet with the
+// given scope prefix length.
+func (k *Key) withScope(prefix uint8) Key {
+	other := *k
+	other.SetScope(k.client.family, prefix, k.client.addr[:])
+	return other
+}
+
+// unscoped returns k without its scope.
+func (k *Key) unscoped() Key {
+	other := *k
+	other.n = k.nameLen + 5
+	return other
+}
+
+// name returns the wire-format name part of the key.
+func (k *Key) name() []byte {
+	return k.buf[:k.nameLen]
+}
+
+func (k *Key) qtype() uint16 {
+	return uint16(k.buf[k.nameLen])<<8 | uint16(k.buf[k.nameLen+1])
+}
+
+func (k *Key) qclass() uint16 {
+	return uint16(k.buf[k.nameLen+2])<<8 | uint16(k.buf[k.nameLen+3])
+}
+
+// DO reports whether the key is for a query with the DNSSEC OK bit set.
+func (k *Key) DO() bool {
+	return k.buf[k.nameLen+4]&keyFlagDO != 0
+}
+
+// CD reports whether the key is for a query with Checking Disabled set.
+func (k *Key) CD() bool {
+	return k.buf[k.nameLen+4]&keyFlagCD != 0
+}
+
+// derive returns the key for name and qtype with k's class, flags and scope.
+func (k *Key) derive(name []byte, qtype uint16) Key {
+	var other Key
+	other.set(name, qtype, k.qclass())
+	other.n += copy(other.buf[other.n-1:], k.buf[k.nameLen+4:k.n]) - 1
+	return other
+}
+
+// nxdomainKey returns the key under which an NXDOMAIN for k's name is kept for
+// answering other questions at or below the name. Type 0 is reserved, so it never
+// collides with a real question.
+func (k *Key) nxdomainKey() Key {
+	return k.derive(k.name(), 0)
+}
+
+// rrsetKey returns the key of the RRset of type rrtype at k's name. An RRset is
+// the same whoever asked, so the key has no flags or scope.
+func (k *Key) rrsetKey(rrtype uint16) Key {
+	var other Key
+	other.set(k.name(), rrtype, k.qclass())
+	return other
+}
+
+// Question returns the question the key was made from, with a lowercased name.
+func (k *Key) Question() dns.Question {
+	name, _, err := dns.UnpackDomainName(k.name(), 0)
+	if err != nil {
+		// NewKey fell back to the name as text.
+		name = string(k.name())
+	}
+	return dns.Question{Name: name, Qtype: k.qtype(), Qclass: k.qclass()}
+}
+
+// Bytes returns the key's encoding. It aliases k.
+func (k *Key) Bytes() []byte {
+	return k.buf[:k.n]
+}
+
+// keyFromBytes is the inverse of Bytes.
+func keyFromBytes(b []byte) (Key, bool) {
+	var k Key
+	if len(b) > len(k.buf) {
+		return k, false
+	}
+	off := 0
+	for off < len(b) && b[off] != 0 {
+		off += int(b[off]) + 1
+	}
+	if off+1+5 > len(b) {
+		return k, false
+	}
+	k.n = copy(k.buf[:], b)
+	k.nameLen = off + 1
+	return k, true
+}
+
+// String returns the key as a string, for singleflight groups and logs. Keys
+// of ECS queries include the client subnet, so that only queries from the
+// same subnet share a lookup. Unlike the rest of Key it allocates.
+func (k *Key) String() string {
+	if k.client.prefix > 0 {
+		scoped := k.withScope(k.client.prefix)
+		return string(scoped.Bytes())
+	}
+	return string(k.buf[:k.n])
+}
+
+// keyHash is what the cache hands Ristretto in place of a key. Ristretto takes keys
+// as interface{} and only ever hashes them; boxing a string or a Key would allocate
+// on every lookup, a pooled pointer doesn't.
+type keyHash struct {
+	key, conflict uint64
+}
+
+var keyHashPool = sync.Pool{
+	New: func() interface{} {
+		return new(keyHash)
+	},
+}
+
+func (k *Key) hash() *keyHash {
+	h := keyHashPool.Get().(*keyHash)
+	h.key, h.conflict = z.MemHash(k.Bytes()), xxhash.Sum64(k.Bytes())
+	return h
+}
+
+// keyToHash is the cache's Ristretto KeyToHash.
+func keyToHash(key interface{}) (uint64, uint64) {
+	if h, ok := key.(*keyHash); ok {
+		return h.key, h.conflict
+	}
+	return z.KeyToHash(key)
+}
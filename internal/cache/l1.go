@@ -0,0 +1,91 @@
+package cache
+
+import (
+	"bytes"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"github.com/dgraph-io/ristretto/z"
+)
+
+// l1Cache is a small direct-mapped cache of the hottest entries in front of
+// Ristretto. A hit is an atomic pointer load and a key compare: it takes no
+// lock and, unlike a Ristretto Get, writes nothing that other cores read, so
+// the handful of names that make up most of the traffic scale with cores.
+// Entries are immutable; replacing one swaps the slot's pointer.
+type l1Cache struct {
+	slots [l1Slots]atomic.Pointer[l1Entry]
+	hits  [l1Stripes]paddedCounter
+}
+
+type l1Entry struct {
+	key  Key
+	item *CacheItem
+}
+
+// paddedCounter is a counter alone on its cache line, so that cores
+// incrementing neighbouring counters don't contend.
+type paddedCounter struct {
+	n atomic.Uint64
+	_ [56]byte
+}
+
+// hitStripe picks a hit counter for the calling goroutine from the address of a
+// local variable, as the metrics counters do. Striping by slot would put every
+// core serving the same hot name on one counter.
+func hitStripe() uint64 {
+	var local byte
+	p := uint64(uintptr(unsafe.Pointer(&local)))
+	return (p >> 12) * 0x9E3779B97F4A7C15 >> (64 - l1StripeBits)
+}
+
+func l1Slot(key *Key) uint64 {
+	return z.MemHash(key.Bytes()) & (l1Slots - 1)
+}
+
+// get returns the fresh item cached for key, or nil.
+func (l *l1Cache) get(key *Key, now time.Time) *CacheItem {
+	slot := l1Slot(key)
+	e := l.slots[slot].Load()
+	if e == nil || !bytes.Equal(e.key.Bytes(), key.Bytes()) || !now.Before(e.item.Expiration) {
+		return nil
+	}
+	l.hits[hitStripe()].n.Add(1)
+	return e.item
+}
+
+// promote caches item for key, unless its slot holds a live entry that has
+// been hit more often.
+func (l *l1Cache) promote(key *Key, item *CacheItem, now time.Time) {
+	slot := &l.slots[l1Slot(key)]
+	old := slot.Load()
+	if old != nil && now.Before(old.item.Expiration) && old.item.hits.Load() >= item.hits.Load() {
+		return
+	}
+	slot.CompareAndSwap(old, &l1Entry{key: *key, item: item})
+}
+
+// replace swaps in item for key if key is cached, so that L1 never serves an
+// entry L2 has replaced.
+func (l *l1Cache) replace(key *Key, item *CacheItem) {
+	slot := &l.slots[l1Slot(key)]
+	old := slot.Load()
+	if old == nil || !bytes.Equal(old.key.Bytes(), key.Bytes()) {
+		return
+	}
+	if item == nil {
+		slot.CompareAndSwap(old, nil)
+		return
+	}
+	slot.CompareAndSwap(old, &l1Entry{key: *key, item: item})
+}
+
+// hitCount returns the number of hits served.
+func (l *l1Cache) hitCount() uint64 {
+	var n uint64
+	for i := range l.hits {
+		n += l.hits[i].n.Load()
+	}
+	return n
+}
@@ -0,0 +1,53 @@
+package cache
+
+import (
+	"github.com/miekg/dns"
+)
+
+// isNegative reports whether msg is a negative answer: NXDOMAIN, or NODATA
+// (NOERROR with an empty answer section).
+func isNegative(msg *dns.Msg) bool {
+	return msg.Rcode == dns.RcodeNameError || (msg.Rcode == dns.RcodeSuccess && len(msg.Answer) == 0)
+}
+
+// negativeTTL returns how long a negative answer may be cached: the lesser of the
+// TTL of the SOA in its authority section and the SOA's MINIMUM field (RFC 2308,
+// section 5). Negative answers without an SOA must not be cached.
+func negativeTTL(msg *dns.Msg) (uint32, bool) {
+	for _, rr := range msg.Ns {
+		if soa, ok := rr.(*dns.SOA); ok {
+			if soa.Hdr.Ttl < soa.Minttl {
+				return soa.Hdr.Ttl, true
+			}
+			return soa.Minttl, true
+		}
+	}
+	return 0, false
+}
+
+// nxdomainCut returns a fresh cached NXDOMAIN for key's name or one of its
+// ancestors. A name that doesn't exist has no descendants either (RFC 8020), so
+// such an answer holds for every question at or below it.
+func (c *Cache) nxdomainCut(key *Key) *CacheItem {
+	name := key.name()
+	for off := 0; off < len(name) && name[off] != 0; off += int(name[off]) + 1 {
+		cutKey := key.derive(name[off:], 0)
+		if item, found, stale := c.find(&cutKey); found && !stale {
+			return item
+		}
+	}
+	return nil
+}
+
+// questionFor returns the question key was built from. qname is the client's
+// wire-format question name, if known, so that answers echo its letter case.
+func questionFor(key *Key, qname []byte) dns.Question {
+	if qname == nil {
+		qname = key.name()
+	}
+	name, _, err := dns.UnpackDomainName(qname, 0)
+	if err != nil {
+		name = "."
+	}
+	return dns.Question{Name: name, Qtype: key.qtype(), Qclass: key.qclass()}
+}
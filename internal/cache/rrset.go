@@ -0,0 +1,213 @@
+package cache
+
+import (
+	"fmt"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/dgraph-io/ristretto"
+	"github.com/miekg/dns"
+)
+
+// rrsetCache is the second cache tier. It holds the RRsets of positive answers
+// keyed by owner name, type and class, so that a CNAME or an address learned
+// answering one question can answer another, and is budgeted in bytes like the
+// message tier.
+type rrsetCache struct {
+	cache   *ristretto.Cache
+	metrics *metrics.Metrics
+	maxTTL  time.Duration
+}
+
+// rrset is a cached RRset together with the RRSIGs covering it.
+type rrset struct {
+	rrs     []dns.RR // TTLs as received
+	sigs    []dns.RR
+	stored  time.Time
+	expires time.Time
+	secure  bool // the answer it came from was DNSSEC-validated
+	cost    int64
+}
+
+func newRRsetCache(maxBytes int64, maxTTL time.Duration, m *metrics.Metrics) (*rrsetCache, error) {
+	r := &rrsetCache{metrics: m, maxTTL: maxTTL}
+	cache, err := ristretto.NewCache(&ristretto.Config{
+		NumCounters:        maxBytes / averageItemCost * 10,
+		MaxCost:            maxBytes,
+		BufferItems:        64,
+		KeyToHash:          keyToHash,
+		IgnoreInternalCost: true,
+		OnExit: func(value interface{}) {
+			if set, ok := value.(*rrset); ok {
+				m.AddRRsetCacheBytes(-set.cost)
+			}
+		},
+	})
+	if err != nil {
+		return nil, fmt.Errorf("failed to create ristretto rrset cache: %w", err)
+	}
+	r.cache = cache
+	return r, nil
+}
+
+func (r *rrsetCache) close() {
+	r.cache.Close()
+}
+
+// add caches the RRsets in the answer section of a positive response.
+func (r *rrsetCache) add(msg *dns.Msg, now time.Time) {
+	type setKey struct {
+		name   string
+		rrtype uint16
+		class  uint16
+	}
+	var order []setKey
+	sets := make(map[setKey]*rrset)
+	setFor := func(k setKey) *rrset {
+		set, ok := sets[k]
+		if !ok {
+			set = &rrset{stored: now, secure: msg.AuthenticatedData}
+			sets[k] = set
+			order = append(order, k)
+		}
+		return set
+	}
+
+	for _, rr := range msg.Answer {
+		h := rr.Header()
+		if sig, ok := rr.(*dns.RRSIG); ok {
+			set := setFor(setKey{dns.CanonicalName(h.Name), sig.TypeCovered, h.Class})
+			set.sigs = append(set.sigs, dns.Copy(rr))
+			continue
+		}
+		set := setFor(setKey{dns.CanonicalName(h.Name), h.Rrtype, h.Class})
+		set.rrs = append(set.rrs, dns.Copy(rr))
+	}
+
+	for _, k := range order {
+		set := sets[k]
+		if len(set.rrs) == 0 {
+			continue // signatures without their set
+		}
+		ttl := set.rrs[0].Header().Ttl
+		set.cost = itemOverhead
+		for _, rrs := range [][]dns.RR{set.rrs, set.sigs} {
+			for _, rr := range rrs {
+				if rr.Header().Ttl < ttl {
+					ttl = rr.Header().Ttl
+				}
+				set.cost += int64(dns.Len(rr)) + rrOverhead
+			}
+		}
+		if ttl == 0 {
+			continue
+		}
+		lifetime := time.Duration(ttl) * time.Second
+		if lifetime > r.maxTTL {
+			lifetime = r.maxTTL
+		}
+		set.expires = now.Add(lifetime)
+
+		key := NewKey(dns.Question{Name: k.name, Qtype: k.rrtype, Qclass: k.class})
+		h := key.hash()
+		r.metrics.AddRRsetCacheBytes(set.cost)
+		if !r.cache.SetWithTTL(h, set, set.cost, lifetime) {
+			r.metrics.AddRRsetCacheBytes(-set.cost)
+		}
+		keyHashPool.Put(h)
+	}
+}
+
+// get returns the unexpired RRset for key.
+func (r *rrsetCache) get(key *Key, now time.Time) *rrset {
+	h := key.hash()
+	value, found := r.cache.Get(h)
+	keyHashPool.Put(h)
+	if !found {
+		return nil
+	}
+	set, ok := value.(*rrset)
+	if !ok || !now.Before(set.expires) {
+		return nil
+	}
+	return set
+}
+
+// appendTo appends copies of the set, and of its signatures if withSigs is set,
+// to dst, aged by the time the set has been cached.
+func (set *rrset) appendTo(dst []dns.RR, now time.Time, withSigs bool) []dns.RR {
+	age := uint32(now.Sub(set.stored) / time.Second)
+	sets := [][]dns.RR{set.rrs, set.sigs}
+	if !withSigs {
+		sets = sets[:1]
+	}
+	for _, rrs := range sets {
+		for _, rr := range rrs {
+			rr = dns.Copy(rr)
+			if h := rr.Header(); h.Ttl > age {
+				h.Ttl -= age
+			} else {
+				h.Ttl = 0
+			}
+			dst = append(dst, rr)
+		}
+	}
+	return dst
+}
+
+// compose builds a positive answer for key from cached RRsets, following a
+// CNAME chain of up to maxCNAMEChain links. Every link and the final RRset must
+// be cached; otherwise it returns nil. qname is the client's wire-format
+// question name, if known. Signatures are only included for DO queries.
+func (r *rrsetCache) compose(key *Key, qname []byte, now time.Time) *dns.Msg {
+	qtype := key.qtype()
+	if qtype == dns.TypeANY || qtype == dns.TypeRRSIG || qtype == 0 {
+		return nil
+	}
+
+	var answer []dns.RR
+	secure := true
+	do := key.DO()
+	// Sets taken from answers to non-DO queries had their signatures stripped;
+	// a DO client must not be told they are secure without them.
+	get := func(k *Key) *rrset {
+		set := r.get(k, now)
+		if set != nil && do && set.secure && len(set.sigs) == 0 {
+			return nil
+		}
+		return set
+	}
+	cur := key.rrsetKey(qtype)
+	for links := 0; ; links++ {
+		if set := get(&cur); set != nil {
+			answer = set.appendTo(answer, now, do)
+			secure = secure && set.secure
+			break
+		}
+		if qtype == dns.TypeCNAME || links == maxCNAMEChain {
+			return nil
+		}
+		cnameKey := cur.rrsetKey(dns.TypeCNAME)
+		set := get(&cnameKey)
+		if set == nil {
+			return nil
+		}
+		cname, ok := set.rrs[0].(*dns.CNAME)
+		if !ok {
+			return nil
+		}
+		answer = set.appendTo(answer, now, do)
+		secure = secure && set.secure
+		cur = NewKey(dns.Question{Name: cname.Target, Qtype: qtype, Qclass: key.qclass()})
+	}
+
+	msg := new(dns.Msg)
+	msg.Response = true
+	msg.RecursionDesired = true
+	msg.RecursionAvailable = true
+	msg.AuthenticatedData = secure
+	msg.Question = []dns.Question{questionFor(key, qname)}
+	msg.Answer = answer
+	return msg
+}
@@ -0,0 +1,109 @@
+package cache
+
+import (
+	"encoding/binary"
+	"errors"
+
+	"github.com/miekg/dns"
+)
+
+const headerLen = 12
+
+var (
+	errShortMessage = errors.New("dns message truncated")
+	errBadLabel     = errors.New("invalid label type in dns message")
+)
+
+// ttlOffsets walks a packed message and returns the offset of the TTL field of
+// every resource record except OPT, whose TTL field carries EDNS flags instead.
+func ttlOffsets(msg []byte) ([]uint16, error) {
+	if len(msg) < headerLen {
+		return nil, errShortMessage
+	}
+	qdcount := int(binary.BigEndian.Uint16(msg[4:]))
+	rrcount := int(binary.BigEndian.Uint16(msg[6:])) +
+		int(binary.BigEndian.Uint16(msg[8:])) +
+		int(binary.BigEndian.Uint16(msg[10:]))
+
+	off := headerLen
+	var err error
+	for i := 0; i < qdcount; i++ {
+		if off, err = skipName(msg, off); err != nil {
+			return nil, err
+		}
+		off += 4 // qtype, qclass
+		if off > len(msg) {
+			return nil, errShortMessage
+		}
+	}
+
+	offsets := make([]uint16, 0, rrcount)
+	for i := 0; i < rrcount; i++ {
+		if off, err = skipName(msg, off); err != nil {
+			return nil, err
+		}
+		// type(2) class(2) ttl(4) rdlength(2)
+		if off+10 > len(msg) {
+			return nil, errShortMessage
+		}
+		if binary.BigEndian.Uint16(msg[off:]) != dns.TypeOPT {
+			offsets = append(offsets, uint16(off+4))
+		}
+		off += 10 + int(binary.BigEndian.Uint16(msg[off+8:]))
+		if off > len(msg) {
+			return nil, errShortMessage
+		}
+	}
+	return offsets, nil
+}
+
+// skipName returns the offset just past the (possibly compressed) name at off.
+func skipName(msg []byte, off int) (int, error) {
+	for {
+		if off >= len(msg) {
+			return 0, errShortMessage
+		}
+		c := int(msg[off])
+		switch c & 0xC0 {
+		case 0x00:
+			if c == 0 {
+				return off + 1, nil
+			}
+			off += c + 1
+		case 0xC0:
+			if off+2 > len(msg) {
+				return 0, errShortMessage
+			}
+			return off + 2, nil
+		default:
+			return 0, errBadLabel
+		}
+	}
+}
+
+// isNXDomainWire reports whether a packed response is an NXDOMAIN without
+// answer records.
+func isNXDomainWire(msg []byte) bool {
+	return len(msg) >= headerLen && msg[3]&0x0F == dns.RcodeNameError && binary.BigEndian.Uint16(msg[6:]) == 0
+}
+
+// patchWire sets the message ID of a copied cached response and ages each TTL by age seconds.
+func patchWire(wire []byte, offsets []uint16, id uint16, age uint32) {
+	binary.BigEndian.PutUint16(wire, id)
+	for _, off := range offsets {
+		ttl := binary.BigEndian.Uint32(wire[off:])
+		if ttl > age {
+			ttl -= age
+		} else {
+			ttl = 0
+		}
+		binary.BigEndian.PutUint32(wire[off:], ttl)
+	}
+}
+
+// setWireTTLs sets every TTL of a copied cached response to ttl.
+func setWireTTLs(wire []byte, offsets []uint16, ttl uint32) {
+	for _, off := range offsets {
+		binary.BigEndian.PutUint32(wire[off:], ttl)
+	}
+}
@@ -9,21 +9,47 @@ import (
 // Config holds the configuration for the DNS resolver.
 type Config struct {
 	ListenAddr           string
+	ListenerSockets      int  // SO_REUSEPORT sockets per protocol; 0 means GOMAXPROCS
+	ListenerCPUAffinity  bool // pin each socket's read loop to its own CPU
+	UDPBatchSize         int  // packets per recvmmsg/sendmmsg call; 0 or 1 disables batching
 	MetricsAddr          string
 	PrometheusEnabled    bool
 	PrometheusNamespace  string
 	UpstreamTimeout      time.Duration
 	RequestTimeout       time.Duration
-	MaxWorkers           int
-	CacheSize            int
-	MessageCacheSize     int
-	RRsetCacheSize       int
+	MaxWorkers           int   // background refresh workers
+	RefreshQueueSize     int   // revalidations and prefetches waiting for a worker
+	MessageCacheBytes    int64 // memory budget of the whole-message cache in bytes
+	RRsetCacheBytes      int64 // memory budget of the RRset cache in bytes
 	CacheMaxTTL          time.Duration
 	CacheMinTTL          time.Duration
 	StaleWhileRevalidate time.Duration
+	ServeStaleMax        time.Duration // how long past expiry entries may answer when the upstream fails; 0 disables
+	ServeStaleTTL        time.Duration // TTL of answers served stale
+	PrefetchMinHits      uint32        // hits after which an entry is refreshed before it expires; 0 disables
+	ECSEnabled           bool          // forward EDNS Client Subnet and partition the cache by its scope
+	ECSIPv4Prefix        uint8         // longest IPv4 source prefix sent upstream
+	ECSIPv6Prefix        uint8         // longest IPv6 source prefix sent upstream
+	ECSForwarders        []string      // upstreams (host:port) that ECS queries are forwarded to
+	ECSZones             []string      // domains whose names are sent with the client's own address when it sent no ECS
 	LMDBPath             string
-	ResolverType         string // "unbound" or "knot"
-	ServerRole           string // "master", "slave", or "standalone"
+	LogLevel             string              // least severe query-path message logged: debug, info, warn or error
+	LogBufferSize        int                 // messages queued for the log writer before new ones are dropped
+	LogRateLimit         int                 // messages per second per log category; 0 is unlimited
+	LogSampling          map[string]int      // log category -> keep one message in N
+	DnstapSocket         string              // unix socket of a dnstap reader to log client queries and responses to
+	DnstapFile           string              // file to log them to instead, if there is no socket
+	DnstapMaxFileSize    int64               // size at which the dnstap file is rotated; 0 never rotates
+	DnstapQueueSize      int                 // dnstap frames waiting to be written before new ones are dropped
+	DnstapIdentity       string              // server identity in dnstap messages; defaults to the hostname
+	ResolverType         string              // "unbound" to recurse or "forward" to forward to upstreams; "knot" is taken as "unbound"
+	ForwardUpstreams     []string            // upstreams of the "forward" resolver: host:port (UDP, TCP when truncated), tcp://host:port or tls://host:port
+	ForwardRules         map[string][]string // domain -> upstreams that names under it are forwarded to instead
+	ForwardConns         int                 // persistent connections per upstream for TCP and DoT
+	UnboundContexts      int                 // independent libunbound contexts lookups are sharded over; 0 means GOMAXPROCS
+	UnboundMsgCache      int64               // message cache budget in bytes, split between the libunbound contexts
+	UnboundRRsetCache    int64               // RRset cache budget in bytes, split between the libunbound contexts
+	ServerRole           string              // "master", "slave", or "standalone"
 	MasterAPIEndpoint    string
 	SyncInterval         time.Duration
 	DoTAddr              string
@@ -37,37 +63,60 @@ func NewConfig() *Config {
 	cfg, err := LoadConfig("config.json")
 	if err != nil {
 		// If config doesn't exist or is invalid, create a default one and save it.
-		defaultCfg := &Config{
-			ListenAddr:           "0.0.0.0:5053",
-			MetricsAddr:          "0.0.0.0:9090",
-			PrometheusEnabled:    false,
-			PrometheusNamespace:  "dns_resolver",
-			UpstreamTimeout:      5 * time.Second,
-			RequestTimeout:       5 * time.Second,
-			MaxWorkers:           10,
-			CacheSize:            5000,
-			MessageCacheSize:     5000,
-			RRsetCacheSize:       5000,
-			CacheMaxTTL:          3600 * time.Second,
-			CacheMinTTL:          60 * time.Second,
-			StaleWhileRevalidate: 1 * time.Minute,
-			LMDBPath:             "/tmp/dns_cache.lmdb",
-			ResolverType:         "knot",
-			ServerRole:           "master",
-			MasterAPIEndpoint:    "http://localhost:8080/api/v1/zones",
-			SyncInterval:         1 * time.Minute,
-			DoTAddr:              "0.0.0.0:853",
-			DoHAddr:              "0.0.0.0:443",
-			CertFile:             "cert.pem",
-			KeyFile:              "key.pem",
-		}
+		defaultCfg := DefaultConfig()
 		defaultCfg.Save("config.json")
 		return defaultCfg
 	}
 	return cfg
 }
 
-// LoadConfig loads configuration from a file.
+// DefaultConfig returns the default configuration.
+func DefaultConfig() *Config {
+	return &Config{
+		ListenAddr:           "0.0.0.0:5053",
+		ListenerSockets:      0,
+		ListenerCPUAffinity:  false,
+		UDPBatchSize:         64,
+		MetricsAddr:          "0.0.0.0:9090",
+		PrometheusEnabled:    false,
+		PrometheusNamespace:  "dns_resolver",
+		UpstreamTimeout:      5 * time.Second,
+		RequestTimeout:       5 * time.Second,
+		MaxWorkers:           10,
+		RefreshQueueSize:     1024,
+		MessageCacheBytes:    64 << 20,
+		RRsetCacheBytes:      32 << 20,
+		CacheMaxTTL:          3600 * time.Second,
+		CacheMinTTL:          60 * time.Second,
+		StaleWhileRevalidate: 1 * time.Minute,
+		ServeStaleMax:        24 * time.Hour,
+		ServeStaleTTL:        30 * time.Second,
+		PrefetchMinHits:      3,
+		ECSEnabled:           false,
+		ECSIPv4Prefix:        24,
+		ECSIPv6Prefix:        56,
+		LMDBPath:             "/tmp/dns_cache.lmdb",
+		LogLevel:             "info",
+		LogBufferSize:        8192,
+		LogRateLimit:         1000,
+		DnstapMaxFileSize:    256 << 20,
+		DnstapQueueSize:      4096,
+		ResolverType:         "knot",
+		UnboundMsgCache:      16 << 20,
+		UnboundRRsetCache:    32 << 20,
+		ForwardConns:         2,
+		ServerRole:           "master",
+		MasterAPIEndpoint:    "http://localhost:8080/api/v1/zones",
+		SyncInterval:         1 * time.Minute,
+		DoTAddr:              "0.0.0.0:853",
+		DoHAddr:              "0.0.0.0:443",
+		CertFile:             "cert.pem",
+		KeyFile:              "key.pem",
+	}
+}
+
+// LoadConfig loads configuration from a file. Settings the file doesn't have,
+// as when it was saved by an older version, keep their defaults.
 func LoadConfig(path string) (*Config, error) {
 	file, err := os.Open(path)
 	if err != nil {
@@ -75,7 +124,7 @@ func LoadConfig(path string) (*Config, error) {
 	}
 	defer file.Close()
 	decoder := json.NewDecoder(file)
-	cfg := &Config{}
+	cfg := DefaultConfig()
 	err = decoder.Decode(cfg)
 	if err != nil {
 		return nil, err
@@ -0,0 +1,181 @@
+// Package dnswire parses the parts of DNS messages the hot path needs straight
+// from the wire, without unpacking them into a dns.Msg.
+package dnswire
+
+import "encoding/binary"
+
+const (
+	// HeaderLen is the length of the fixed DNS message header.
+	HeaderLen = 12
+	// MaxNameLen is the maximum length of a domain name in wire format.
+	MaxNameLen = 255
+	// MaxPresentationLen bounds a name in presentation format, every byte escaped as \DDD.
+	MaxPresentationLen = 4 * MaxNameLen
+
+	typeOPT = 41
+
+	optionECS = 8 // EDNS Client Subnet (RFC 7871)
+)
+
+// Query holds what the fast path needs from a plain query: one question and at
+// most an OPT record. It is meant to live on the stack.
+type Query struct {
+	ID     uint16
+	RD     bool
+	CD     bool
+	Qtype  uint16
+	Qclass uint16
+
+	EDNS    bool
+	UDPSize uint16
+	DO      bool
+	ECS     bool // the OPT record has a client subnet option
+
+	name    [MaxNameLen]byte // lowercased wire-format qname
+	nameLen int
+}
+
+// ParseQuery fills q from msg and reports whether msg is a plain query the fast
+// path can serve: opcode QUERY, one uncompressed question, no answer or authority
+// records and at most a single OPT record in the additional section.
+func ParseQuery(msg []byte, q *Query) bool {
+	if len(msg) < HeaderLen {
+		return false
+	}
+	flags := binary.BigEndian.Uint16(msg[2:])
+	if flags&0x8000 != 0 || (flags>>11)&0xF != 0 { // QR set or opcode != QUERY
+		return false
+	}
+	if binary.BigEndian.Uint16(msg[4:]) != 1 ||
+		binary.BigEndian.Uint16(msg[6:]) != 0 ||
+		binary.BigEndian.Uint16(msg[8:]) != 0 {
+		return false
+	}
+	arcount := binary.BigEndian.Uint16(msg[10:])
+	if arcount > 1 {
+		return false
+	}
+
+	q.ID = binary.BigEndian.Uint16(msg)
+	q.RD = flags&0x0100 != 0
+	q.CD = flags&0x0010 != 0
+
+	off := HeaderLen
+	n := 0
+	for {
+		if off >= len(msg) {
+			return false
+		}
+		c := int(msg[off])
+		if c&0xC0 != 0 { // compression pointers have no place in a question
+			return false
+		}
+		if n+c+1 > MaxNameLen || off+c+1 > len(msg) {
+			return false
+		}
+		q.name[n] = byte(c)
+		for i := 1; i <= c; i++ {
+			b := msg[off+i]
+			if b >= 'A' && b <= 'Z' {
+				b += 'a' - 'A'
+			}
+			q.name[n+i] = b
+		}
+		n += c + 1
+		off += c + 1
+		if c == 0 {
+			break
+		}
+	}
+	q.nameLen = n
+
+	if off+4 > len(msg) {
+		return false
+	}
+	q.Qtype = binary.BigEndian.Uint16(msg[off:])
+	q.Qclass = binary.BigEndian.Uint16(msg[off+2:])
+	off += 4
+
+	q.EDNS, q.UDPSize, q.DO, q.ECS = false, 0, false, false
+	if arcount == 1 {
+		// OPT: root name, type, class (UDP size), TTL (ext-rcode, version, flags), rdlength.
+		if off+11 > len(msg) || msg[off] != 0 || binary.BigEndian.Uint16(msg[off+1:]) != typeOPT {
+			return false
+		}
+		q.EDNS = true
+		q.UDPSize = binary.BigEndian.Uint16(msg[off+3:])
+		q.DO = msg[off+7]&0x80 != 0
+		end := off + 11 + int(binary.BigEndian.Uint16(msg[off+9:]))
+		if end > len(msg) {
+			return false
+		}
+		q.ECS = hasOption(msg[off+11:end], optionECS)
+		off = end
+	}
+	return off <= len(msg)
+}
+
+// hasOption reports whether the OPT RDATA rdata contains an option with code.
+func hasOption(rdata []byte, code uint16) bool {
+	for len(rdata) >= 4 {
+		if binary.BigEndian.Uint16(rdata) == code {
+			return true
+		}
+		n := 4 + int(binary.BigEndian.Uint16(rdata[2:]))
+		if n > len(rdata) {
+			return false
+		}
+		rdata = rdata[n:]
+	}
+	return false
+}
+
+// WireName returns the lowercased qname in wire format.
+func (q *Query) WireName() []byte {
+	return q.name[:q.nameLen]
+}
+
+// QuestionName returns the qname exactly as the client sent it in msg, the
+// packet q was parsed from.
+func (q *Query) QuestionName(msg []byte) []byte {
+	return msg[HeaderLen : HeaderLen+q.nameLen]
+}
+
+// AppendName appends the lowercased qname in presentation format to dst, escaped
+// the same way github.com/miekg/dns escapes names it unpacks.
+func (q *Query) AppendName(dst []byte) []byte {
+	name := q.WireName()
+	if len(name) <= 1 {
+		return append(dst, '.')
+	}
+	for off := 0; name[off] != 0; {
+		c := int(name[off])
+		for _, b := range name[off+1 : off+1+c] {
+			switch {
+			case isSpecial(b):
+				dst = append(dst, '\\', b)
+			case b < ' ' || b > '~':
+				dst = append(dst, '\\', '0'+b/100, '0'+b/10%10, '0'+b%10)
+			default:
+				dst = append(dst, b)
+			}
+		}
+		dst = append(dst, '.')
+		off += c + 1
+	}
+	return dst
+}
+
+// NameString returns the lowercased qname in presentation format.
+func (q *Query) NameString() string {
+	var buf [MaxPresentationLen]byte
+	return string(q.AppendName(buf[:0]))
+}
+
+func isSpecial(b byte) bool {
+	switch b {
+	case '.', ' ', '\'', '@', ';', '(', ')', '"', '\\':
+		return true
+	}
+	return false
+}
@@ -0,0 +1,108 @@
+package dnswire
+
+import (
+	"strings"
+	"testing"
+
+	"github.com/miekg/dns"
+	"github.com/stretchr/testify/assert"
+)
+
+func packQuery(t *testing.T, m *dns.Msg) []byte {
+	t.Helper()
+	wire, err := m.Pack()
+	assert.NoError(t, err)
+	return wire
+}
+
+func TestParseQuery(t *testing.T) {
+	m := new(dns.Msg)
+	m.SetQuestion("WwW.Example.COM.", dns.TypeAAAA)
+	m.Id = 0xBEEF
+	m.CheckingDisabled = true
+	m.SetEdns0(1232, true)
+	wire := packQuery(t, m)
+
+	var q Query
+	assert.True(t, ParseQuery(wire, &q))
+	assert.Equal(t, uint16(0xBEEF), q.ID)
+	assert.True(t, q.RD)
+	assert.True(t, q.CD)
+	assert.Equal(t, dns.TypeAAAA, q.Qtype)
+	assert.Equal(t, uint16(dns.ClassINET), q.Qclass)
+	assert.True(t, q.EDNS)
+	assert.Equal(t, uint16(1232), q.UDPSize)
+	assert.True(t, q.DO)
+	assert.Equal(t, "www.example.com.", q.NameString())
+
+	// The question name is echoed with the client's original case.
+	assert.Equal(t, []byte("\x03WwW\x07Example\x03COM\x00"), q.QuestionName(wire))
+	assert.Equal(t, []byte("\x03www\x07example\x03com\x00"), q.WireName())
+}
+
+func TestParseQueryECS(t *testing.T) {
+	m := new(dns.Msg)
+	m.SetQuestion("example.com.", dns.TypeA)
+	m.SetEdns0(1232, false)
+	wire := packQuery(t, m)
+
+	var q Query
+	assert.True(t, ParseQuery(wire, &q))
+	assert.False(t, q.ECS)
+
+	opt := m.IsEdns0()
+	opt.Option = append(opt.Option, &dns.EDNS0_COOKIE{Code: dns.EDNS0COOKIE, Cookie: "0123456789abcdef"})
+	opt.Option = append(opt.Option, &dns.EDNS0_SUBNET{Code: dns.EDNS0SUBNET, Family: 1, SourceNetmask: 24, Address: []byte{192, 0, 2, 0}})
+	wire = packQuery(t, m)
+	assert.True(t, ParseQuery(wire, &q))
+	assert.True(t, q.ECS)
+}
+
+func TestParseQueryNameEscaping(t *testing.T) {
+	for _, name := range []string{".", "a\\.b.example.", "x\\032y.example.", "\\255\\000.", "Under_Score.Example."} {
+		m := new(dns.Msg)
+		m.SetQuestion(name, dns.TypeA)
+		wire := packQuery(t, m)
+
+		var q Query
+		assert.True(t, ParseQuery(wire, &q), name)
+		assert.Equal(t, strings.ToLower(name), q.NameString(), name)
+	}
+}
+
+func TestParseQueryRejects(t *testing.T) {
+	base := new(dns.Msg)
+	base.SetQuestion("example.com.", dns.TypeA)
+
+	response := base.Copy()
+	response.Response = true
+
+	notify := base.Copy()
+	notify.Opcode = dns.OpcodeNotify
+
+	twoQuestions := base.Copy()
+	twoQuestions.Question = append(twoQuestions.Question, dns.Question{Name: "example.org.", Qtype: dns.TypeA, Qclass: dns.ClassINET})
+
+	withAnswer := base.Copy()
+	rr, _ := dns.NewRR("example.com. 60 IN A 192.0.2.1")
+	withAnswer.Answer = append(withAnswer.Answer, rr)
+
+	nonOPT := base.Copy()
+	nonOPT.Extra = append(nonOPT.Extra, rr)
+
+	for name, m := range map[string]*dns.Msg{
+		"response":      response,
+		"opcode":        notify,
+		"two questions": twoQuestions,
+		"answer":        withAnswer,
+		"non-OPT extra": nonOPT,
+	} {
+		var q Query
+		assert.False(t, ParseQuery(packQuery(t, m), &q), name)
+	}
+
+	wire := packQuery(t, base)
+	var q Query
+	assert.False(t, ParseQuery(wire[:len(wire)-1], &q), "truncated")
+	assert.False(t, ParseQuery(wire[:HeaderLen-1], &q), "short header")
+}
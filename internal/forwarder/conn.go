@@ -0,0 +1,295 @@
+package forwarder
+
+import (
+	"context"
+	"crypto/tls"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// maxPipelined caps the queries in flight on one connection.
+const maxPipelined = 1024
+
+var (
+	errConnBusy   = errors.New("too many queries in flight on the connection")
+	errConnClosed = errors.New("upstream closed the connection")
+)
+
+// pipeConn is a persistent TCP or DoT connection to an upstream that carries
+// many queries at once (RFC 7766, section 6.2.1.1). Each query is sent under an
+// ID unique on the connection, and responses are matched to queries by that ID
+// in whatever order they arrive.
+type pipeConn struct {
+	conn net.Conn
+	wmu  sync.Mutex // serialises writes
+
+	mu      sync.Mutex
+	pending map[uint16]chan []byte
+	nextID  uint16
+	err     error // why the connection failed; nil while it is usable
+}
+
+func newPipeConn(conn net.Conn) *pipeConn {
+	c := &pipeConn{conn: conn, pending: make(map[uint16]chan []byte)}
+	go c.readLoop()
+	return c
+}
+
+// exchange sends query, a packed DNS message, and returns the packed response,
+// carrying the query's ID. query is not modified.
+func (c *pipeConn) exchange(ctx context.Context, query []byte) ([]byte, error) {
+	if len(query) < 12 || len(query) > 0xFFFF {
+		return nil, fmt.Errorf("invalid query of %d bytes", len(query))
+	}
+	ch := make(chan []byte, 1)
+	c.mu.Lock()
+	if c.err != nil {
+		c.mu.Unlock()
+		return nil, c.err
+	}
+	if len(c.pending) >= maxPipelined {
+		c.mu.Unlock()
+		return nil, errConnBusy
+	}
+	id := c.nextID
+	for c.pending[id] != nil {
+		id++
+	}
+	c.nextID = id + 1
+	c.pending[id] = ch
+	c.mu.Unlock()
+
+	// Two bytes of length, then the query under the connection's ID.
+	buf := make([]byte, 2+len(query))
+	binary.BigEndian.PutUint16(buf, uint16(len(query)))
+	copy(buf[2:], query)
+	binary.BigEndian.PutUint16(buf[2:], id)
+
+	c.wmu.Lock()
+	deadline, _ := ctx.Deadline()
+	c.conn.SetWriteDeadline(deadline)
+	_, err := c.conn.Write(buf)
+	c.wmu.Unlock()
+	if err != nil {
+		// A partial write leaves the stream out of step; nobody can use it.
+		c.fail(err)
+		return nil, err
+	}
+
+	select {
+	case resp, ok := <-ch:
+		if !ok {
+			return nil, c.failure()
+		}
+		copy(resp[:2], query[:2])
+		return resp, nil
+	case <-ctx.Done():
+		c.mu.Lock()
+		if c.pending[id] == ch {
+			delete(c.pending, id)
+		}
+		c.mu.Unlock()
+		return nil, ctx.Err()
+	}
+}
+
+// readLoop hands each response to the query waiting for it, until the
+// connection fails.
+func (c *pipeConn) readLoop() {
+	var size [2]byte
+	for {
+		if _, err := io.ReadFull(c.conn, size[:]); err != nil {
+			c.fail(err)
+			return
+		}
+		resp := make([]byte, binary.BigEndian.Uint16(size[:]))
+		if _, err := io.ReadFull(c.conn, resp); err != nil {
+			c.fail(err)
+			return
+		}
+		if len(resp) < 12 {
+			c.fail(fmt.Errorf("short response of %d bytes", len(resp)))
+			return
+		}
+		id := binary.BigEndian.Uint16(resp)
+		c.mu.Lock()
+		ch := c.pending[id]
+		delete(c.pending, id)
+		c.mu.Unlock()
+		if ch != nil {
+			ch <- resp
+		}
+		// Otherwise the query was given up on; drop the late answer.
+	}
+}
+
+// fail closes the connection, failing the queries waiting on it.
+func (c *pipeConn) fail(err error) {
+	if errors.Is(err, io.EOF) {
+		err = errConnClosed
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if c.err != nil {
+		return
+	}
+	c.err = err
+	c.conn.Close()
+	for id, ch := range c.pending {
+		delete(c.pending, id)
+		close(ch)
+	}
+}
+
+func (c *pipeConn) failure() error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.err
+}
+
+// usable reports whether new queries can be sent on the connection.
+func (c *pipeConn) usable() bool {
+	return c.failure() == nil
+}
+
+// connPool keeps a fixed number of persistent connections to one upstream and
+// spreads queries over them in turn. A connection that fails is redialled by the
+// next query that needs it.
+type connPool struct {
+	dial   func(ctx context.Context) (net.Conn, error)
+	slots  []poolSlot
+	next   atomic.Uint32
+	open   prometheus.Gauge
+	closed atomic.Bool
+}
+
+type poolSlot struct {
+	mu      sync.Mutex
+	c       *pipeConn
+	dialing *dialCall // in flight, if any
+}
+
+// dialCall is a dial shared by the queries waiting for a slot's connection.
+type dialCall struct {
+	done chan struct{}
+	err  error
+}
+
+// newConnPool returns a pool of size connections to addr over network "tcp", or
+// over TLS when tlsConfig is not nil.
+func newConnPool(addr string, tlsConfig *tls.Config, size int, timeout time.Duration, open prometheus.Gauge) *connPool {
+	if size < 1 {
+		size = 1
+	}
+	dialer := &net.Dialer{Timeout: timeout, KeepAlive: 30 * time.Second}
+	p := &connPool{slots: make([]poolSlot, size), open: open}
+	p.dial = func(ctx context.Context) (net.Conn, error) {
+		if tlsConfig != nil {
+			d := &tls.Dialer{NetDialer: dialer, Config: tlsConfig}
+			return d.DialContext(ctx, "tcp", addr)
+		}
+		return dialer.DialContext(ctx, "tcp", addr)
+	}
+	return p
+}
+
+// exchange sends query on one of the pool's connections. A query whose
+// connection turns out to have been closed under it, as upstreams do with idle
+// connections, is retried once on a fresh one.
+func (p *connPool) exchange(ctx context.Context, query []byte) ([]byte, error) {
+	s := &p.slots[int(p.next.Add(1))%len(p.slots)]
+	for attempt := 0; ; attempt++ {
+		c, fresh, err := p.get(ctx, s)
+		if err != nil {
+			return nil, err
+		}
+		resp, err := c.exchange(ctx, query)
+		if err == nil || fresh || attempt > 0 || ctx.Err() != nil || errors.Is(err, errConnBusy) {
+			return resp, err
+		}
+	}
+}
+
+// get returns the slot's connection, dialling a new one if it has failed; fresh
+// reports whether it was just dialled. The dial runs without the slot's lock and
+// is shared: queries arriving meanwhile wait for it rather than queueing up
+// behind the lock, and all fail with its error if it fails.
+func (p *connPool) get(ctx context.Context, s *poolSlot) (c *pipeConn, fresh bool, err error) {
+	s.mu.Lock()
+	if s.c != nil && s.c.usable() {
+		c = s.c
+		s.mu.Unlock()
+		return c, false, nil
+	}
+	if s.c != nil {
+		s.c = nil
+		p.open.Dec()
+	}
+	d := s.dialing
+	if d == nil {
+		d = &dialCall{done: make(chan struct{})}
+		s.dialing = d
+		go p.dialSlot(s, d)
+	}
+	s.mu.Unlock()
+
+	select {
+	case <-d.done:
+	case <-ctx.Done():
+		return nil, false, ctx.Err()
+	}
+	if d.err != nil {
+		return nil, false, d.err
+	}
+	s.mu.Lock()
+	c = s.c
+	s.mu.Unlock()
+	if c == nil {
+		return nil, false, net.ErrClosed
+	}
+	return c, true, nil
+}
+
+// dialSlot dials a connection for s. It isn't bound to the context of the query
+// that started it, since others may be waiting for it; the dialer's timeout
+// bounds it instead.
+func (p *connPool) dialSlot(s *poolSlot, d *dialCall) {
+	conn, err := p.dial(context.Background())
+	s.mu.Lock()
+	s.dialing = nil
+	switch {
+	case err != nil:
+		d.err = err
+	case p.closed.Load():
+		conn.Close()
+		d.err = net.ErrClosed
+	default:
+		s.c = newPipeConn(conn)
+		p.open.Inc()
+	}
+	s.mu.Unlock()
+	close(d.done)
+}
+
+// close closes every connection of the pool.
+func (p *connPool) close() {
+	p.closed.Store(true)
+	for i := range p.slots {
+		s := &p.slots[i]
+		s.mu.Lock()
+		if s.c != nil {
+			s.c.fail(net.ErrClosed)
+			s.c = nil
+			p.open.Dec()
+		}
+		s.mu.Unlock()
+	}
+}
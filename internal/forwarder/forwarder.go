@@ -0,0 +1,287 @@
+// Package forwarder is a Backend that forwards queries to upstream resolvers
+// instead of recursing. Plain upstreams are queried over UDP, and over TCP when
+// the answer is truncated; TCP and DNS over TLS upstreams are queried over a
+// pool of persistent connections, each carrying many queries at once.
+// Conditional forwarding rules send names under a domain to their own
+// upstreams.
+package forwarder
+
+import (
+	"context"
+	"crypto/tls"
+	"errors"
+	"fmt"
+	"net"
+	"sort"
+	"strings"
+	"time"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/interfaces"
+	"dns-resolver/internal/metrics"
+
+	"github.com/miekg/dns"
+)
+
+// upstream is a server queries are forwarded to.
+type upstream struct {
+	name  string // as configured, for logs and metrics
+	proto string // "udp", "tcp" or "tls"
+	addr  string
+	udp   *dns.Client
+	pool  *connPool // TCP or DoT connections; for UDP upstreams, the truncation fallback
+	infra *infra
+}
+
+// rule sends names under suffix to its upstreams.
+type rule struct {
+	suffix    string // lower case, fully qualified
+	labels    int    // more labels, more specific
+	upstreams []*upstream
+}
+
+// Forwarder forwards queries to the upstreams of the longest matching rule. It
+// tries the fastest healthy upstream first, moving on to the next when one fails
+// or doesn't answer within its retransmit timeout.
+type Forwarder struct {
+	rules     []rule // longest suffix first; the last one is the root
+	upstreams []*upstream
+	metrics   *metrics.Metrics
+}
+
+var _ interfaces.Backend = (*Forwarder)(nil)
+
+// New returns a forwarder to cfg.ForwardUpstreams, with cfg.ForwardRules for
+// conditional forwarding. Upstreams are written host:port for UDP with TCP
+// fallback, tcp://host:port for TCP only, or tls://host:port for DNS over TLS,
+// whose certificate must be valid for host.
+func New(cfg *config.Config, m *metrics.Metrics) (*Forwarder, error) {
+	f := &Forwarder{metrics: m}
+	byName := make(map[string]*upstream)
+	resolve := func(names []string) ([]*upstream, error) {
+		ups := make([]*upstream, 0, len(names))
+		for _, name := range names {
+			u := byName[name]
+			if u == nil {
+				var err error
+				if u, err = newUpstream(name, cfg, m); err != nil {
+					return nil, err
+				}
+				byName[name] = u
+				f.upstreams = append(f.upstreams, u)
+			}
+			ups = append(ups, u)
+		}
+		return ups, nil
+	}
+
+	suffixes := make(map[string][]string, len(cfg.ForwardRules)+1)
+	if len(cfg.ForwardUpstreams) > 0 {
+		suffixes["."] = cfg.ForwardUpstreams
+	}
+	for suffix, names := range cfg.ForwardRules {
+		suffixes[strings.ToLower(dns.Fqdn(suffix))] = names
+	}
+	if len(suffixes["."]) == 0 {
+		return nil, errors.New("no upstreams to forward to: set ForwardUpstreams")
+	}
+	for suffix, names := range suffixes {
+		if len(names) == 0 {
+			return nil, fmt.Errorf("forwarding rule for %s has no upstreams", suffix)
+		}
+		ups, err := resolve(names)
+		if err != nil {
+			return nil, err
+		}
+		f.rules = append(f.rules, rule{suffix: suffix, labels: strings.Count(suffix, "."), upstreams: ups})
+	}
+	sort.Slice(f.rules, func(i, j int) bool {
+		return f.rules[i].labels > f.rules[j].labels
+	})
+	m.SetUpstreamSource(f.upstreamStates)
+	return f, nil
+}
+
+func newUpstream(name string, cfg *config.Config, m *metrics.Metrics) (*upstream, error) {
+	proto, addr := "udp", name
+	if i := strings.Index(name, "://"); i >= 0 {
+		proto, addr = name[:i], name[i+3:]
+	}
+	port := "53"
+	switch proto {
+	case "udp", "tcp":
+	case "tls":
+		port = "853"
+	default:
+		return nil, fmt.Errorf("upstream %s: unknown protocol %q", name, proto)
+	}
+	host, _, err := net.SplitHostPort(addr)
+	if err != nil {
+		host, addr = addr, net.JoinHostPort(addr, port)
+	}
+	if host == "" {
+		return nil, fmt.Errorf("upstream %s: no host", name)
+	}
+
+	u := &upstream{name: name, proto: proto, addr: addr}
+	var tlsConfig *tls.Config
+	if proto == "tls" {
+		tlsConfig = &tls.Config{
+			ServerName:         host,
+			MinVersion:         tls.VersionTLS12,
+			ClientSessionCache: tls.NewLRUClientSessionCache(0),
+		}
+	}
+	if proto == "udp" {
+		u.udp = &dns.Client{Net: "udp", Timeout: cfg.UpstreamTimeout}
+	}
+	u.pool = newConnPool(addr, tlsConfig, cfg.ForwardConns, cfg.UpstreamTimeout, m.ForwardConnsGauge(name))
+	u.infra = newInfra(name, cfg.UpstreamTimeout, m)
+	return u, nil
+}
+
+// route returns the upstreams for name.
+func (f *Forwarder) route(name string) []*upstream {
+	name = strings.ToLower(name)
+	for i := range f.rules {
+		r := &f.rules[i]
+		if r.suffix == "." || name == r.suffix || strings.HasSuffix(name, "."+r.suffix) {
+			return r.upstreams
+		}
+	}
+	return nil
+}
+
+// maxPasses caps the rounds over a name's upstreams while they time out.
+const maxPasses = 3
+
+// Exchange forwards req to the upstreams for its name, fastest healthy one first,
+// giving each its own retransmit timeout. An upstream that answers SERVFAIL,
+// REFUSED or NOTIMP counts as failed, and the next one is tried; its answer is
+// only returned when no upstream does better. When every upstream timed out it
+// goes round again with their backed-off timeouts, until ctx is done. The DNSSEC
+// status is the upstream's: secure when it set the AD bit, unknown otherwise.
+func (f *Forwarder) Exchange(ctx context.Context, req *dns.Msg) (*dns.Msg, interfaces.DNSSECStatus, error) {
+	ups := f.route(req.Question[0].Name)
+	var lastErr error
+	var lastFailure *dns.Msg // the last SERVFAIL, REFUSED or NOTIMP answer
+	for pass := 0; pass < maxPasses; pass++ {
+		timedOut := false
+		for _, u := range byScore(ups, time.Now()) {
+			actx, cancel := context.WithTimeout(ctx, u.infra.rto())
+			start := time.Now()
+			resp, err := u.exchange(actx, req)
+			cancel()
+			if err == nil && isFailure(resp.Rcode) {
+				// The upstream is up, but can't or won't answer; another may.
+				u.infra.failed(time.Now())
+				f.metrics.IncrementForwardQueries(u.name, "error")
+				lastFailure = resp
+				continue
+			}
+			if err == nil {
+				u.infra.answered(time.Since(start))
+				f.metrics.IncrementForwardQueries(u.name, "ok")
+				if resp.AuthenticatedData {
+					return resp, interfaces.DNSSECSecure, nil
+				}
+				return resp, interfaces.DNSSECUnknown, nil
+			}
+
+			lastErr = fmt.Errorf("upstream %s: %w", u.name, err)
+			switch {
+			case ctx.Err() != nil:
+				// The caller gave up or ran out of time, which may have been
+				// before the upstream's RTO; don't hold it against it.
+				f.metrics.IncrementForwardQueries(u.name, "timeout")
+				return lastAnswer(lastFailure, lastErr)
+			case actx.Err() != nil:
+				u.infra.timedOut(time.Now())
+				f.metrics.IncrementForwardQueries(u.name, "timeout")
+				timedOut = true
+			default:
+				u.infra.failed(time.Now())
+				f.metrics.IncrementForwardQueries(u.name, "error")
+			}
+		}
+		if !timedOut {
+			// They all failed outright; going round again won't help.
+			break
+		}
+	}
+	return lastAnswer(lastFailure, lastErr)
+}
+
+// isFailure reports whether rcode says the upstream failed the query rather than
+// answered it.
+func isFailure(rcode int) bool {
+	return rcode == dns.RcodeServerFailure || rcode == dns.RcodeRefused || rcode == dns.RcodeNotImplemented
+}
+
+// lastAnswer is what Exchange returns when no upstream answered: the last
+// failure an upstream replied with, or else the last error.
+func lastAnswer(failure *dns.Msg, err error) (*dns.Msg, interfaces.DNSSECStatus, error) {
+	if failure != nil {
+		return failure, interfaces.DNSSECUnknown, nil
+	}
+	return nil, interfaces.DNSSECUnknown, err
+}
+
+// upstreamStates returns the infrastructure table of every upstream.
+func (f *Forwarder) upstreamStates() []metrics.UpstreamState {
+	now := time.Now()
+	states := make([]metrics.UpstreamState, len(f.upstreams))
+	for i, u := range f.upstreams {
+		states[i] = u.infra.state(u.name, now)
+	}
+	return states
+}
+
+// exchange sends req to the upstream.
+func (u *upstream) exchange(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
+	if u.udp != nil {
+		// The ID is all that keeps an off-path attacker from spoofing the
+		// answer, so don't reuse the client's.
+		q := *req
+		q.Id = dns.Id()
+		resp, _, err := u.udp.ExchangeContext(ctx, &q, u.addr)
+		if err != nil || !resp.Truncated {
+			if err == nil {
+				resp.Id = req.Id
+			}
+			return resp, checkReply(req, resp, err)
+		}
+	}
+	query, err := req.Pack()
+	if err != nil {
+		return nil, err
+	}
+	wire, err := u.pool.exchange(ctx, query)
+	if err != nil {
+		return nil, err
+	}
+	resp := new(dns.Msg)
+	if err := resp.Unpack(wire); err != nil {
+		return nil, err
+	}
+	return resp, checkReply(req, resp, nil)
+}
+
+// checkReply makes sure resp answers req's question.
+func checkReply(req, resp *dns.Msg, err error) error {
+	if err != nil {
+		return err
+	}
+	if len(resp.Question) != 1 || !strings.EqualFold(resp.Question[0].Name, req.Question[0].Name) ||
+		resp.Question[0].Qtype != req.Question[0].Qtype {
+		return errors.New("response does not match the question")
+	}
+	return nil
+}
+
+// Close closes the connections to the upstreams.
+func (f *Forwarder) Close() {
+	for _, u := range f.upstreams {
+		u.pool.close()
+	}
+}
@@ -0,0 +1,306 @@
+package forwarder
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+
+	"github.com/miekg/dns"
+	"github.com/stretchr/testify/assert"
+	"github.com/stretchr/testify/require"
+)
+
+// readFrame reads a length-prefixed DNS message off a stream.
+func readFrame(r io.Reader) ([]byte, error) {
+	var size [2]byte
+	if _, err := io.ReadFull(r, size[:]); err != nil {
+		return nil, err
+	}
+	msg := make([]byte, binary.BigEndian.Uint16(size[:]))
+	_, err := io.ReadFull(r, msg)
+	return msg, err
+}
+
+func writeFrame(w io.Writer, msg []byte) error {
+	frame := binary.BigEndian.AppendUint16(nil, uint16(len(msg)))
+	_, err := w.Write(append(frame, msg...))
+	return err
+}
+
+// query returns a fake 12-byte message with the given ID, tagged by its last byte.
+func query(id uint16, tag byte) []byte {
+	q := make([]byte, 12)
+	binary.BigEndian.PutUint16(q, id)
+	q[11] = tag
+	return q
+}
+
+// listen starts a TCP upstream that hands each accepted connection to serve.
+func listen(t *testing.T, serve func(conn net.Conn)) string {
+	t.Helper()
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	require.NoError(t, err)
+	t.Cleanup(func() { l.Close() })
+	go func() {
+		for {
+			conn, err := l.Accept()
+			if err != nil {
+				return
+			}
+			go serve(conn)
+		}
+	}()
+	return l.Addr().String()
+}
+
+func TestPipelinedResponsesOutOfOrder(t *testing.T) {
+	const n = 3
+	addr := listen(t, func(conn net.Conn) {
+		defer conn.Close()
+		// Take all the queries before answering any, then answer the last first.
+		var queries [][]byte
+		for len(queries) < n {
+			q, err := readFrame(conn)
+			if err != nil {
+				return
+			}
+			queries = append(queries, q)
+		}
+		for i := n - 1; i >= 0; i-- {
+			writeFrame(conn, queries[i])
+		}
+	})
+
+	pool := newConnPool(addr, nil, 1, time.Second, metrics.NewMetrics().ForwardConnsGauge(addr))
+	defer pool.close()
+
+	ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
+	defer cancel()
+	var wg sync.WaitGroup
+	for i := 0; i < n; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			q := query(0xAB00, byte(i))
+			resp, err := pool.exchange(ctx, q)
+			if assert.NoError(t, err) {
+				assert.Equal(t, q, resp, "each query gets its own answer, under its own ID")
+			}
+		}(i)
+	}
+	wg.Wait()
+}
+
+func TestConnPoolRedialsClosedConnection(t *testing.T) {
+	var mu sync.Mutex
+	accepted := 0
+	addr := listen(t, func(conn net.Conn) {
+		defer conn.Close()
+		mu.Lock()
+		accepted++
+		mu.Unlock()
+		// Answer one query, then close the connection as if it had gone idle.
+		q, err := readFrame(conn)
+		if err == nil {
+			writeFrame(conn, q)
+		}
+	})
+
+	pool := newConnPool(addr, nil, 1, time.Second, metrics.NewMetrics().ForwardConnsGauge(addr))
+	defer pool.close()
+
+	ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
+	defer cancel()
+	for i := 0; i < 3; i++ {
+		q := query(uint16(i), byte(i))
+		resp, err := pool.exchange(ctx, q)
+		require.NoError(t, err)
+		assert.Equal(t, q, resp)
+	}
+	mu.Lock()
+	assert.Equal(t, 3, accepted)
+	mu.Unlock()
+}
+
+func TestConnPoolSharesDial(t *testing.T) {
+	pool := newConnPool("192.0.2.1:53", nil, 1, time.Second, metrics.NewMetrics().ForwardConnsGauge("shared"))
+	defer pool.close()
+	var dials atomic.Int32
+	release := make(chan struct{})
+	pool.dial = func(ctx context.Context) (net.Conn, error) {
+		dials.Add(1)
+		<-release
+		return nil, errors.New("connection refused")
+	}
+
+	// A query that gives up doesn't hold up the others or the dial.
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+	_, _, err := pool.get(ctx, &pool.slots[0])
+	assert.Equal(t, context.Canceled, err)
+
+	const n = 5
+	errs := make(chan error, n)
+	for i := 0; i < n; i++ {
+		go func() {
+			_, _, err := pool.get(context.Background(), &pool.slots[0])
+			errs <- err
+		}()
+	}
+	time.Sleep(50 * time.Millisecond)
+	close(release)
+	for i := 0; i < n; i++ {
+		if err := <-errs; assert.Error(t, err) {
+			assert.Equal(t, "connection refused", err.Error())
+		}
+	}
+	assert.Equal(t, int32(1), dials.Load(), "expected the waiting queries to share one dial")
+}
+
+func TestRoute(t *testing.T) {
+	cfg := &config.Config{
+		UpstreamTimeout:  time.Second,
+		ForwardUpstreams: []string{"192.0.2.1"},
+		ForwardRules: map[string][]string{
+			"corp.example.":     {"tcp://192.0.2.2:5353"},
+			"dev.corp.example.": {"tls://resolver.example:853", "192.0.2.1"},
+		},
+	}
+	f, err := New(cfg, metrics.NewMetrics())
+	require.NoError(t, err)
+	defer f.Close()
+
+	names := func(name string) []string {
+		var out []string
+		for _, u := range f.route(name) {
+			out = append(out, u.addr)
+		}
+		return out
+	}
+	assert.Equal(t, []string{"192.0.2.1:53"}, names("www.example.com."))
+	assert.Equal(t, []string{"192.0.2.1:53"}, names("notcorp.example."))
+	assert.Equal(t, []string{"192.0.2.2:5353"}, names("Host.Corp.Example."))
+	assert.Equal(t, []string{"192.0.2.2:5353"}, names("corp.example."))
+	assert.Equal(t, []string{"resolver.example:853", "192.0.2.1:53"}, names("a.dev.corp.example."))
+
+	_, err = New(&config.Config{ForwardUpstreams: []string{"doh://192.0.2.1"}}, metrics.NewMetrics())
+	assert.Error(t, err)
+	_, err = New(&config.Config{}, metrics.NewMetrics())
+	assert.Error(t, err)
+}
+
+func TestInfraRTOAndSelection(t *testing.T) {
+	m := metrics.NewMetrics()
+	now := time.Now()
+	fast := &upstream{name: "fast", infra: newInfra("fast", 2*time.Second, m)}
+	slow := &upstream{name: "slow", infra: newInfra("slow", 2*time.Second, m)}
+	fresh := &upstream{name: "fresh", infra: newInfra("fresh", 2*time.Second, m)}
+	broken := &upstream{name: "broken", infra: newInfra("broken", 2*time.Second, m)}
+
+	assert.Equal(t, unknownRTO, fresh.infra.rto())
+
+	fast.infra.answered(100 * time.Millisecond)
+	assert.Equal(t, 300*time.Millisecond, fast.infra.rto(), "SRTT plus four times half the first sample")
+	fast.infra.answered(100 * time.Millisecond)
+	assert.Equal(t, 250*time.Millisecond, fast.infra.rto(), "the variance shrinks as samples agree")
+
+	slow.infra.answered(time.Second)
+	broken.infra.answered(10 * time.Millisecond)
+	broken.infra.failed(now)
+
+	order := func() []string {
+		var names []string
+		for _, u := range byScore([]*upstream{broken, slow, fresh, fast}, now) {
+			names = append(names, u.name)
+		}
+		return names
+	}
+	assert.Equal(t, []string{"fast", "fresh", "slow", "broken"}, order())
+
+	// Timeouts back the RTO off, up to the cap, and rank the upstream lower.
+	fast.infra.timedOut(now)
+	assert.Equal(t, 500*time.Millisecond, fast.infra.rto())
+	fast.infra.timedOut(now)
+	assert.Equal(t, []string{"fresh", "fast", "slow", "broken"}, order())
+	fast.infra.timedOut(now)
+	fast.infra.timedOut(now)
+	assert.Equal(t, 2*time.Second, fast.infra.rto())
+	assert.False(t, fast.infra.state("fast", now).Healthy, "penalized after timeouts in a row")
+
+	// An answer clears it all, and the penalty wears off by itself.
+	fast.infra.answered(100 * time.Millisecond)
+	assert.True(t, fast.infra.state("fast", now).Healthy)
+	assert.True(t, broken.infra.state("broken", now.Add(penaltyBase)).Healthy)
+
+	// Timeouts decay once their penalty runs out, so that an upstream that was
+	// slow ranks by its SRTT again and gets tried.
+	for i := 0; i < penaltyTimeouts; i++ {
+		slow.infra.timedOut(now)
+	}
+	assert.False(t, slow.infra.state("slow", now).Healthy)
+	later := now.Add(penaltyBase)
+	state := slow.infra.state("slow", later)
+	assert.True(t, state.Healthy)
+	assert.Equal(t, 1, state.Timeouts, "halved when the penalty ran out")
+	assert.Equal(t, time.Second, slow.infra.score(later.Add(timeoutDecay)))
+}
+
+// rcodeUpstream starts a TCP upstream answering every query with rcode.
+func rcodeUpstream(t *testing.T, rcode int) string {
+	return "tcp://" + listen(t, func(conn net.Conn) {
+		defer conn.Close()
+		for {
+			wire, err := readFrame(conn)
+			if err != nil {
+				return
+			}
+			req := new(dns.Msg)
+			if req.Unpack(wire) != nil {
+				return
+			}
+			resp := new(dns.Msg)
+			resp.SetRcode(req, rcode)
+			if wire, err = resp.Pack(); err != nil || writeFrame(conn, wire) != nil {
+				return
+			}
+		}
+	})
+}
+
+func TestExchangeMovesOnFromFailureRcodes(t *testing.T) {
+	refused := rcodeUpstream(t, dns.RcodeRefused)
+	servfail := rcodeUpstream(t, dns.RcodeServerFailure)
+	ok := rcodeUpstream(t, dns.RcodeSuccess)
+	req := new(dns.Msg)
+	req.SetQuestion("example.com.", dns.TypeA)
+	ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
+	defer cancel()
+
+	f, err := New(&config.Config{UpstreamTimeout: time.Second, ForwardUpstreams: []string{refused, servfail, ok}}, metrics.NewMetrics())
+	require.NoError(t, err)
+	defer f.Close()
+	resp, _, err := f.Exchange(ctx, req)
+	require.NoError(t, err)
+	assert.Equal(t, dns.RcodeSuccess, resp.Rcode)
+	states := f.upstreamStates()
+	assert.Equal(t, 1, states[0].Failures)
+	assert.Equal(t, 1, states[1].Failures)
+	assert.Equal(t, uint64(1), states[2].Samples)
+
+	// When none does better, the last failure is the answer.
+	f, err = New(&config.Config{UpstreamTimeout: time.Second, ForwardUpstreams: []string{refused, servfail}}, metrics.NewMetrics())
+	require.NoError(t, err)
+	defer f.Close()
+	resp, _, err = f.Exchange(ctx, req)
+	require.NoError(t, err)
+	assert.Equal(t, dns.RcodeServerFailure, resp.Rcode)
+}
@@ -0,0 +1,226 @@
+package forwarder
+
+import (
+	"sort"
+	"sync"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+const (
+	// unknownRTT ranks an upstream that hasn't answered yet, so that it is tried
+	// before any known to be slower (Unbound's UNKNOWN_SERVER_NICENESS).
+	unknownRTT = 376 * time.Millisecond
+	// unknownRTO is the retransmit timeout before the first answer (RFC 6298).
+	unknownRTO = time.Second
+	// minRTO keeps a fast upstream's timeout above scheduling noise.
+	minRTO = 50 * time.Millisecond
+	// maxBackoff caps how many times timeouts in a row double the RTO.
+	maxBackoff = 5
+	// Timeouts in a row after which an upstream is penalized as well.
+	penaltyTimeouts = 3
+	// An upstream that fails is penalized for penaltyBase, doubling with each
+	// failure in a row up to penaltyMax.
+	penaltyBase = time.Second
+	penaltyMax  = 30 * time.Second
+	// Timeouts in a row are halved each timeoutDecay after the last one, or
+	// after the penalty they earned runs out, so that an upstream that was slow
+	// ranks well enough again to be tried.
+	timeoutDecay = penaltyBase
+)
+
+// infra is an upstream's entry in the infrastructure table: its smoothed RTT and
+// RTT variance, as TCP keeps them (RFC 6298), the timeouts and failures since it
+// last answered, and how long it is penalized for them.
+type infra struct {
+	mu       sync.Mutex
+	srtt     time.Duration
+	rttvar   time.Duration
+	samples  uint64
+	timeouts int       // in a row, decaying
+	decay    time.Time // when timeouts are next halved
+	failures int       // in a row
+	penalty  time.Time // unhealthy until
+	maxRTO   time.Duration
+
+	srttGauge, rtoGauge prometheus.Gauge
+}
+
+func newInfra(name string, maxRTO time.Duration, m *metrics.Metrics) *infra {
+	in := &infra{maxRTO: maxRTO}
+	in.srttGauge, in.rtoGauge = m.UpstreamGauges(name)
+	in.rtoGauge.Set(in.rtoLocked().Seconds())
+	return in
+}
+
+// rto returns the upstream's retransmit timeout: how long to wait for its answer
+// before trying the next upstream.
+func (in *infra) rto() time.Duration {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	return in.rtoLocked()
+}
+
+func (in *infra) rtoLocked() time.Duration {
+	rto := unknownRTO
+	if in.samples > 0 {
+		rto = in.srtt + 4*in.rttvar
+		if rto < minRTO {
+			rto = minRTO
+		}
+	}
+	backoff := in.timeouts
+	if backoff > maxBackoff {
+		backoff = maxBackoff
+	}
+	rto <<= backoff
+	if in.maxRTO > 0 && rto > in.maxRTO {
+		rto = in.maxRTO
+	}
+	return rto
+}
+
+// score ranks the upstream for selection: lower is better. Penalized upstreams
+// rank after every healthy one.
+func (in *infra) score(now time.Time) time.Duration {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	in.decayTimeouts(now)
+	s := unknownRTT
+	if in.samples > 0 {
+		s = in.srtt
+	}
+	backoff := in.timeouts
+	if backoff > maxBackoff {
+		backoff = maxBackoff
+	}
+	s <<= backoff
+	if now.Before(in.penalty) {
+		s += time.Hour
+	}
+	return s
+}
+
+// answered records an answer that took rtt, clearing timeouts and failures.
+func (in *infra) answered(rtt time.Duration) {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	if in.samples == 0 {
+		in.srtt, in.rttvar = rtt, rtt/2
+	} else {
+		delta := in.srtt - rtt
+		if delta < 0 {
+			delta = -delta
+		}
+		in.rttvar += (delta - in.rttvar) / 4
+		in.srtt += (rtt - in.srtt) / 8
+	}
+	in.samples++
+	in.timeouts, in.failures = 0, 0
+	in.penalty = time.Time{}
+	in.update()
+}
+
+// timedOut records an exchange that got no answer within the RTO.
+func (in *infra) timedOut(now time.Time) {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	in.timeouts++
+	in.decay = now.Add(timeoutDecay)
+	if in.timeouts >= penaltyTimeouts {
+		in.penalize(now, in.timeouts-penaltyTimeouts)
+		in.decay = in.penalty
+	}
+	in.update()
+}
+
+// decayTimeouts halves the timeouts in a row for every timeoutDecay since they
+// were due to decay. Nothing but the upstream's own answers would clear them,
+// and without this it would rank too low to ever be asked.
+func (in *infra) decayTimeouts(now time.Time) {
+	if in.timeouts == 0 || now.Before(in.decay) {
+		return
+	}
+	for in.timeouts > 0 && !now.Before(in.decay) {
+		in.timeouts >>= 1
+		in.decay = in.decay.Add(timeoutDecay)
+	}
+	in.update()
+}
+
+// failed records an exchange that failed outright, as when the upstream refuses
+// the connection.
+func (in *infra) failed(now time.Time) {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	in.failures++
+	in.penalize(now, in.failures-1)
+	in.update()
+}
+
+func (in *infra) penalize(now time.Time, doublings int) {
+	d := penaltyMax
+	if doublings < 5 {
+		if d = penaltyBase << doublings; d > penaltyMax {
+			d = penaltyMax
+		}
+	}
+	in.penalty = now.Add(d)
+}
+
+// update exports the entry to the gauges. Health is exported from state when
+// the metrics are scraped, since a penalty runs out by itself.
+func (in *infra) update() {
+	in.srttGauge.Set(in.srtt.Seconds())
+	in.rtoGauge.Set(in.rtoLocked().Seconds())
+}
+
+// state returns the entry for /debug/upstreams.
+func (in *infra) state(name string, now time.Time) metrics.UpstreamState {
+	in.mu.Lock()
+	defer in.mu.Unlock()
+	in.decayTimeouts(now)
+	s := metrics.UpstreamState{
+		Name:     name,
+		SRTTMs:   ms(in.srtt),
+		RTTVarMs: ms(in.rttvar),
+		RTOMs:    ms(in.rtoLocked()),
+		Samples:  in.samples,
+		Timeouts: in.timeouts,
+		Failures: in.failures,
+		Healthy:  !now.Before(in.penalty),
+	}
+	if !s.Healthy {
+		s.PenaltyMs = ms(in.penalty.Sub(now))
+	}
+	return s
+}
+
+func ms(d time.Duration) float64 {
+	return float64(d) / float64(time.Millisecond)
+}
+
+// byScore returns ups ordered from the fastest healthy upstream to the slowest,
+// then the penalized ones. Upstreams that rank the same keep their configured
+// order.
+func byScore(ups []*upstream, now time.Time) []*upstream {
+	type ranked struct {
+		u     *upstream
+		score time.Duration
+	}
+	r := make([]ranked, len(ups))
+	for i, u := range ups {
+		r[i] = ranked{u, u.infra.score(now)}
+	}
+	sort.SliceStable(r, func(i, j int) bool {
+		return r[i].score < r[j].score
+	})
+	out := make([]*upstream, len(ups))
+	for i := range r {
+		out[i] = r[i].u
+	}
+	return out
+}
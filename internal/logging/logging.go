@@ -0,0 +1,297 @@
+// Package logging is the resolver's log for messages on the query path. Callers
+// only queue a message in a lock-free ring buffer; a background goroutine
+// formats it as a key=value line and writes it out. Messages below the
+// configured level are ignored, and each category can be sampled and rate
+// limited, so that a flood of queries can't turn logging into the bottleneck.
+// Messages the logger sheds are counted in the metrics.
+//
+// Startup, shutdown and other rare messages keep using the standard log
+// package, which writes synchronously and so never loses a message before a
+// fatal exit.
+package logging
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"log"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// Level is the severity of a message.
+type Level int32
+
+const (
+	LevelDebug Level = iota
+	LevelInfo
+	LevelWarn
+	LevelError
+)
+
+var levelNames = [...]string{"debug", "info", "warn", "error"}
+
+func (l Level) String() string {
+	if l >= 0 && int(l) < len(levelNames) {
+		return levelNames[l]
+	}
+	return strconv.Itoa(int(l))
+}
+
+// ParseLevel returns the level called name: debug, info, warn or error.
+func ParseLevel(name string) (Level, error) {
+	for i, n := range levelNames {
+		if strings.EqualFold(name, n) {
+			return Level(i), nil
+		}
+	}
+	return LevelInfo, fmt.Errorf("unknown log level %q", name)
+}
+
+// Category is the part of the resolver a message comes from. Sampling and rate
+// limits apply per category.
+type Category int
+
+const (
+	CategoryQuery    Category = iota // per-query errors in the server
+	CategoryResolver                 // upstream resolution
+	CategoryDNSSEC                   // validation results
+	CategoryCache                    // cache and journal
+	CategoryPlugin                   // request plugins
+	categoryCount
+)
+
+var categoryNames = [categoryCount]string{"query", "resolver", "dnssec", "cache", "plugin"}
+
+func (c Category) String() string {
+	return categoryNames[c]
+}
+
+// Reasons a message is shed, as counted in the metrics.
+const (
+	dropSampled     = iota // not picked by the category's sampling
+	dropRateLimited        // over the category's rate limit
+	dropQueueFull          // the writer is behind
+	dropReasonCount
+)
+
+var dropReasonNames = [dropReasonCount]string{"sampled", "rate_limited", "queue_full"}
+
+// categoryState is the sampling and rate limiting state of one category.
+type categoryState struct {
+	sampleEvery uint64 // keep one message in sampleEvery; 0 or 1 keeps all
+	sampled     atomic.Uint64
+	limit       int64        // messages per second; 0 is unlimited
+	window      atomic.Int64 // the second count is for, in Unix time
+	count       atomic.Int64
+	drops       [dropReasonCount]prometheus.Counter
+}
+
+// admit reports whether a message passes sampling and the rate limit.
+func (c *categoryState) admit(now time.Time) bool {
+	if c.sampleEvery > 1 && c.sampled.Add(1)%c.sampleEvery != 1 {
+		c.drops[dropSampled].Inc()
+		return false
+	}
+	if c.limit > 0 {
+		sec := now.Unix()
+		if w := c.window.Load(); w != sec && c.window.CompareAndSwap(w, sec) {
+			c.count.Store(0)
+		}
+		if c.count.Add(1) > c.limit {
+			c.drops[dropRateLimited].Inc()
+			return false
+		}
+	}
+	return true
+}
+
+// Logger queues messages and writes them from a background goroutine.
+type Logger struct {
+	level      Level
+	categories [categoryCount]categoryState
+	ring       *ring
+	wake       chan struct{}
+	done       chan struct{}
+	closed     chan struct{}
+	out        *bufio.Writer
+	closeOnce  sync.Once
+}
+
+// defaultBufferSize is the queue length when LogBufferSize isn't set.
+const defaultBufferSize = 8192
+
+// New starts a logger writing to w, configured by the Log* settings of cfg.
+// Settings left unset, as in configs saved before they existed, get their
+// defaults.
+func New(cfg *config.Config, w io.Writer, m *metrics.Metrics) (*Logger, error) {
+	level := LevelInfo
+	if cfg.LogLevel != "" {
+		var err error
+		if level, err = ParseLevel(cfg.LogLevel); err != nil {
+			return nil, err
+		}
+	}
+	size := cfg.LogBufferSize
+	if size <= 0 {
+		size = defaultBufferSize
+	}
+	l := &Logger{
+		level:  level,
+		ring:   newRing(size),
+		wake:   make(chan struct{}, 1),
+		done:   make(chan struct{}),
+		closed: make(chan struct{}),
+		out:    bufio.NewWriterSize(w, 64<<10),
+	}
+	for name := range cfg.LogSampling {
+		if categoryByName(name) < 0 {
+			return nil, fmt.Errorf("unknown log category %q", name)
+		}
+	}
+	for i := range l.categories {
+		c := &l.categories[i]
+		if n := cfg.LogSampling[categoryNames[i]]; n > 1 {
+			c.sampleEvery = uint64(n)
+		}
+		c.limit = int64(cfg.LogRateLimit)
+		for r := range c.drops {
+			c.drops[r] = m.LogDropCounter(categoryNames[i], dropReasonNames[r])
+		}
+	}
+	go l.run()
+	return l, nil
+}
+
+func categoryByName(name string) Category {
+	for i, n := range categoryNames {
+		if n == name {
+			return Category(i)
+		}
+	}
+	return -1
+}
+
+// Logf queues a message. The arguments are formatted by the writer, so they
+// must not be modified afterwards.
+func (l *Logger) Logf(level Level, cat Category, format string, args ...interface{}) {
+	if level < l.level {
+		return
+	}
+	now := time.Now()
+	c := &l.categories[cat]
+	if !c.admit(now) {
+		return
+	}
+	if !l.ring.push(entry{time: now, level: level, category: cat, format: format, args: args}) {
+		c.drops[dropQueueFull].Inc()
+		return
+	}
+	select {
+	case l.wake <- struct{}{}:
+	default:
+	}
+}
+
+// Close writes out the queued messages and stops the writer.
+func (l *Logger) Close() error {
+	l.closeOnce.Do(func() { close(l.done) })
+	<-l.closed
+	return nil
+}
+
+// run writes queued messages, flushing whenever the ring runs dry.
+func (l *Logger) run() {
+	defer close(l.closed)
+	var line []byte
+	for {
+		line = l.drain(line)
+		select {
+		case <-l.wake:
+		case <-l.done:
+			// Pick up whatever was queued before Close.
+			l.drain(line)
+			return
+		}
+	}
+}
+
+// drain writes out every queued message. line is a scratch buffer, returned for
+// reuse.
+func (l *Logger) drain(line []byte) []byte {
+	for {
+		e, ok := l.ring.pop()
+		if !ok {
+			break
+		}
+		line = appendEntry(line[:0], &e)
+		if _, err := l.out.Write(line); err != nil {
+			log.Printf("Failed to write log: %v", err)
+		}
+	}
+	if err := l.out.Flush(); err != nil {
+		log.Printf("Failed to flush log: %v", err)
+	}
+	return line
+}
+
+// appendEntry formats e as a line of key=value pairs.
+func appendEntry(dst []byte, e *entry) []byte {
+	dst = append(dst, "time="...)
+	dst = e.time.AppendFormat(dst, time.RFC3339Nano)
+	dst = append(dst, " level="...)
+	dst = append(dst, e.level.String()...)
+	dst = append(dst, " category="...)
+	dst = append(dst, e.category.String()...)
+	dst = append(dst, " msg="...)
+	dst = strconv.AppendQuote(dst, fmt.Sprintf(e.format, e.args...))
+	return append(dst, '\n')
+}
+
+// std is the logger behind the package-level functions. Until Init installs one
+// they fall back to the standard log package.
+var std atomic.Pointer[Logger]
+
+// Init makes l the logger behind the package-level functions.
+func Init(l *Logger) {
+	std.Store(l)
+}
+
+// Logf queues a message on the package's logger.
+func Logf(level Level, cat Category, format string, args ...interface{}) {
+	if l := std.Load(); l != nil {
+		l.Logf(level, cat, format, args...)
+		return
+	}
+	if level >= LevelInfo {
+		log.Printf(format, args...)
+	}
+}
+
+// Debugf logs a debug message.
+func Debugf(cat Category, format string, args ...interface{}) {
+	Logf(LevelDebug, cat, format, args...)
+}
+
+// Infof logs an informational message.
+func Infof(cat Category, format string, args ...interface{}) {
+	Logf(LevelInfo, cat, format, args...)
+}
+
+// Warnf logs a warning.
+func Warnf(cat Category, format string, args ...interface{}) {
+	Logf(LevelWarn, cat, format, args...)
+}
+
+// Errorf logs an error.
+func Errorf(cat Category, format string, args ...interface{}) {
+	Logf(LevelError, cat, format, args...)
+}
@@ -0,0 +1,134 @@
+package logging
+
+import (
+	"bytes"
+	"strings"
+	"sync"
+	"testing"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+
+	"github.com/stretchr/testify/assert"
+	"github.com/stretchr/testify/require"
+)
+
+// syncBuffer is a bytes.Buffer safe to read while the writer goroutine writes.
+type syncBuffer struct {
+	mu  sync.Mutex
+	buf bytes.Buffer
+}
+
+func (b *syncBuffer) Write(p []byte) (int, error) {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	return b.buf.Write(p)
+}
+
+func (b *syncBuffer) lines() []string {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+	return strings.Split(strings.TrimSuffix(b.buf.String(), "\n"), "\n")
+}
+
+func newTestLogger(t *testing.T, cfg *config.Config) (*Logger, *syncBuffer) {
+	t.Helper()
+	out := &syncBuffer{}
+	l, err := New(cfg, out, metrics.NewMetrics())
+	require.NoError(t, err)
+	return l, out
+}
+
+func TestRingDropsWhenFull(t *testing.T) {
+	r := newRing(3) // rounded up to 4
+	for i := 0; i < 4; i++ {
+		require.True(t, r.push(entry{format: "m"}))
+	}
+	assert.False(t, r.push(entry{format: "m"}))
+
+	_, ok := r.pop()
+	require.True(t, ok)
+	assert.True(t, r.push(entry{format: "m"}), "a popped slot is reused")
+}
+
+func TestRingConcurrentProducers(t *testing.T) {
+	r := newRing(1 << 12)
+	var wg sync.WaitGroup
+	for p := 0; p < 8; p++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := 0; i < 500; i++ {
+				r.push(entry{format: "m"})
+			}
+		}()
+	}
+	wg.Wait()
+
+	n := 0
+	for {
+		if _, ok := r.pop(); !ok {
+			break
+		}
+		n++
+	}
+	assert.Equal(t, 8*500, n)
+}
+
+func TestLoggerLevelsSamplingAndRateLimit(t *testing.T) {
+	cfg := &config.Config{
+		LogLevel:      "info",
+		LogBufferSize: 1024,
+		LogRateLimit:  5,
+		LogSampling:   map[string]int{"dnssec": 10},
+	}
+	l, out := newTestLogger(t, cfg)
+
+	l.Logf(LevelDebug, CategoryQuery, "hidden")
+	l.Logf(LevelWarn, CategoryQuery, "failed to resolve %s", "example.com.")
+	for i := 0; i < 100; i++ {
+		l.Logf(LevelInfo, CategoryDNSSEC, "validated %d", i) // 1 in 10 sampled
+		l.Logf(LevelInfo, CategoryPlugin, "query %d", i)     // 5 a second
+	}
+	require.NoError(t, l.Close())
+
+	lines := out.lines()
+	assert.Contains(t, lines[0], `level=warn category=query msg="failed to resolve example.com."`)
+	assert.True(t, strings.HasPrefix(lines[0], "time="))
+
+	var dnssec, plugin int
+	for _, line := range lines {
+		assert.NotContains(t, line, "hidden")
+		switch {
+		case strings.Contains(line, "category=dnssec"):
+			dnssec++
+		case strings.Contains(line, "category=plugin"):
+			plugin++
+		}
+	}
+	// A second may tick over during the loop, letting through another 5.
+	assert.GreaterOrEqual(t, dnssec, 5, "sampled 1 in 10, then rate limited")
+	assert.LessOrEqual(t, dnssec, 10, "sampled 1 in 10")
+	assert.GreaterOrEqual(t, plugin, 5)
+	assert.LessOrEqual(t, plugin, 10, "rate limited to 5 a second")
+}
+
+func TestNewRejectsUnknownSettings(t *testing.T) {
+	_, err := New(&config.Config{LogLevel: "loud"}, &bytes.Buffer{}, metrics.NewMetrics())
+	assert.Error(t, err)
+	_, err = New(&config.Config{LogLevel: "info", LogSampling: map[string]int{"nope": 2}}, &bytes.Buffer{}, metrics.NewMetrics())
+	assert.Error(t, err)
+}
+
+func TestNewDefaultsUnsetSettings(t *testing.T) {
+	// A config saved before the Log* settings existed.
+	l, out := newTestLogger(t, &config.Config{})
+	assert.Equal(t, LevelInfo, l.level)
+	assert.Equal(t, uint64(defaultBufferSize-1), l.ring.mask)
+
+	l.Logf(LevelDebug, CategoryQuery, "hidden")
+	l.Logf(LevelInfo, CategoryQuery, "shown")
+	require.NoError(t, l.Close())
+	assert.Len(t, out.lines(), 1)
+	assert.Contains(t, out.lines()[0], `level=info category=query msg="shown"`)
+}
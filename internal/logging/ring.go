@@ -0,0 +1,80 @@
+package logging
+
+import (
+	"sync/atomic"
+	"time"
+)
+
+// entry is a log message waiting to be written. It is formatted by the writer,
+// not the caller.
+type entry struct {
+	time     time.Time
+	level    Level
+	category Category
+	format   string
+	args     []interface{}
+}
+
+type slot struct {
+	seq atomic.Uint64
+	e   entry
+}
+
+// ring is a bounded lock-free queue of entries for many producers and a single
+// consumer (Vyukov's bounded MPMC queue, with the consumer side simplified).
+// Each slot's sequence number says whose turn it is: a producer claims a slot
+// by advancing head with a CAS, fills it and publishes it by bumping the
+// sequence; the consumer takes it and hands it back one lap later. A full ring
+// refuses new entries instead of blocking.
+type ring struct {
+	head  atomic.Uint64
+	_     [56]byte // keep producers' head off the consumer's cache line
+	tail  uint64   // only the consumer touches it
+	mask  uint64
+	slots []slot
+}
+
+// newRing returns a ring of at least size slots, rounded up to a power of two.
+func newRing(size int) *ring {
+	n := 1
+	for n < size {
+		n <<= 1
+	}
+	r := &ring{mask: uint64(n - 1), slots: make([]slot, n)}
+	for i := range r.slots {
+		r.slots[i].seq.Store(uint64(i))
+	}
+	return r
+}
+
+// push queues e and reports whether there was room for it.
+func (r *ring) push(e entry) bool {
+	for {
+		pos := r.head.Load()
+		s := &r.slots[pos&r.mask]
+		switch dif := int64(s.seq.Load() - pos); {
+		case dif == 0:
+			if r.head.CompareAndSwap(pos, pos+1) {
+				s.e = e
+				s.seq.Store(pos + 1)
+				return true
+			}
+		case dif < 0:
+			return false // the consumer hasn't freed the slot a lap ago
+		}
+		// Another producer took the slot; try the next one.
+	}
+}
+
+// pop takes the oldest entry off the ring. Only the writer goroutine calls it.
+func (r *ring) pop() (entry, bool) {
+	s := &r.slots[r.tail&r.mask]
+	if s.seq.Load() != r.tail+1 {
+		return entry{}, false
+	}
+	e := s.e
+	s.e = entry{}
+	s.seq.Store(r.tail + r.mask + 1)
+	r.tail++
+	return e, true
+}
@@ -0,0 +1,152 @@
+package metrics
+
+import (
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"unsafe"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// counterStripes is the number of cache lines a stripedCounter is spread over.
+const counterStripes = 32
+
+// paddedCounter is a counter alone on its cache line, so that cores
+// incrementing neighbouring counters don't contend.
+type paddedCounter struct {
+	n atomic.Uint64
+	_ [56]byte
+}
+
+// stripedCounter is a counter for the query hot path. Increments go to one of
+// several cache-line-padded stripes, so that concurrent queries rarely write to
+// the same line; reads add the stripes up, which only scrapes and the dashboard
+// do.
+type stripedCounter struct {
+	stripes [counterStripes]paddedCounter
+}
+
+// stripe picks a stripe for the calling goroutine from the address of a local
+// variable. Goroutines run on separate stacks, so concurrent callers mostly land
+// on different stripes, while a listener's read loop keeps to its own.
+func stripe() uint64 {
+	var local byte
+	p := uint64(uintptr(unsafe.Pointer(&local)))
+	return (p >> 12) * 0x9E3779B97F4A7C15 >> 59 // Fibonacci hash to 5 bits
+}
+
+// Add adds n to the counter.
+func (c *stripedCounter) Add(n uint64) {
+	c.stripes[stripe()].n.Add(n)
+}
+
+// Inc increments the counter.
+func (c *stripedCounter) Inc() {
+	c.Add(1)
+}
+
+// Load returns the counter's value.
+func (c *stripedCounter) Load() uint64 {
+	var n uint64
+	for i := range c.stripes {
+		n += c.stripes[i].n.Load()
+	}
+	return n
+}
+
+// labelCounter counts one label value of a breakdown such as query types.
+type labelCounter struct {
+	label string
+	count stripedCounter
+}
+
+// labelCounters is a counter broken down by a DNS code such as the query type or
+// rcode, exported as one Prometheus counter per label value. Counters for the
+// codes below 256 that have a name are made up front, so counting one is an
+// array index and a striped increment: no map lookup, label hashing or lock.
+// Other codes are kept in an immutable map; the first sighting of one copies the
+// map under mu. The counts reach Prometheus only when it scrapes, through
+// Collect.
+type labelCounters struct {
+	desc   *prometheus.Desc
+	prefix string // label of unnamed codes, followed by the number
+	known  [256]*labelCounter
+	mu     sync.Mutex
+	other  atomic.Pointer[map[int]*labelCounter]
+}
+
+// newLabelCounters returns counters for the codes in names, exported as the
+// counter vector name with the code's name as label labelName.
+func newLabelCounters(name, help, labelName string, names map[int]string, prefix string) *labelCounters {
+	l := &labelCounters{
+		desc:   prometheus.NewDesc(name, help, []string{labelName}, nil),
+		prefix: prefix,
+	}
+	for code, label := range names {
+		if code >= 0 && code < len(l.known) {
+			l.known[code] = &labelCounter{label: label}
+		}
+	}
+	l.other.Store(&map[int]*labelCounter{})
+	return l
+}
+
+// Inc increments the counter for code.
+func (l *labelCounters) Inc(code int) {
+	if code >= 0 && code < len(l.known) {
+		if c := l.known[code]; c != nil {
+			c.count.Inc()
+			return
+		}
+	}
+	c, ok := (*l.other.Load())[code]
+	if !ok {
+		c = l.add(code)
+	}
+	c.count.Inc()
+}
+
+func (l *labelCounters) add(code int) *labelCounter {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	old := *l.other.Load()
+	if c, ok := old[code]; ok {
+		return c
+	}
+	counters := make(map[int]*labelCounter, len(old)+1)
+	for k, v := range old {
+		counters[k] = v
+	}
+	c := &labelCounter{label: l.prefix + strconv.Itoa(code)}
+	counters[code] = c
+	l.other.Store(&counters)
+	return c
+}
+
+// Range calls f with every label value counted so far and its count.
+func (l *labelCounters) Range(f func(label string, count int64)) {
+	for _, c := range l.known {
+		if c != nil {
+			if n := c.count.Load(); n > 0 {
+				f(c.label, int64(n))
+			}
+		}
+	}
+	for _, c := range *l.other.Load() {
+		f(c.label, int64(c.count.Load()))
+	}
+}
+
+// Describe implements prometheus.Collector.
+func (l *labelCounters) Describe(ch chan<- *prometheus.Desc) {
+	ch <- l.desc
+}
+
+// Collect implements prometheus.Collector.
+func (l *labelCounters) Collect(ch chan<- prometheus.Metric) {
+	l.Range(func(label string, count int64) {
+		ch <- prometheus.MustNewConstMetric(l.desc, prometheus.CounterValue, float64(count), label)
+	})
+}
@@ -0,0 +1,89 @@
+package metrics
+
+import (
+	"math/bits"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	// hdrSubBucketBits sets the precision of an hdrHistogram: values are kept to
+	// within 1/2^(hdrSubBucketBits-1), under 2%.
+	hdrSubBucketBits = 7
+	hdrSubBuckets    = 1 << hdrSubBucketBits
+	hdrHalfBuckets   = hdrSubBuckets / 2
+	// hdrMaxBits bounds the values an hdrHistogram tells apart to 2^hdrMaxBits
+	// microseconds, about a minute; longer ones are counted as the largest.
+	hdrMaxBits  = 26
+	hdrMaxValue = 1<<hdrMaxBits - 1
+	hdrBuckets  = (hdrMaxBits-hdrSubBucketBits)*hdrHalfBuckets + hdrSubBuckets
+)
+
+// hdrHistogram is a fixed-size, lock-free latency histogram in the style of
+// HdrHistogram: buckets are log-linear, so every value from 1µs to about a
+// minute is kept to two significant digits in 1344 counters,
+// and percentiles can be read off exactly rather than interpolated between
+// wide Prometheus buckets.
+type hdrHistogram struct {
+	counts [hdrBuckets]atomic.Uint64
+	total  atomic.Uint64
+}
+
+// hdrIndex returns the bucket of v microseconds. Values below hdrSubBuckets get
+// a bucket each; above that each power of two is split into hdrHalfBuckets.
+func hdrIndex(v uint64) int {
+	if v > hdrMaxValue {
+		v = hdrMaxValue
+	}
+	if v < hdrSubBuckets {
+		return int(v)
+	}
+	shift := bits.Len64(v) - hdrSubBucketBits
+	return shift*hdrHalfBuckets + int(v>>shift)
+}
+
+// hdrValue returns the midpoint of bucket i, in microseconds.
+func hdrValue(i int) uint64 {
+	if i < hdrSubBuckets {
+		return uint64(i)
+	}
+	shift := i/hdrHalfBuckets - 1
+	sub := uint64(i%hdrHalfBuckets + hdrHalfBuckets)
+	return sub<<shift + (1<<shift)/2
+}
+
+// record counts one observation of d.
+func (h *hdrHistogram) record(d time.Duration) {
+	if d < 0 {
+		d = 0
+	}
+	h.counts[hdrIndex(uint64(d/time.Microsecond))].Add(1)
+	h.total.Add(1)
+}
+
+// quantiles returns the value at each quantile in qs, which must be ascending,
+// and the number of observations. Recording may go on meanwhile; the result is
+// then approximate.
+func (h *hdrHistogram) quantiles(qs []float64) ([]time.Duration, uint64) {
+	total := h.total.Load()
+	values := make([]time.Duration, len(qs))
+	if total == 0 {
+		return values, 0
+	}
+	var seen uint64
+	q := 0
+	for i := range h.counts {
+		seen += h.counts[i].Load()
+		for q < len(qs) && float64(seen) >= qs[q]*float64(total) {
+			values[q] = time.Duration(hdrValue(i)) * time.Microsecond
+			q++
+		}
+		if q == len(qs) {
+			break
+		}
+	}
+	for ; q < len(qs); q++ {
+		values[q] = time.Duration(hdrValue(hdrBuckets-1)) * time.Microsecond
+	}
+	return values, total
+}
@@ -0,0 +1,30 @@
+package metrics
+
+import (
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/assert"
+)
+
+func TestHDRHistogramQuantiles(t *testing.T) {
+	var h hdrHistogram
+	for i := 1; i <= 1000; i++ {
+		h.record(time.Duration(i) * time.Millisecond)
+	}
+	h.record(5 * time.Minute) // beyond the range, counted as the largest value
+
+	q, n := h.quantiles([]float64{0.5, 0.99, 1})
+	assert.Equal(t, uint64(1001), n)
+	assert.InEpsilon(t, float64(500*time.Millisecond), float64(q[0]), 0.02)
+	assert.InEpsilon(t, float64(990*time.Millisecond), float64(q[1]), 0.02)
+	assert.InEpsilon(t, float64(hdrMaxValue*time.Microsecond), float64(q[2]), 0.02)
+}
+
+func TestHDRIndexRoundTrips(t *testing.T) {
+	for _, v := range []uint64{0, 1, 127, 128, 129, 1000, 12345, 1 << 20, hdrMaxValue} {
+		i := hdrIndex(v)
+		assert.Less(t, i, hdrBuckets)
+		assert.InEpsilon(t, float64(v)+1, float64(hdrValue(i))+1, 0.02, "value %d", v)
+	}
+}
@@ -3,27 +3,23 @@ package metrics
 import (
 	"encoding/json"
 	"log"
+	"math"
 	"net/http"
 	"runtime"
 	"sort"
+	"strconv"
 	"sync"
 	"time"
 
+	"github.com/miekg/dns"
 	"github.com/prometheus/client_golang/prometheus"
 	"github.com/prometheus/client_golang/prometheus/promauto"
 	"github.com/prometheus/client_golang/prometheus/promhttp"
 	"github.com/shirou/gopsutil/v3/cpu"
 	"github.com/shirou/gopsutil/v3/mem"
 	"github.com/shirou/gopsutil/v3/net"
-	"github.com/dgraph-io/ristretto"
 )
 
-// LatencyStat holds the total latency and count for a domain.
-type LatencyStat struct {
-	TotalLatency time.Duration
-	Count        int64
-}
-
 // JSON-friendly structs for the dashboard
 type DomainCount struct {
 	Domain string `json:"domain"`
@@ -54,30 +50,41 @@ type DashboardMetrics struct {
 	CacheHits         int64           `json:"cache_hits"`
 	CacheMisses       int64           `json:"cache_misses"`
 	CacheHitRate      float64         `json:"cache_hit_rate"`
+	CacheL1HitRate    float64         `json:"cache_l1_hit_rate"`
+	CacheL2HitRate    float64         `json:"cache_l2_hit_rate"`
 	TopNXDomains      []DomainCount   `json:"top_nx_domains"`
 	TopLatencyDomains []DomainLatency `json:"top_latency_domains"`
 	QueryTypes        []TypeCount     `json:"query_types"`
 	ResponseCodes     []CodeCount     `json:"response_codes"`
+	StageLatencies    []StageLatency  `json:"stage_latencies"`
 }
 
-// Metrics holds the collected metrics.
+// Metrics holds the collected metrics. The counters updated for every query are
+// striped and lock-free; Prometheus and the dashboard add them up when they read
+// them. The mutex guards the fields updated by the background collectors.
 type Metrics struct {
 	sync.RWMutex
-	totalQueries      int64
+	queries           stripedCounter
+	cacheHits         stripedCounter
+	cacheMisses       stripedCounter
 	startTime         time.Time
-	topNXDomains      sync.Map // map[string]int64
-	topLatencyDomains sync.Map // map[string]LatencyStat
-	queryTypes        sync.Map // map[string]int64
-	responseCodes     sync.Map // map[string]int64
+	topNXDomains      *topK // weighted by NXDOMAIN answers
+	topLatencyDomains *topK // weighted by resolution time
+	queryTypes        *labelCounters
+	responseCodes     *labelCounters
+	stages            *stageHistograms
 	registry          *prometheus.Registry
+	upstreams         func() []UpstreamState // the backend's infrastructure table, if any
 
 	// Fields for direct access by JSON handler
 	qps            float64
 	cpuUsage       float64
 	memoryUsage    float64
 	goroutineCount int
-	cacheHits      int64
-	cacheMisses    int64
+	cacheL1Hits    uint64
+	cacheL2Hits    uint64
+	cacheL1Rate    float64
+	cacheL2Rate    float64
 }
 
 var (
@@ -88,10 +95,6 @@ var (
 		Name: "dns_resolver_qps",
 		Help: "Queries per second",
 	})
-	promTotalQueries = promauto.NewCounter(prometheus.CounterOpts{
-		Name: "dns_resolver_total_queries",
-		Help: "Total number of DNS queries",
-	})
 	promCacheProbation = promauto.NewGauge(prometheus.GaugeOpts{
 		Name: "dns_resolver_cache_probation_size",
 		Help: "Size of the probation segment of the cache",
@@ -100,6 +103,42 @@ var (
 		Name: "dns_resolver_cache_protected_size",
 		Help: "Size of the protected segment of the cache",
 	})
+	promCacheL1Hits = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_l1_hits_total",
+		Help: "Total number of cache lookups answered by the L1 of hot entries",
+	})
+	promCacheL2Hits = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_l2_hits_total",
+		Help: "Total number of cache lookups answered behind the L1",
+	})
+	promCacheL1HitRate = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_cache_l1_hit_rate",
+		Help: "Fraction of cache lookups answered by the L1",
+	})
+	promCacheL2HitRate = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_cache_l2_hit_rate",
+		Help: "Fraction of cache lookups answered behind the L1",
+	})
+	promCacheBytes = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_cache_bytes",
+		Help: "Bytes charged for the entries in the cache by query type",
+	}, []string{"qtype"})
+	promCacheMaxBytes = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_cache_max_bytes",
+		Help: "Memory budget of the cache in bytes",
+	})
+	promCachePressureEvictions = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_pressure_evictions_total",
+		Help: "Total number of unexpired cache entries evicted to stay within the memory budget by query type",
+	}, []string{"qtype"})
+	promCachePressureEvictedBytes = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_pressure_evicted_bytes_total",
+		Help: "Total bytes of unexpired cache entries evicted to stay within the memory budget by query type",
+	}, []string{"qtype"})
+	promRRsetCacheBytes = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_rrset_cache_bytes",
+		Help: "Bytes charged for the RRsets in the RRset cache",
+	})
 	promCPUUsage = promauto.NewGauge(prometheus.GaugeOpts{
 		Name: "dns_resolver_cpu_usage_percent",
 		Help: "Current CPU usage percentage",
@@ -128,18 +167,14 @@ var (
 		Name: "dns_resolver_top_latency_domains_ms",
 		Help: "Top domains by average query latency in milliseconds",
 	}, []string{"domain"})
-	promQueryTypes = promauto.NewCounterVec(prometheus.CounterOpts{
-		Name: "dns_resolver_query_types_total",
-		Help: "Total number of queries by type",
-	}, []string{"type"})
-	promResponseCodes = promauto.NewCounterVec(prometheus.CounterOpts{
-		Name: "dns_resolver_response_codes_total",
-		Help: "Total number of responses by code",
-	}, []string{"code"})
 	promUnboundErrors = promauto.NewCounter(prometheus.CounterOpts{
 		Name: "dns_resolver_unbound_errors_total",
 		Help: "Total number of errors from the Unbound resolver",
 	})
+	promUnboundCancelled = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_unbound_cancelled_total",
+		Help: "Total number of Unbound lookups abandoned because no client waited for them any more or they timed out",
+	})
 	promDNSSECValidation = promauto.NewCounterVec(prometheus.CounterOpts{
 		Name: "dns_resolver_dnssec_validation_total",
 		Help: "Total number of DNSSEC validation results by type",
@@ -148,18 +183,38 @@ var (
 		Name: "dns_resolver_cache_revalidations_total",
 		Help: "Total number of cache revalidations",
 	})
-	promCacheHits = promauto.NewCounter(prometheus.CounterOpts{
-		Name: "dns_resolver_cache_hits_total",
-		Help: "Total number of cache hits",
-	})
-	promCacheMisses = promauto.NewCounter(prometheus.CounterOpts{
-		Name: "dns_resolver_cache_misses_total",
-		Help: "Total number of cache misses",
-	})
 	promCacheEvictions = promauto.NewCounter(prometheus.CounterOpts{
 		Name: "dns_resolver_cache_evictions_total",
 		Help: "Total number of cache evictions",
 	})
+	promRRsetAnswers = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_rrset_answers_total",
+		Help: "Total number of answers composed from cached RRsets after a message cache miss",
+	})
+	promNXDomainCutHits = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_nxdomain_cut_hits_total",
+		Help: "Total number of queries answered from a cached NXDOMAIN for the name or an ancestor",
+	})
+	promAggressiveNSEC = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_aggressive_nsec_total",
+		Help: "Total number of negative answers synthesized from cached NSEC/NSEC3 records by rcode",
+	}, []string{"rcode"})
+	promECSCacheEntries = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_ecs_cache_entries",
+		Help: "Number of cached answers scoped to a client subnet",
+	})
+	promECSCacheBytes = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_ecs_cache_bytes",
+		Help: "Bytes charged for cached answers scoped to a client subnet",
+	})
+	promECSAnswers = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_ecs_answers_total",
+		Help: "Total number of answers to ECS queries cached, by returned scope prefix length",
+	}, []string{"scope"})
+	promStaleServed = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_cache_stale_served_total",
+		Help: "Total number of expired cache entries served because the upstream failed, by reason",
+	}, []string{"reason"})
 	promLMDBCacheLoads = promauto.NewCounter(prometheus.CounterOpts{
 		Name: "dns_resolver_lmdb_loads_total",
 		Help: "Total number of items loaded from LMDB",
@@ -168,10 +223,62 @@ var (
 		Name: "dns_resolver_lmdb_errors_total",
 		Help: "Total number of LMDB errors",
 	})
+	promLMDBWrites = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_lmdb_writes_total",
+		Help: "Total number of cache entries written to LMDB",
+	})
+	promLMDBJournalDrops = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_lmdb_journal_drops_total",
+		Help: "Total number of cache entries not written to LMDB because the journal queue was full",
+	})
+	promRefreshQueueDepth = promauto.NewGauge(prometheus.GaugeOpts{
+		Name: "dns_resolver_refresh_queue_depth",
+		Help: "Number of revalidations and prefetches waiting for a worker",
+	})
+	promRefreshDrops = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_refresh_drops_total",
+		Help: "Total number of revalidations and prefetches not queued, by kind and reason",
+	}, []string{"kind", "reason"})
 	promPrefetches = promauto.NewCounter(prometheus.CounterOpts{
 		Name: "dns_resolver_prefetches_total",
 		Help: "Total number of cache prefetches",
 	})
+	promLogDrops = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_log_dropped_total",
+		Help: "Total number of log messages shed by sampling, rate limiting or a full queue",
+	}, []string{"category", "reason"})
+	promDnstapFrames = promauto.NewCounter(prometheus.CounterOpts{
+		Name: "dns_resolver_dnstap_frames_total",
+		Help: "Total number of dnstap frames written",
+	})
+	promDnstapDrops = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_dnstap_dropped_total",
+		Help: "Total number of dnstap frames dropped",
+	}, []string{"reason"})
+	promListenerReceives = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_listener_receives_total",
+		Help: "Total number of messages read per listener socket",
+	}, []string{"proto", "socket"})
+	promUnboundQueries = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_unbound_queries_total",
+		Help: "Total number of lookups sent to each Unbound context",
+	}, []string{"context"})
+	promUnboundOutstanding = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_unbound_outstanding",
+		Help: "Number of lookups in progress in each Unbound context, including abandoned ones",
+	}, []string{"context"})
+	promUnboundCacheBytes = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_unbound_cache_bytes",
+		Help: "Configured size of each Unbound context's message and RRset caches",
+	}, []string{"context", "cache"})
+	promForwardQueries = promauto.NewCounterVec(prometheus.CounterOpts{
+		Name: "dns_resolver_forward_queries_total",
+		Help: "Total number of queries forwarded to each upstream by result",
+	}, []string{"upstream", "result"})
+	promForwardConns = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_forward_connections",
+		Help: "Number of open persistent TCP and DoT connections to each upstream",
+	}, []string{"upstream"})
 )
 
 // NewMetrics returns the singleton instance of Metrics.
@@ -181,10 +288,34 @@ func NewMetrics() *Metrics {
 		registry.MustRegister(prometheus.NewProcessCollector(prometheus.ProcessCollectorOpts{}))
 		registry.MustRegister(prometheus.NewGoCollector())
 		
+		qtypes := make(map[int]string, len(dns.TypeToString))
+		for qtype, name := range dns.TypeToString {
+			qtypes[int(qtype)] = name
+		}
 		instance = &Metrics{
-			startTime: time.Now(),
-			registry:  registry,
+			startTime:         time.Now(),
+			registry:          registry,
+			topNXDomains:      newTopK(topDomainsCapacity),
+			topLatencyDomains: newTopK(topDomainsCapacity),
+			stages:            newStageHistograms(),
+			queryTypes: newLabelCounters("dns_resolver_query_types_total",
+				"Total number of queries by type", "type", qtypes, "TYPE"),
+			responseCodes: newLabelCounters("dns_resolver_response_codes_total",
+				"Total number of responses by code", "code", dns.RcodeToString, "RCODE"),
 		}
+		prometheus.MustRegister(instance.queryTypes, instance.responseCodes, upstreamHealth{instance})
+		promauto.NewCounterFunc(prometheus.CounterOpts{
+			Name: "dns_resolver_total_queries",
+			Help: "Total number of DNS queries",
+		}, func() float64 { return float64(instance.queries.Load()) })
+		promauto.NewCounterFunc(prometheus.CounterOpts{
+			Name: "dns_resolver_cache_hits_total",
+			Help: "Total number of cache hits",
+		}, func() float64 { return float64(instance.cacheHits.Load()) })
+		promauto.NewCounterFunc(prometheus.CounterOpts{
+			Name: "dns_resolver_cache_misses_total",
+			Help: "Total number of cache misses",
+		}, func() float64 { return float64(instance.cacheMisses.Load()) })
 		go instance.qpsCalculator()
 		go instance.systemMetricsCollector()
 		go instance.topDomainsProcessor()
@@ -203,6 +334,7 @@ func (m *Metrics) StartMetricsServer(addr string) {
 	))
 
 	mux.HandleFunc("/dashboard", m.dashboardHandler)
+	mux.HandleFunc("/debug/upstreams", m.upstreamsHandler)
 
 	// Добавляем эндпоинт для проверки здоровья
 	mux.HandleFunc("/health", func(w http.ResponseWriter, r *http.Request) {
@@ -227,61 +359,49 @@ func (m *Metrics) JSONMetricsHandler(w http.ResponseWriter, r *http.Request) {
 	defer m.RUnlock()
 
 	var topNXDomains []DomainCount
-	m.topNXDomains.Range(func(key, value interface{}) bool {
-		topNXDomains = append(topNXDomains, DomainCount{Domain: key.(string), Count: value.(int64)})
-		return true
-	})
-	sort.Slice(topNXDomains, func(i, j int) bool { return topNXDomains[i].Count > topNXDomains[j].Count })
-	if len(topNXDomains) > 10 {
-		topNXDomains = topNXDomains[:10]
+	for _, e := range m.topNXDomains.heaviest(10) {
+		topNXDomains = append(topNXDomains, DomainCount{Domain: e.domain, Count: int64(math.Round(e.weight))})
 	}
 
 	var topLatencyDomains []DomainLatency
-	m.topLatencyDomains.Range(func(key, value interface{}) bool {
-		stat := value.(LatencyStat)
-		if stat.Count > 0 {
-			avgLatency := stat.TotalLatency.Seconds() * 1000 / float64(stat.Count)
-			topLatencyDomains = append(topLatencyDomains, DomainLatency{Domain: key.(string), AvgLatency: avgLatency})
-		}
-		return true
-	})
-	sort.Slice(topLatencyDomains, func(i, j int) bool { return topLatencyDomains[i].AvgLatency > topLatencyDomains[j].AvgLatency })
-	if len(topLatencyDomains) > 10 {
-		topLatencyDomains = topLatencyDomains[:10]
+	for _, e := range m.topLatencyDomains.highestAverage(10) {
+		topLatencyDomains = append(topLatencyDomains, DomainLatency{Domain: e.domain, AvgLatency: e.average()})
 	}
 
 	var queryTypes []TypeCount
-	m.queryTypes.Range(func(key, value interface{}) bool {
-		queryTypes = append(queryTypes, TypeCount{Type: key.(string), Count: value.(int64)})
-		return true
+	m.queryTypes.Range(func(qtype string, count int64) {
+		queryTypes = append(queryTypes, TypeCount{Type: qtype, Count: count})
 	})
 	sort.Slice(queryTypes, func(i, j int) bool { return queryTypes[i].Count > queryTypes[j].Count })
 
 	var responseCodes []CodeCount
-	m.responseCodes.Range(func(key, value interface{}) bool {
-		responseCodes = append(responseCodes, CodeCount{Code: key.(string), Count: value.(int64)})
-		return true
+	m.responseCodes.Range(func(rcode string, count int64) {
+		responseCodes = append(responseCodes, CodeCount{Code: rcode, Count: count})
 	})
 	sort.Slice(responseCodes, func(i, j int) bool { return responseCodes[i].Count > responseCodes[j].Count })
 
+	cacheHits, cacheMisses := int64(m.cacheHits.Load()), int64(m.cacheMisses.Load())
 	var cacheHitRate float64
-	if m.cacheHits+m.cacheMisses > 0 {
-		cacheHitRate = float64(m.cacheHits) / float64(m.cacheHits+m.cacheMisses) * 100
+	if cacheHits+cacheMisses > 0 {
+		cacheHitRate = float64(cacheHits) / float64(cacheHits+cacheMisses) * 100
 	}
 
 	data := DashboardMetrics{
 		QPS:               m.qps,
-		TotalQueries:      m.totalQueries,
+		TotalQueries:      int64(m.queries.Load()),
 		CPUUsage:          m.cpuUsage,
 		MemoryUsage:       m.memoryUsage,
 		Goroutines:        m.goroutineCount,
-		CacheHits:         m.cacheHits,
-		CacheMisses:       m.cacheMisses,
+		CacheHits:         cacheHits,
+		CacheMisses:       cacheMisses,
 		CacheHitRate:      cacheHitRate,
+		CacheL1HitRate:    m.cacheL1Rate,
+		CacheL2HitRate:    m.cacheL2Rate,
 		TopNXDomains:      topNXDomains,
 		TopLatencyDomains: topLatencyDomains,
 		QueryTypes:        queryTypes,
 		ResponseCodes:     responseCodes,
+		StageLatencies:    m.stages.latencies(),
 	}
 
 	w.Header().Set("Content-Type", "application/json")
@@ -293,10 +413,7 @@ func (m *Metrics) JSONMetricsHandler(w http.ResponseWriter, r *http.Request) {
 
 // IncrementQueries increments the total number of queries.
 func (m *Metrics) IncrementQueries() {
-	m.Lock()
-	defer m.Unlock()
-	m.totalQueries++
-	promTotalQueries.Inc()
+	m.queries.Inc()
 }
 
 // qpsCalculator calculates the QPS every second.
@@ -304,10 +421,10 @@ func (m *Metrics) qpsCalculator() {
 	ticker := time.NewTicker(1 * time.Second)
 	defer ticker.Stop()
 
-	var lastQueryCount int64
+	var lastQueryCount uint64
 	for range ticker.C {
 		m.Lock()
-		currentQueries := m.totalQueries
+		currentQueries := m.queries.Load()
 		qps := float64(currentQueries - lastQueryCount)
 		lastQueryCount = currentQueries
 		m.qps = qps
@@ -356,122 +473,77 @@ func (m *Metrics) systemMetricsCollector() {
 	}
 }
 
-// UpdateCacheStats updates the cache statistics.
-func (m *Metrics) UpdateCacheStats(ristrettoMetrics *ristretto.Metrics) {
-    if ristrettoMetrics == nil {
-        return
-    }
-    // These are counters, so we should set them to their current value.
-    promCacheHits.Add(float64(ristrettoMetrics.GetsKept()))
-    promCacheMisses.Add(float64(ristrettoMetrics.GetsDropped()))
-    promCacheEvictions.Add(float64(ristrettoMetrics.CostEvicted()))
+// UpdateCacheTierStats takes the cache's running L1 hit, L2 hit and miss counts.
+// L1 hits are counted by the cache alone to keep them off shared memory, so
+// this is also where they reach the overall hit counts.
+func (m *Metrics) UpdateCacheTierStats(l1Hits, l2Hits, misses uint64) {
+	var l1Rate, l2Rate float64
+	if total := l1Hits + l2Hits + misses; total > 0 {
+		l1Rate = float64(l1Hits) / float64(total)
+		l2Rate = float64(l2Hits) / float64(total)
+	}
+
+	m.Lock()
+	l1Delta, l2Delta := l1Hits-m.cacheL1Hits, l2Hits-m.cacheL2Hits
+	m.cacheL1Hits, m.cacheL2Hits = l1Hits, l2Hits
+	m.cacheL1Rate, m.cacheL2Rate = l1Rate, l2Rate
+	m.Unlock()
+
+	m.cacheHits.Add(l1Delta)
+	promCacheL1Hits.Add(float64(l1Delta))
+	promCacheL2Hits.Add(float64(l2Delta))
+	promCacheL1HitRate.Set(l1Rate)
+	promCacheL2HitRate.Set(l2Rate)
 }
 
 // RecordNXDOMAIN records an NXDOMAIN response for a given domain.
 func (m *Metrics) RecordNXDOMAIN(domain string) {
-	val, _ := m.topNXDomains.LoadOrStore(domain, int64(0))
-	m.topNXDomains.Store(domain, val.(int64)+1)
+	m.topNXDomains.observe(domain, 1, 1)
 }
 
 // RecordLatency records the query latency for a given domain.
 func (m *Metrics) RecordLatency(domain string, latency time.Duration) {
-	val, _ := m.topLatencyDomains.LoadOrStore(domain, LatencyStat{})
-	stat := val.(LatencyStat)
-	stat.TotalLatency += latency
-	stat.Count++
-	m.topLatencyDomains.Store(domain, stat)
+	ms := latency.Seconds() * 1000
+	m.topLatencyDomains.observe(domain, ms, ms)
 }
 
-// topDomainsProcessor periodically processes the domain maps to generate top lists.
+// topDomainsProcessor periodically decays the top-domains sketches and
+// publishes the top lists.
 func (m *Metrics) topDomainsProcessor() {
-	ticker := time.NewTicker(10 * time.Second)
+	const interval = 10 * time.Second
+	ticker := time.NewTicker(interval)
 	defer ticker.Stop()
 
 	for range ticker.C {
+		m.topNXDomains.decay(interval)
+		m.topLatencyDomains.decay(interval)
 		m.processTopNXDomains()
 		m.processTopLatencyDomains()
 	}
 }
 
 func (m *Metrics) processTopNXDomains() {
-	var domains []struct {
-		Domain string
-		Count  int64
-	}
-	m.topNXDomains.Range(func(key, value interface{}) bool {
-		domains = append(domains, struct {
-			Domain string
-			Count  int64
-		}{key.(string), value.(int64)})
-		return true
-	})
-
-	// Sort and get top 10
-	// Simple bubble sort for demonstration
-	for i := 0; i < len(domains); i++ {
-		for j := i + 1; j < len(domains); j++ {
-			if domains[i].Count < domains[j].Count {
-				domains[i], domains[j] = domains[j], domains[i]
-			}
-		}
-	}
-	if len(domains) > 10 {
-		domains = domains[:10]
-	}
-
 	promTopNXDomains.Reset()
-	for _, d := range domains {
-		promTopNXDomains.WithLabelValues(d.Domain).Set(float64(d.Count))
+	for _, e := range m.topNXDomains.heaviest(10) {
+		promTopNXDomains.WithLabelValues(e.domain).Set(e.weight)
 	}
 }
 
 func (m *Metrics) processTopLatencyDomains() {
-	var domains []struct {
-		Domain     string
-		AvgLatency float64
-	}
-	m.topLatencyDomains.Range(func(key, value interface{}) bool {
-		stat := value.(LatencyStat)
-		if stat.Count > 0 {
-			avgLatency := stat.TotalLatency.Seconds() * 1000 / float64(stat.Count) // avg in ms
-			domains = append(domains, struct {
-				Domain     string
-				AvgLatency float64
-			}{key.(string), avgLatency})
-		}
-		return true
-	})
-
-	// Sort and get top 10
-	for i := 0; i < len(domains); i++ {
-		for j := i + 1; j < len(domains); j++ {
-			if domains[i].AvgLatency < domains[j].AvgLatency {
-				domains[i], domains[j] = domains[j], domains[i]
-			}
-		}
-	}
-	if len(domains) > 10 {
-		domains = domains[:10]
-	}
-
 	promTopLatencyDomains.Reset()
-	for _, d := range domains {
-		promTopLatencyDomains.WithLabelValues(d.Domain).Set(d.AvgLatency)
+	for _, e := range m.topLatencyDomains.highestAverage(10) {
+		promTopLatencyDomains.WithLabelValues(e.domain).Set(e.average())
 	}
 }
 
 // RecordQueryType records the type of a DNS query.
-func (m *Metrics) RecordQueryType(qtype string) {
-	val, _ := m.queryTypes.LoadOrStore(qtype, int64(0))
-	m.queryTypes.Store(qtype, val.(int64)+1)
-	promQueryTypes.WithLabelValues(qtype).Inc()
+func (m *Metrics) RecordQueryType(qtype uint16) {
+	m.queryTypes.Inc(int(qtype))
 }
 
 // RecordResponseCode records the response code of a DNS query.
-func (m *Metrics) RecordResponseCode(rcode string) {
-	val, _ := m.responseCodes.LoadOrStore(rcode, int64(0))
-	m.responseCodes.Store(rcode, val.(int64)+1)
-	promResponseCodes.WithLabelValues(rcode).Inc()
+func (m *Metrics) RecordResponseCode(rcode int) {
+	m.responseCodes.Inc(rcode)
 }
 
 // IncrementUnboundErrors increments the Unbound error counter.
@@ -479,6 +551,11 @@ func (m *Metrics) IncrementUnboundErrors() {
 	promUnboundErrors.Inc()
 }
 
+// IncrementUnboundCancelled increments the counter of abandoned Unbound lookups.
+func (m *Metrics) IncrementUnboundCancelled() {
+	promUnboundCancelled.Inc()
+}
+
 // RecordDNSSECValidation records a DNSSEC validation result.
 func (m *Metrics) RecordDNSSECValidation(result string) {
 	promDNSSECValidation.WithLabelValues(result).Inc()
@@ -491,18 +568,12 @@ func (m *Metrics) IncrementCacheRevalidations() {
 
 // IncrementCacheHits increments the cache hit counter.
 func (m *Metrics) IncrementCacheHits() {
-	m.Lock()
-	m.cacheHits++
-	m.Unlock()
-	promCacheHits.Inc()
+	m.cacheHits.Inc()
 }
 
 // IncrementCacheMisses increments the cache miss counter.
 func (m *Metrics) IncrementCacheMisses() {
-	m.Lock()
-	m.cacheMisses++
-	m.Unlock()
-	promCacheMisses.Inc()
+	m.cacheMisses.Inc()
 }
 
 // IncrementCacheEvictions increments the cache eviction counter.
@@ -510,6 +581,65 @@ func (m *Metrics) IncrementCacheEvictions() {
 	promCacheEvictions.Inc()
 }
 
+// SetCacheMaxBytes records the memory budget of the cache.
+func (m *Metrics) SetCacheMaxBytes(bytes int64) {
+	promCacheMaxBytes.Set(float64(bytes))
+}
+
+// AddCacheBytes adjusts the bytes held in the cache for qtype by delta.
+func (m *Metrics) AddCacheBytes(qtype string, delta int64) {
+	promCacheBytes.WithLabelValues(qtype).Add(float64(delta))
+}
+
+// RecordCachePressureEviction records an unexpired entry of bytes bytes evicted
+// to make room in the cache.
+func (m *Metrics) RecordCachePressureEviction(qtype string, bytes int64) {
+	promCachePressureEvictions.WithLabelValues(qtype).Inc()
+	promCachePressureEvictedBytes.WithLabelValues(qtype).Add(float64(bytes))
+}
+
+// AddRRsetCacheBytes adjusts the bytes held in the RRset cache by delta.
+func (m *Metrics) AddRRsetCacheBytes(delta int64) {
+	promRRsetCacheBytes.Add(float64(delta))
+}
+
+// IncrementRRsetAnswers increments the counter of answers composed from cached RRsets.
+func (m *Metrics) IncrementRRsetAnswers() {
+	promRRsetAnswers.Inc()
+}
+
+// IncrementNXDomainCutHits increments the counter of queries answered by an NXDOMAIN cut.
+func (m *Metrics) IncrementNXDomainCutHits() {
+	promNXDomainCutHits.Inc()
+}
+
+// RecordAggressiveNSEC records a negative answer synthesized from cached NSEC/NSEC3 records.
+func (m *Metrics) RecordAggressiveNSEC(rcode string) {
+	promAggressiveNSEC.WithLabelValues(rcode).Inc()
+}
+
+// AddECSCacheBytes records a cached answer scoped to a client subnet being
+// added (positive delta) or removed (negative delta), with its size in bytes.
+func (m *Metrics) AddECSCacheBytes(delta int64) {
+	if delta > 0 {
+		promECSCacheEntries.Inc()
+	} else {
+		promECSCacheEntries.Dec()
+	}
+	promECSCacheBytes.Add(float64(delta))
+}
+
+// RecordECSAnswer records an answer to an ECS query cached at scope, 0 meaning
+// it holds for every client.
+func (m *Metrics) RecordECSAnswer(scope uint8) {
+	promECSAnswers.WithLabelValues(strconv.Itoa(int(scope))).Inc()
+}
+
+// IncrementStaleServed records an expired entry served because the upstream failed.
+func (m *Metrics) IncrementStaleServed(reason string) {
+	promStaleServed.WithLabelValues(reason).Inc()
+}
+
 // IncrementLMDBCacheLoads increments the LMDB cache load counter.
 func (m *Metrics) IncrementLMDBCacheLoads() {
 	promLMDBCacheLoads.Inc()
@@ -520,7 +650,72 @@ func (m *Metrics) IncrementLMDBErrors() {
 	promLMDBErrors.Inc()
 }
 
+// AddLMDBWrites adds n to the LMDB write counter.
+func (m *Metrics) AddLMDBWrites(n int) {
+	promLMDBWrites.Add(float64(n))
+}
+
+// IncrementLMDBJournalDrops increments the LMDB journal drop counter.
+func (m *Metrics) IncrementLMDBJournalDrops() {
+	promLMDBJournalDrops.Inc()
+}
+
+// SetRefreshQueueDepth records the number of refreshes waiting for a worker.
+func (m *Metrics) SetRefreshQueueDepth(depth int) {
+	promRefreshQueueDepth.Set(float64(depth))
+}
+
+// IncrementRefreshDrops records a refresh of kind that wasn't queued, because
+// one for the entry already was ("duplicate") or the queue was full ("full").
+func (m *Metrics) IncrementRefreshDrops(kind, reason string) {
+	promRefreshDrops.WithLabelValues(kind, reason).Inc()
+}
+
 // IncrementPrefetches increments the prefetch counter.
 func (m *Metrics) IncrementPrefetches() {
 	promPrefetches.Inc()
-}
\ No newline at end of file
+}
+
+// IncrementDnstapFrames increments the counter of dnstap frames written.
+func (m *Metrics) IncrementDnstapFrames() {
+	promDnstapFrames.Inc()
+}
+
+// IncrementDnstapDrops increments the counter of dnstap frames dropped for reason:
+// "queue_full", "unavailable" or "write_error".
+func (m *Metrics) IncrementDnstapDrops(reason string) {
+	promDnstapDrops.WithLabelValues(reason).Inc()
+}
+
+// LogDropCounter returns the counter of log messages of category that were shed
+// for reason. The logger resolves its counters once, when it starts.
+func (m *Metrics) LogDropCounter(category, reason string) prometheus.Counter {
+	return promLogDrops.WithLabelValues(category, reason)
+}
+
+// ListenerReceiveCounter returns the receive counter for a single listener socket.
+// Listeners resolve it once at startup so the read loop only pays for an atomic add.
+func (m *Metrics) ListenerReceiveCounter(proto string, socket int) prometheus.Counter {
+	return promListenerReceives.WithLabelValues(proto, strconv.Itoa(socket))
+}
+
+// UnboundContextMetrics records the cache sizes of Unbound context id and returns
+// its lookup counter and outstanding lookup gauge, resolved once when the
+// resolver starts.
+func (m *Metrics) UnboundContextMetrics(id int, msgCacheSize, rrsetCacheSize int64) (queries prometheus.Counter, outstanding prometheus.Gauge) {
+	label := strconv.Itoa(id)
+	promUnboundCacheBytes.WithLabelValues(label, "msg").Set(float64(msgCacheSize))
+	promUnboundCacheBytes.WithLabelValues(label, "rrset").Set(float64(rrsetCacheSize))
+	return promUnboundQueries.WithLabelValues(label), promUnboundOutstanding.WithLabelValues(label)
+}
+
+// IncrementForwardQueries counts a query forwarded to upstream, by result: "ok",
+// "error" or "timeout".
+func (m *Metrics) IncrementForwardQueries(upstream, result string) {
+	promForwardQueries.WithLabelValues(upstream, result).Inc()
+}
+
+// ForwardConnsGauge returns the gauge of open connections to upstream.
+func (m *Metrics) ForwardConnsGauge(upstream string) prometheus.Gauge {
+	return promForwardConns.WithLabelValues(upstream)
+}
@@ -0,0 +1,226 @@
+package metrics
+
+import (
+	"context"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+	"github.com/prometheus/client_golang/prometheus/promauto"
+)
+
+// Listener is the listener a query arrived on.
+type Listener int
+
+const (
+	ListenerUDP Listener = iota
+	ListenerTCP
+	ListenerDoT
+	ListenerDoH
+	ListenerCount
+)
+
+var listenerNames = [ListenerCount]string{"udp", "tcp", "dot", "doh"}
+
+// Outcome is how a query was answered.
+type Outcome int
+
+const (
+	OutcomeHit       Outcome = iota // fresh from the cache
+	OutcomeStale                    // from the cache, expired
+	OutcomeMiss                     // resolved by this query
+	OutcomeCoalesced                // resolved by another query for the same key
+	OutcomePlugin                   // answered or dropped by a plugin
+	outcomeCount
+)
+
+var outcomeNames = [outcomeCount]string{"hit", "stale", "miss", "coalesced", "plugin"}
+
+func (o Outcome) String() string {
+	return outcomeNames[o]
+}
+
+// Stage is a step of the query pipeline.
+type Stage int
+
+const (
+	StagePlugins      Stage = iota // request plugins
+	StageCache                     // cache lookups
+	StageSingleflight              // waiting for another query's lookup
+	StageUpstream                  // resolving upstream and caching the answer
+	StageWrite                     // writing the response
+	StageTotal                     // the whole query
+	stageCount
+)
+
+var stageNames = [stageCount]string{"plugins", "cache", "singleflight", "upstream", "write", "total"}
+
+var promStageDuration = promauto.NewHistogramVec(prometheus.HistogramOpts{
+	Name:                            "dns_resolver_stage_duration_seconds",
+	Help:                            "Time spent in each stage of the query pipeline",
+	Buckets:                         prometheus.ExponentialBuckets(0.00001, 4, 10), // 10µs to 2.6s
+	NativeHistogramBucketFactor:     1.1,
+	NativeHistogramMaxBucketNumber:  160,
+	NativeHistogramMinResetDuration: time.Hour,
+}, []string{"stage", "listener", "outcome"})
+
+// stageHistograms holds a Prometheus observer and an HDR histogram for every
+// stage, listener and outcome. The observers are looked up once, so recording
+// a stage does no label hashing; the HDR histograms, which are larger, are made
+// the first time their combination is seen.
+type stageHistograms struct {
+	observers [stageCount][ListenerCount][outcomeCount]prometheus.Observer
+	hdr       [stageCount][ListenerCount][outcomeCount]atomic.Pointer[hdrHistogram]
+}
+
+func newStageHistograms() *stageHistograms {
+	h := &stageHistograms{}
+	for s := range h.observers {
+		for l := range h.observers[s] {
+			for o := range h.observers[s][l] {
+				h.observers[s][l][o] = promStageDuration.WithLabelValues(stageNames[s], listenerNames[l], outcomeNames[o])
+			}
+		}
+	}
+	return h
+}
+
+func (h *stageHistograms) observe(s Stage, l Listener, o Outcome, d time.Duration) {
+	h.observers[s][l][o].Observe(d.Seconds())
+	p := &h.hdr[s][l][o]
+	hdr := p.Load()
+	if hdr == nil {
+		p.CompareAndSwap(nil, new(hdrHistogram))
+		hdr = p.Load()
+	}
+	hdr.record(d)
+}
+
+// StageLatency is the latency distribution of one stage for the dashboard.
+type StageLatency struct {
+	Stage    string  `json:"stage"`
+	Listener string  `json:"listener"`
+	Outcome  string  `json:"outcome"`
+	Count    uint64  `json:"count"`
+	P50      float64 `json:"p50_ms"`
+	P90      float64 `json:"p90_ms"`
+	P99      float64 `json:"p99_ms"`
+	P999     float64 `json:"p999_ms"`
+}
+
+var stageQuantiles = []float64{0.5, 0.9, 0.99, 0.999}
+
+// latencies returns the percentiles of every combination seen so far.
+func (h *stageHistograms) latencies() []StageLatency {
+	var out []StageLatency
+	for s := range h.hdr {
+		for l := range h.hdr[s] {
+			for o := range h.hdr[s][l] {
+				hdr := h.hdr[s][l][o].Load()
+				if hdr == nil {
+					continue
+				}
+				q, n := hdr.quantiles(stageQuantiles)
+				out = append(out, StageLatency{
+					Stage:    stageNames[s],
+					Listener: listenerNames[l],
+					Outcome:  outcomeNames[o],
+					Count:    n,
+					P50:      q[0].Seconds() * 1000,
+					P90:      q[1].Seconds() * 1000,
+					P99:      q[2].Seconds() * 1000,
+					P999:     q[3].Seconds() * 1000,
+				})
+			}
+		}
+	}
+	return out
+}
+
+// QueryTrace times the stages of one query. The server starts one per query
+// and passes it down as the query's context, so the resolver can add the
+// stages it runs and say how the query was answered; it is a context itself,
+// so that passing it along doesn't allocate. A nil *QueryTrace records nothing.
+type QueryTrace struct {
+	context.Context
+	listener Listener
+	outcome  Outcome
+	start    time.Time
+	recorded uint8 // bit per stage
+	stages   [stageCount]time.Duration
+}
+
+type traceKey struct{}
+
+var tracePool = sync.Pool{
+	New: func() interface{} {
+		return new(QueryTrace)
+	},
+}
+
+// StartTrace starts timing a query that arrived on listener l. The trace must
+// be finished with FinishTrace, after which it must no longer be used.
+func (m *Metrics) StartTrace(l Listener) *QueryTrace {
+	t := tracePool.Get().(*QueryTrace)
+	*t = QueryTrace{Context: context.Background(), listener: l, outcome: OutcomeMiss, start: time.Now()}
+	return t
+}
+
+// TraceFrom returns the trace ctx carries, or nil.
+func TraceFrom(ctx context.Context) *QueryTrace {
+	t, _ := ctx.Value(traceKey{}).(*QueryTrace)
+	return t
+}
+
+// Value implements context.Context.
+func (t *QueryTrace) Value(key interface{}) interface{} {
+	if key == (traceKey{}) {
+		return t
+	}
+	return t.Context.Value(key)
+}
+
+// Stage adds d to the time spent in stage s.
+func (t *QueryTrace) Stage(s Stage, d time.Duration) {
+	if t == nil {
+		return
+	}
+	t.stages[s] += d
+	t.recorded |= 1 << s
+}
+
+// SetOutcome records how the query was answered. The last call wins.
+func (t *QueryTrace) SetOutcome(o Outcome) {
+	if t != nil {
+		t.outcome = o
+	}
+}
+
+// Outcome returns how the query was answered, as far as is known.
+func (t *QueryTrace) Outcome() Outcome {
+	return t.outcome
+}
+
+// Start returns when the query arrived.
+func (t *QueryTrace) Start() time.Time {
+	return t.start
+}
+
+// FinishTrace records the stages of t and its total time.
+func (m *Metrics) FinishTrace(t *QueryTrace) {
+	t.Stage(StageTotal, time.Since(t.start))
+	for s := Stage(0); s < stageCount; s++ {
+		if t.recorded&(1<<s) != 0 {
+			m.stages.observe(s, t.listener, t.outcome, t.stages[s])
+		}
+	}
+	*t = QueryTrace{}
+	tracePool.Put(t)
+}
+
+// DiscardTrace releases t without recording it.
+func (m *Metrics) DiscardTrace(t *QueryTrace) {
+	*t = QueryTrace{}
+	tracePool.Put(t)
+}
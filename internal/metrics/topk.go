@@ -0,0 +1,146 @@
+package metrics
+
+import (
+	"container/heap"
+	"math"
+	"sort"
+	"sync"
+	"time"
+)
+
+const (
+	// topDomainsCapacity is the number of domains each top-domains sketch tracks.
+	topDomainsCapacity = 1024
+	// topDomainsHalfLife is how long it takes a domain's weight in a sketch to
+	// halve, so that the top lists follow current traffic.
+	topDomainsHalfLife = 10 * time.Minute
+)
+
+// topKEntry is a domain tracked by a topK sketch.
+type topKEntry struct {
+	domain string
+	weight float64 // decayed weight, the eviction order; may overestimate
+	count  float64 // decayed number of observations since the domain was tracked
+	total  float64 // decayed sum of the observed values since then
+	index  int     // position in the heap
+}
+
+// topK is a Space-Saving sketch of the domains with the most weight. It tracks
+// a fixed number of domains: a domain that isn't tracked takes the place of
+// the lightest one and inherits its weight, so memory and the cost of an
+// observation don't depend on how many distinct names are seen, and every
+// domain whose weight exceeds the total weight over the capacity is guaranteed
+// to be tracked. Weights decay exponentially, so old traffic fades out.
+type topK struct {
+	mu       sync.Mutex
+	capacity int
+	entries  map[string]*topKEntry
+	heap     topKHeap // lightest first
+}
+
+func newTopK(capacity int) *topK {
+	return &topK{
+		capacity: capacity,
+		entries:  make(map[string]*topKEntry, capacity),
+	}
+}
+
+// observe adds weight to domain, recording value as one observation of it.
+func (t *topK) observe(domain string, weight, value float64) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	e, ok := t.entries[domain]
+	switch {
+	case ok:
+	case len(t.heap) < t.capacity:
+		e = &topKEntry{domain: domain}
+		t.entries[domain] = e
+		heap.Push(&t.heap, e)
+	default:
+		e = t.heap[0]
+		delete(t.entries, e.domain)
+		// The newcomer keeps the evicted weight, its possible past, but only its
+		// own observations count towards its average.
+		e.domain, e.count, e.total = domain, 0, 0
+		t.entries[domain] = e
+	}
+	e.weight += weight
+	e.count++
+	e.total += value
+	heap.Fix(&t.heap, e.index)
+}
+
+// decay scales every weight down by the decay over elapsed. Scaling them all
+// alike leaves the heap in order.
+func (t *topK) decay(elapsed time.Duration) {
+	f := math.Exp2(-float64(elapsed) / float64(topDomainsHalfLife))
+	t.mu.Lock()
+	for _, e := range t.heap {
+		e.weight *= f
+		e.count *= f
+		e.total *= f
+	}
+	t.mu.Unlock()
+}
+
+// top returns copies of up to n entries, ordered by less.
+func (t *topK) top(n int, less func(a, b *topKEntry) bool) []topKEntry {
+	t.mu.Lock()
+	entries := make([]*topKEntry, len(t.heap))
+	copy(entries, t.heap)
+	sort.Slice(entries, func(i, j int) bool { return less(entries[i], entries[j]) })
+	if len(entries) > n {
+		entries = entries[:n]
+	}
+	top := make([]topKEntry, len(entries))
+	for i, e := range entries {
+		top[i] = *e
+	}
+	t.mu.Unlock()
+	return top
+}
+
+// heaviest returns the n domains with the most weight.
+func (t *topK) heaviest(n int) []topKEntry {
+	return t.top(n, func(a, b *topKEntry) bool { return a.weight > b.weight })
+}
+
+// highestAverage returns the n domains with the highest average value.
+func (t *topK) highestAverage(n int) []topKEntry {
+	return t.top(n, func(a, b *topKEntry) bool { return a.average() > b.average() })
+}
+
+func (e *topKEntry) average() float64 {
+	if e.count == 0 {
+		return 0
+	}
+	return e.total / e.count
+}
+
+// topKHeap is a min-heap of entries by weight.
+type topKHeap []*topKEntry
+
+func (h topKHeap) Len() int { return len(h) }
+
+func (h topKHeap) Less(i, j int) bool { return h[i].weight < h[j].weight }
+
+func (h topKHeap) Swap(i, j int) {
+	h[i], h[j] = h[j], h[i]
+	h[i].index = i
+	h[j].index = j
+}
+
+func (h *topKHeap) Push(x interface{}) {
+	e := x.(*topKEntry)
+	e.index = len(*h)
+	*h = append(*h, e)
+}
+
+func (h *topKHeap) Pop() interface{} {
+	old := *h
+	e := old[len(old)-1]
+	old[len(old)-1] = nil
+	*h = old[:len(old)-1]
+	return e
+}
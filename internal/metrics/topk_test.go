@@ -0,0 +1,46 @@
+package metrics
+
+import (
+	"strconv"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/assert"
+	"github.com/stretchr/testify/require"
+)
+
+func TestTopKBoundedUnderFlood(t *testing.T) {
+	k := newTopK(16)
+	for i := 0; i < 100000; i++ {
+		k.observe(strconv.Itoa(i)+".random.example.", 1, 1)
+		if i%10 == 0 {
+			k.observe("hot.example.", 1, 1)
+		}
+	}
+
+	assert.Len(t, k.entries, 16)
+	top := k.heaviest(1)
+	require.Len(t, top, 1)
+	assert.Equal(t, "hot.example.", top[0].domain)
+	assert.GreaterOrEqual(t, top[0].weight, 10000.0)
+}
+
+func TestTopKAverageAndDecay(t *testing.T) {
+	k := newTopK(4)
+	k.observe("slow.example.", 300, 300)
+	k.observe("slow.example.", 100, 100)
+	k.observe("fast.example.", 5, 5)
+
+	top := k.highestAverage(2)
+	require.Len(t, top, 2)
+	assert.Equal(t, "slow.example.", top[0].domain)
+	assert.InDelta(t, 200, top[0].average(), 1e-9)
+
+	k.decay(topDomainsHalfLife)
+	top = k.heaviest(1)
+	assert.InDelta(t, 200, top[0].weight, 1e-9)
+	assert.InDelta(t, 200, top[0].average(), 1e-9, "decay keeps averages")
+
+	k.decay(time.Duration(0))
+	assert.InDelta(t, 200, k.heaviest(1)[0].weight, 1e-9)
+}
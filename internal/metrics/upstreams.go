@@ -0,0 +1,94 @@
+package metrics
+
+import (
+	"encoding/json"
+	"net/http"
+
+	"github.com/prometheus/client_golang/prometheus"
+	"github.com/prometheus/client_golang/prometheus/promauto"
+)
+
+var (
+	promUpstreamSRTT = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_upstream_srtt_seconds",
+		Help: "Smoothed round-trip time of each upstream",
+	}, []string{"upstream"})
+	promUpstreamRTO = promauto.NewGaugeVec(prometheus.GaugeOpts{
+		Name: "dns_resolver_upstream_rto_seconds",
+		Help: "Retransmit timeout of each upstream, including timeout backoff",
+	}, []string{"upstream"})
+)
+
+var upstreamHealthyDesc = prometheus.NewDesc("dns_resolver_upstream_healthy",
+	"Whether each upstream is healthy (1) or penalized for failing (0)", []string{"upstream"}, nil)
+
+// UpstreamState is an upstream's entry in a backend's infrastructure table, as
+// served by /debug/upstreams.
+type UpstreamState struct {
+	Name      string  `json:"name"`
+	SRTTMs    float64 `json:"srtt_ms"`
+	RTTVarMs  float64 `json:"rttvar_ms"`
+	RTOMs     float64 `json:"rto_ms"`
+	Samples   uint64  `json:"samples"`
+	Timeouts  int     `json:"timeouts"` // in a row
+	Failures  int     `json:"failures"` // in a row
+	Healthy   bool    `json:"healthy"`
+	PenaltyMs float64 `json:"penalty_ms,omitempty"` // left before the upstream is healthy again
+}
+
+// UpstreamGauges returns the SRTT and RTO gauges of upstream, resolved once by
+// the backend that owns it.
+func (m *Metrics) UpstreamGauges(upstream string) (srtt, rto prometheus.Gauge) {
+	return promUpstreamSRTT.WithLabelValues(upstream), promUpstreamRTO.WithLabelValues(upstream)
+}
+
+// SetUpstreamSource makes fn the source of the upstream states served by
+// /debug/upstreams.
+func (m *Metrics) SetUpstreamSource(fn func() []UpstreamState) {
+	m.Lock()
+	defer m.Unlock()
+	m.upstreams = fn
+}
+
+// upstreamStates returns the states from the upstream source, if there is one.
+func (m *Metrics) upstreamStates() []UpstreamState {
+	m.RLock()
+	fn := m.upstreams
+	m.RUnlock()
+	if fn == nil {
+		return nil
+	}
+	return fn()
+}
+
+// upstreamHealth exports whether each upstream is healthy as of the scrape, so
+// that a penalty running out shows without waiting for the next exchange.
+type upstreamHealth struct {
+	m *Metrics
+}
+
+// Describe implements prometheus.Collector.
+func (u upstreamHealth) Describe(ch chan<- *prometheus.Desc) {
+	ch <- upstreamHealthyDesc
+}
+
+// Collect implements prometheus.Collector.
+func (u upstreamHealth) Collect(ch chan<- prometheus.Metric) {
+	for _, s := range u.m.upstreamStates() {
+		healthy := 0.0
+		if s.Healthy {
+			healthy = 1
+		}
+		ch <- prometheus.MustNewConstMetric(upstreamHealthyDesc, prometheus.GaugeValue, healthy, s.Name)
+	}
+}
+
+// upstreamsHandler serves the upstream infrastructure table as JSON.
+func (m *Metrics) upstreamsHandler(w http.ResponseWriter, r *http.Request) {
+	states := m.upstreamStates()
+	if states == nil {
+		states = []UpstreamState{}
+	}
+	w.Header().Set("Content-Type", "application/json")
+	json.NewEncoder(w).Encode(states)
+}
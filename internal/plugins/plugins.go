@@ -3,6 +3,9 @@ package plugins
 import (
 	"log"
 
+	"dns-resolver/internal/dnswire"
+	"dns-resolver/internal/logging"
+
 	"github.com/miekg/dns"
 )
 
@@ -18,6 +21,13 @@ type Plugin interface {
 	Execute(ctx *PluginContext, msg *dns.Msg) error
 }
 
+// Interceptor is implemented by plugins that only act on some queries. The server
+// answers a query from the cache without unpacking it into a dns.Msg only when no
+// plugin intercepts it; plugins that don't implement Interceptor see every query.
+type Interceptor interface {
+	Intercepts(q *dnswire.Query) bool
+}
+
 // PluginManager manages the lifecycle of plugins.
 type PluginManager struct {
 	plugins []Plugin
@@ -40,10 +50,20 @@ func (pm *PluginManager) Register(p Plugin) {
 func (pm *PluginManager) ExecutePlugins(ctx *PluginContext, msg *dns.Msg) {
 	for _, p := range pm.plugins {
 		if err := p.Execute(ctx, msg); err != nil {
-			log.Printf("Error executing plugin %s: %v", p.Name(), err)
+			logging.Warnf(logging.CategoryPlugin, "Error executing plugin %s: %v", p.Name(), err)
 		}
 		if ctx.Stop {
 			break
 		}
 	}
-}
\ No newline at end of file
+}
+
+// Intercepts reports whether any registered plugin needs to see the query.
+func (pm *PluginManager) Intercepts(q *dnswire.Query) bool {
+	for _, p := range pm.plugins {
+		if i, ok := p.(Interceptor); !ok || i.Intercepts(q) {
+			return true
+		}
+	}
+	return false
+}
@@ -0,0 +1,59 @@
+package resolver
+
+import (
+	"context"
+	"fmt"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// hasECS reports whether req carries an EDNS Client Subnet option.
+func hasECS(req *dns.Msg) bool {
+	opt := req.IsEdns0()
+	if opt == nil {
+		return false
+	}
+	for _, o := range opt.Option {
+		if _, ok := o.(*dns.EDNS0_SUBNET); ok {
+			return true
+		}
+	}
+	return false
+}
+
+// exchangeECS forwards req, which carries an ECS option, to the configured ECS
+// forwarders in turn until one answers. Unbound's library API can't send a
+// client subnet with a query, so queries whose answers depend on it go to
+// upstreams that can. Truncated answers are retried over TCP. The response
+// keeps its OPT record, whose ECS option tells the cache the answer's scope.
+func (r *Resolver) exchangeECS(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
+	q := req.Question[0]
+	startTime := time.Now()
+
+	var lastErr error
+	for _, addr := range r.config.ECSForwarders {
+		msg, _, err := r.ecsClient.ExchangeContext(ctx, req, addr)
+		if err == nil && msg.Truncated {
+			msg, _, err = r.ecsTCPClient.ExchangeContext(ctx, req, addr)
+		}
+		if err != nil {
+			lastErr = fmt.Errorf("ECS forwarder %s: %w", addr, err)
+			if ctx.Err() != nil {
+				break
+			}
+			continue
+		}
+
+		r.metrics.RecordLatency(q.Name, time.Since(startTime))
+		if msg.Rcode == dns.RcodeNameError {
+			r.metrics.RecordNXDOMAIN(q.Name)
+		}
+		return msg, nil
+	}
+
+	r.metrics.RecordLatency(q.Name, time.Since(startTime))
+	msg := new(dns.Msg)
+	msg.SetRcode(req, dns.RcodeServerFailure)
+	return msg, lastErr
+}
@@ -2,10 +2,12 @@ package resolver
 
 import (
 	"context"
+	"fmt"
 	"log"
 
 	"dns-resolver/internal/cache"
 	"dns-resolver/internal/config"
+	"dns-resolver/internal/dnswire"
 	"dns-resolver/internal/metrics"
 
 	"github.com/miekg/dns"
@@ -18,11 +20,17 @@ type ResolverType string
 const (
 	// ResolverTypeUnbound uses libunbound for DNS resolution
 	ResolverTypeUnbound ResolverType = "unbound"
+	// ResolverTypeForward forwards queries to upstream resolvers
+	ResolverTypeForward ResolverType = "forward"
+	// ResolverTypeKnot is not implemented; it has always meant unbound
+	ResolverTypeKnot ResolverType = "knot"
 )
 
 // ResolverInterface defines the common interface for all resolvers.
 type ResolverInterface interface {
 	Resolve(ctx context.Context, req *dns.Msg) (*dns.Msg, error)
+	ResolveWire(ctx context.Context, req *dns.Msg, buf []byte) ([]byte, error)
+	ResolveCached(ctx context.Context, q *dnswire.Query, msg []byte, buf []byte) ([]byte, bool)
 	LookupWithoutCache(ctx context.Context, req *dns.Msg) (*dns.Msg, error)
 	GetSingleflightGroup() *singleflight.Group
 	GetConfig() *config.Config
@@ -31,6 +39,17 @@ type ResolverInterface interface {
 
 // NewResolver creates a new resolver instance based on the specified type.
 func NewResolver(resolverType ResolverType, cfg *config.Config, c *cache.Cache, m *metrics.Metrics) (ResolverInterface, error) {
-	log.Println("Creating Unbound resolver")
-	return NewUnboundResolver(cfg, c, m), nil
+	switch resolverType {
+	case ResolverTypeForward:
+		log.Println("Creating forwarding resolver")
+		r, err := NewForwardingResolver(cfg, c, m)
+		if err != nil {
+			return nil, err
+		}
+		return r, nil
+	case ResolverTypeUnbound, ResolverTypeKnot, "":
+		log.Println("Creating Unbound resolver")
+		return NewUnboundResolver(cfg, c, m), nil
+	}
+	return nil, fmt.Errorf("unknown resolver type %q", resolverType)
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+package resolver
+
+import (
+	"context"
+	"sync"
+	"time"
+
+	"github.com/miekg/dns"
+)
+
+// flightGroup coalesces concurrent lookups of the same key, like singleflight,
+// except that a lookup is cancelled as soon as every caller waiting for it has
+// given up, so that clients that went away don't keep holding resolver capacity.
+type flightGroup struct {
+	mu      sync.Mutex
+	flights map[string]*flight
+}
+
+// flight is a lookup in progress and the callers waiting for it.
+type flight struct {
+	done    chan struct{}
+	cancel  context.CancelFunc
+	waiters int // callers still waiting
+	joined  int // callers that ever waited
+	msg     *dns.Msg
+	err     error
+}
+
+// do runs fn for key, or waits for the run already in flight, until ctx is done.
+// fn gets a context that expires after timeout, or as soon as no caller waits for
+// its result any more. led reports whether this call started the lookup; shared
+// whether the message was handed to other callers too, in which case it must not
+// be modified.
+func (g *flightGroup) do(ctx context.Context, key string, timeout time.Duration, fn func(context.Context) (*dns.Msg, error)) (msg *dns.Msg, led, shared bool, err error) {
+	g.mu.Lock()
+	if g.flights == nil {
+		g.flights = make(map[string]*flight)
+	}
+	f, ok := g.flights[key]
+	if !ok {
+		fctx, cancel := context.WithTimeout(context.Background(), timeout)
+		f = &flight{done: make(chan struct{}), cancel: cancel}
+		g.flights[key] = f
+		led = true
+		go g.run(fctx, key, f, fn)
+	}
+	f.waiters++
+	f.joined++
+	g.mu.Unlock()
+
+	select {
+	case <-f.done:
+		g.mu.Lock()
+		shared = f.joined > 1
+		g.mu.Unlock()
+		return f.msg, led, shared, f.err
+	case <-ctx.Done():
+		g.mu.Lock()
+		if f.waiters--; f.waiters == 0 && g.flights[key] == f {
+			// Nobody wants the answer any more; a later caller starts afresh.
+			delete(g.flights, key)
+			f.cancel()
+		}
+		g.mu.Unlock()
+		return nil, led, false, ctx.Err()
+	}
+}
+
+func (g *flightGroup) run(ctx context.Context, key string, f *flight, fn func(context.Context) (*dns.Msg, error)) {
+	defer f.cancel()
+	msg, err := fn(ctx)
+
+	g.mu.Lock()
+	if g.flights[key] == f {
+		delete(g.flights, key)
+	}
+	f.msg, f.err = msg, err
+	g.mu.Unlock()
+	close(f.done)
+}
@@ -0,0 +1,59 @@
+package resolver
+
+import (
+	"context"
+	"time"
+
+	"dns-resolver/internal/cache"
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/forwarder"
+	"dns-resolver/internal/interfaces"
+	"dns-resolver/internal/logging"
+	"dns-resolver/internal/metrics"
+
+	"github.com/miekg/dns"
+)
+
+// NewForwardingResolver creates a resolver that forwards misses to
+// cfg.ForwardUpstreams, and to cfg.ForwardRules' upstreams for names under their
+// domains, instead of recursing.
+func NewForwardingResolver(cfg *config.Config, c *cache.Cache, m *metrics.Metrics) (*Resolver, error) {
+	f, err := forwarder.New(cfg, m)
+	if err != nil {
+		return nil, err
+	}
+	return newResolver(cfg, c, m, nil, f), nil
+}
+
+// exchangeBackend resolves req through the backend, answering SERVFAIL when it
+// fails.
+func (r *Resolver) exchangeBackend(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
+	q := req.Question[0]
+	startTime := time.Now()
+
+	msg, status, err := r.backend.Exchange(ctx, req)
+	r.metrics.RecordLatency(q.Name, time.Since(startTime))
+	if err != nil {
+		if ctx.Err() == nil {
+			logging.Warnf(logging.CategoryResolver, "Backend resolution error for %s: %v", q.Name, err)
+		}
+		msg := new(dns.Msg)
+		msg.SetRcode(req, dns.RcodeServerFailure)
+		return msg, err
+	}
+	// Like unbound's, the upstream's OPT record is about its exchange with us.
+	msg.Extra = withoutOPT(msg.Extra)
+
+	if msg.Rcode == dns.RcodeNameError {
+		r.metrics.RecordNXDOMAIN(q.Name)
+	}
+	switch status {
+	case interfaces.DNSSECBogus:
+		r.metrics.RecordDNSSECValidation("bogus")
+		msg.Rcode = dns.RcodeServerFailure
+		return msg, errBogus
+	case interfaces.DNSSECSecure, interfaces.DNSSECInsecure:
+		r.metrics.RecordDNSSECValidation(string(status))
+	}
+	return msg, nil
+}
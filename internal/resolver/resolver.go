@@ -2,14 +2,16 @@ package resolver
 
 import (
 	"context"
+	"encoding/binary"
 	"errors"
-	"log"
-	"os"
-	"os/exec"
+	"sync"
 	"time"
 
 	"dns-resolver/internal/cache"
 	"dns-resolver/internal/config"
+	"dns-resolver/internal/dnswire"
+	"dns-resolver/internal/interfaces"
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/metrics"
 
 	"github.com/miekg/dns"
@@ -17,53 +19,55 @@ import (
 	"golang.org/x/sync/singleflight"
 )
 
+// errBogus is returned by exchange when DNSSEC validation fails.
+var errBogus = errors.New("BOGUS: DNSSEC validation failed")
+
 // Resolver is a recursive DNS resolver.
 type Resolver struct {
-	config     *config.Config
-	cache      *cache.Cache
-	sf         singleflight.Group
-	unbound    *unbound.Unbound
-	workerPool *WorkerPool
-	metrics    *metrics.Metrics
+	config    *config.Config
+	cache     *cache.Cache
+	sf        singleflight.Group
+	flights   flightGroup
+	unbound   *unboundPool
+	backend   interfaces.Backend // looks up misses instead of unbound when set
+	refreshes *refreshQueue
+	workers   sync.WaitGroup
+	metrics   *metrics.Metrics
+
+	// Clients for forwarding ECS queries to config.ECSForwarders.
+	ecsClient    *dns.Client
+	ecsTCPClient *dns.Client
 }
 
 // NewUnboundResolver creates a new Unbound resolver instance.
 func NewUnboundResolver(cfg *config.Config, c *cache.Cache, m *metrics.Metrics) *Resolver {
-	u := unbound.New()
-
-	// Ensure the root trust anchor exists and is up to date.
-	rootKeyPath := "/etc/unbound/root.key"
-	if _, err := os.Stat(rootKeyPath); os.IsNotExist(err) {
-		log.Printf("Root trust anchor not found at %s, attempting to generate it...", rootKeyPath)
-		cmd := exec.Command("unbound-anchor", "-a", rootKeyPath)
-		if err := cmd.Run(); err != nil {
-			log.Printf("Warning: failed to run unbound-anchor: %v", err)
-		}
-	}
-
-	if err := u.AddTaFile(rootKeyPath); err != nil {
-		log.Printf("Warning: could not load root trust anchor: %v. DNSSEC validation might not be secure.", err)
-	}
-
-	// Configure Unbound options
-	u.SetOption("do-ip4:", "yes")
-	u.SetOption("do-ip6:", "yes")
-	u.SetOption("do-udp:", "yes")
-	u.SetOption("do-tcp:", "yes")
-	u.SetOption("harden-glue:", "yes")
-	u.SetOption("harden-dnssec-stripped:", "yes")
-	u.SetOption("use-caps-for-id:", "yes")
-	u.SetOption("prefetch:", "yes")
-	u.SetOption("qname-minimisation:", "yes")
+	return newResolver(cfg, c, m, newUnboundPool(cfg, m), nil)
+}
 
+// newResolver creates a resolver that looks up misses through the unbound pool,
+// or through backend when there is one, and starts its background refreshes.
+func newResolver(cfg *config.Config, c *cache.Cache, m *metrics.Metrics, pool *unboundPool, backend interfaces.Backend) *Resolver {
 	r := &Resolver{
-		config:     cfg,
-		cache:      c,
-		sf:         singleflight.Group{},
-		unbound:    u,
-		workerPool: NewWorkerPool(cfg.MaxWorkers),
-		metrics:    m,
+		config:    cfg,
+		cache:     c,
+		sf:        singleflight.Group{},
+		unbound:   pool,
+		backend:   backend,
+		refreshes: newRefreshQueue(cfg.RefreshQueueSize, m),
+		metrics:   m,
+
+		ecsClient:    &dns.Client{Net: "udp", Timeout: cfg.UpstreamTimeout},
+		ecsTCPClient: &dns.Client{Net: "tcp", Timeout: cfg.UpstreamTimeout},
+	}
+	workers := cfg.MaxWorkers
+	if workers <= 0 {
+		workers = 1
+	}
+	r.workers.Add(workers)
+	for i := 0; i < workers; i++ {
+		go r.refreshWorker()
 	}
+	go r.prefetch()
 	return r
 }
 
@@ -79,85 +83,298 @@ func (r *Resolver) GetConfig() *config.Config {
 
 // Resolve performs a recursive DNS lookup for a given request.
 func (r *Resolver) Resolve(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
-	q := req.Question[0]
-	key := cache.Key(q)
+	key := cache.KeyFromMsg(req)
+	trace := metrics.TraceFrom(ctx)
 
 	// Check the cache first.
-	if cachedMsg, found, revalidate := r.cache.Get(key); found {
-		log.Printf("Cache hit for %s (revalidate: %t)", q.Name, revalidate)
+	start := time.Now()
+	cachedMsg, found, revalidate := r.cache.Get(&key)
+	trace.Stage(metrics.StageCache, time.Since(start))
+	if found {
 		cachedMsg.Id = req.Id
+		trace.SetOutcome(metrics.OutcomeHit)
+		if revalidate {
+			trace.SetOutcome(metrics.OutcomeStale)
+			r.revalidate(key, req)
+		}
+		return cachedMsg, nil
+	}
+
+	msg, shared, err := r.resolveMiss(ctx, req, key)
+	if reason := staleReason(msg, err); reason != "" {
+		if staleMsg, found := r.cache.GetStale(&key); found {
+			r.metrics.IncrementStaleServed(reason)
+			trace.SetOutcome(metrics.OutcomeStale)
+			staleMsg.Id = req.Id
+			return staleMsg, nil
+		}
+	}
+	if err != nil {
+		return nil, err
+	}
+	if shared {
+		// Other singleflight callers hold the same message; give this one its own.
+		msg = msg.Copy()
+	}
+	msg.Id = req.Id
+	return msg, nil
+}
+
+// ResolveWire is like Resolve but returns the packed response written into buf.
+// Cache hits are served straight from the wire-format cache without building a
+// dns.Msg and without allocating; misses are resolved and packed.
+func (r *Resolver) ResolveWire(ctx context.Context, req *dns.Msg, buf []byte) ([]byte, error) {
+	q := req.Question[0]
+	key := cache.KeyFromMsg(req)
 
+	var name [dnswire.MaxNameLen]byte
+	var qname []byte
+	if n, err := dns.PackDomainName(q.Name, name[:], 0, nil, false); err == nil {
+		qname = name[:n]
+	}
+
+	trace := metrics.TraceFrom(ctx)
+	start := time.Now()
+	wire, found, revalidate := r.cache.GetWire(&key, req.Id, qname, buf)
+	trace.Stage(metrics.StageCache, time.Since(start))
+	if found {
+		trace.SetOutcome(metrics.OutcomeHit)
 		if revalidate {
-			r.metrics.IncrementCacheRevalidations()
-			// Trigger a background revalidation using the worker pool
-			go func() {
-				if err := r.workerPool.Acquire(context.Background()); err != nil {
-					log.Printf("Failed to acquire worker for revalidation: %v", err)
-					return
-				}
-				defer r.workerPool.Release()
+			trace.SetOutcome(metrics.OutcomeStale)
+			r.revalidate(key, req)
+		}
+		return wire, nil
+	}
 
-				ctx, cancel := context.WithTimeout(context.Background(), r.config.UpstreamTimeout)
-				defer cancel()
+	msg, _, err := r.resolveMiss(ctx, req, key)
+	if reason := staleReason(msg, err); reason != "" {
+		if wire, found := r.cache.GetStaleWire(&key, req.Id, qname, buf); found {
+			r.metrics.IncrementStaleServed(reason)
+			trace.SetOutcome(metrics.OutcomeStale)
+			return wire, nil
+		}
+	}
+	if err != nil {
+		return nil, err
+	}
+	wire, err = msg.PackBuffer(buf)
+	if err != nil {
+		return nil, err
+	}
+	binary.BigEndian.PutUint16(wire, req.Id)
+	return wire, nil
+}
 
-				// Create a new request for revalidation to avoid race conditions on the original request object.
-				revalidationReq := new(dns.Msg)
-				revalidationReq.SetQuestion(q.Name, q.Qtype)
-				revalidationReq.RecursionDesired = true
-				if opt := req.IsEdns0(); opt != nil {
-					revalidationReq.SetEdns0(opt.UDPSize(), opt.Do())
-				}
+// ResolveCached answers a query parsed straight off the wire from the cache alone.
+// msg is the client's packet; the reply echoes its question name. It reports
+// false on a miss, leaving the query to the full path. ctx only carries the
+// query's trace.
+func (r *Resolver) ResolveCached(ctx context.Context, q *dnswire.Query, msg []byte, buf []byte) ([]byte, bool) {
+	key := cache.KeyFromWire(q)
+	trace := metrics.TraceFrom(ctx)
+	start := time.Now()
+	wire, found, revalidate := r.cache.GetWire(&key, q.ID, q.QuestionName(msg), buf)
+	trace.Stage(metrics.StageCache, time.Since(start))
+	if !found {
+		return nil, false
+	}
+	trace.SetOutcome(metrics.OutcomeHit)
+	if revalidate {
+		trace.SetOutcome(metrics.OutcomeStale)
+		// Refresh with the same upstream request the server's full path builds.
+		req := new(dns.Msg)
+		req.SetQuestion(q.NameString(), q.Qtype)
+		req.SetEdns0(4096, q.DO)
+		req.CheckingDisabled = q.CD
+		r.revalidate(key, req)
+	}
+	return wire, true
+}
 
-				res, err, _ := r.sf.Do(key+"-revalidate", func() (interface{}, error) {
-					return r.exchange(ctx, revalidationReq)
-				})
-				if err != nil {
-					log.Printf("Background revalidation failed for %s: %v", q.Name, err)
-					return
-				}
+// resolveMiss resolves req upstream and caches the answer, giving up after the
+// configured request timeout. Concurrent misses for the same key share one lookup;
+// the returned message is then shared between callers (reported by the second
+// return value) and must not be modified.
+//
+// The lookup carries on while any caller still waits for it, and is cancelled
+// once all of them have given up.
+//
+// key is taken by value so that only misses pay for moving it to the heap.
+func (r *Resolver) resolveMiss(ctx context.Context, req *dns.Msg, key cache.Key) (*dns.Msg, bool, error) {
+	ctx, cancel := context.WithTimeout(ctx, r.config.RequestTimeout)
+	defer cancel()
+
+	// The lookup may outlive this call, and with it the caller's request.
+	upstream := req.Copy()
+
+	trace := metrics.TraceFrom(ctx)
+	start := time.Now()
+
+	msg, led, shared, err := r.flights.do(ctx, key.String(), r.config.UpstreamTimeout, func(ctx context.Context) (*dns.Msg, error) {
+		msg, err := r.exchange(ctx, upstream)
+		if err != nil {
+			return nil, err
+		}
+		if !key.DO() {
+			stripDNSSEC(msg)
+		}
+		r.cache.Set(&key, msg, r.config.StaleWhileRevalidate)
+		return msg, nil
+	})
+	if led || ctx.Err() != nil {
+		trace.Stage(metrics.StageUpstream, time.Since(start))
+	} else {
+		trace.Stage(metrics.StageSingleflight, time.Since(start))
+	}
+	if ctx.Err() == nil {
+		if led {
+			trace.SetOutcome(metrics.OutcomeMiss)
+		} else {
+			trace.SetOutcome(metrics.OutcomeCoalesced)
+		}
+	}
+	return msg, shared, err
+}
+
+// staleReason reports why the outcome of a lookup may be replaced by a stale
+// answer (RFC 8767): "timeout", "error" or "servfail". It returns "" when the
+// lookup succeeded, or failed DNSSEC validation, which stale data must not hide.
+func staleReason(msg *dns.Msg, err error) string {
+	switch {
+	case errors.Is(err, errBogus):
+		return ""
+	case errors.Is(err, context.DeadlineExceeded):
+		return "timeout"
+	case err != nil:
+		return "error"
+	case msg.Rcode == dns.RcodeServerFailure:
+		return "servfail"
+	}
+	return ""
+}
 
-				if msg, ok := res.(*dns.Msg); ok {
-					r.cache.Set(key, msg, r.config.StaleWhileRevalidate)
-					log.Printf("Successfully revalidated and updated cache for %s", q.Name)
+// stripDNSSEC removes the DNSSEC records a client that didn't set DO must not be
+// sent (RFC 4035, section 3.2.1), except those of the type it asked for.
+func stripDNSSEC(msg *dns.Msg) {
+	qtype := msg.Question[0].Qtype
+	strip := func(rrs []dns.RR) []dns.RR {
+		kept := rrs[:0]
+		for _, rr := range rrs {
+			switch t := rr.Header().Rrtype; t {
+			case dns.TypeRRSIG, dns.TypeNSEC, dns.TypeNSEC3:
+				if t != qtype {
+					continue
 				}
-			}()
+			}
+			kept = append(kept, rr)
 		}
-		return cachedMsg, nil
+		return kept
 	}
+	msg.Answer = strip(msg.Answer)
+	msg.Ns = strip(msg.Ns)
+	msg.Extra = strip(msg.Extra)
+}
 
-	// Use singleflight to ensure only one lookup for a given question is in flight at a time.
-	res, err, _ := r.sf.Do(key, func() (interface{}, error) {
-		return r.exchange(ctx, req)
+// revalidate queues a background refresh of a stale cache entry.
+func (r *Resolver) revalidate(key cache.Key, req *dns.Msg) {
+	queued := r.refreshes.push(&key, refreshRevalidation, func() *dns.Msg {
+		q := req.Question[0]
+
+		// Build a new request so that the refresh doesn't share the caller's.
+		revalidationReq := new(dns.Msg)
+		revalidationReq.SetQuestion(q.Name, q.Qtype)
+		revalidationReq.RecursionDesired = true
+		revalidationReq.CheckingDisabled = key.CD()
+		if opt := req.IsEdns0(); opt != nil {
+			revalidationReq.SetEdns0(opt.UDPSize(), opt.Do())
+			// Keep the options: an ECS entry must be refreshed for its own subnet.
+			revalidationReq.IsEdns0().Option = append([]dns.EDNS0(nil), opt.Option...)
+		}
+		return revalidationReq
 	})
+	if queued {
+		r.metrics.IncrementCacheRevalidations()
+	}
+}
 
-	if err != nil {
-		return nil, err
+// prefetch queues refreshes of the popular entries the cache reports shortly
+// before they expire, so that hot names are never served stale or missed.
+func (r *Resolver) prefetch() {
+	for key := range r.cache.Prefetches() {
+		key := key
+		queued := r.refreshes.push(&key, refreshPrefetch, func() *dns.Msg {
+			// Refresh with the same upstream request the server's full path builds.
+			q := key.Question()
+			req := new(dns.Msg)
+			req.SetQuestion(q.Name, q.Qtype)
+			req.Question[0].Qclass = q.Qclass
+			req.SetEdns0(4096, key.DO())
+			req.CheckingDisabled = key.CD()
+			return req
+		})
+		if queued {
+			r.metrics.IncrementPrefetches()
+		}
 	}
+}
 
-	msg := res.(*dns.Msg)
-	msg.Id = req.Id
+// refreshWorker runs queued refreshes until the queue is closed.
+func (r *Resolver) refreshWorker() {
+	defer r.workers.Done()
+	for {
+		t, ok := r.refreshes.pop()
+		if !ok {
+			return
+		}
+		q := t.req.Question[0]
+		if err := r.refresh(t.key, t.req); err != nil {
+			logging.Warnf(logging.CategoryResolver, "Background %s failed for %s: %v", t.kind, q.Name, err)
+		}
+		r.refreshes.done(t)
+	}
+}
 
-	// Cache the response
-	r.cache.Set(key, msg, r.config.StaleWhileRevalidate)
+// refresh resolves req upstream and replaces the cache entry for key with the
+// answer. The refresh queue runs at most one refresh of a key at a time.
+func (r *Resolver) refresh(key cache.Key, req *dns.Msg) error {
+	ctx, cancel := context.WithTimeout(context.Background(), r.config.UpstreamTimeout)
+	defer cancel()
 
-	return msg, nil
+	msg, err := r.exchange(ctx, req)
+	if err != nil {
+		return err
+	}
+	if !key.DO() {
+		stripDNSSEC(msg)
+	}
+	r.cache.Set(&key, msg, r.config.StaleWhileRevalidate)
+	return nil
 }
 
-// exchange is a wrapper around the unbound resolver's Resolve method.
+// exchange resolves req through unbound, or the backend when there is one, giving
+// up when ctx is done. Queries with an ECS option go to the ECS forwarders
+// instead, when there are any.
 func (r *Resolver) exchange(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
+	if len(r.config.ECSForwarders) > 0 && hasECS(req) {
+		return r.exchangeECS(ctx, req)
+	}
+	if r.backend != nil {
+		return r.exchangeBackend(ctx, req)
+	}
 	q := req.Question[0]
 	startTime := time.Now()
 
-	// Note: The Go wrapper for libunbound doesn't seem to support passing context for cancellation.
-	result, err := r.unbound.Resolve(q.Name, q.Qtype, q.Qclass)
+	result, err := r.lookup(ctx, q)
 	latency := time.Since(startTime)
 
 	// Always record latency
 	r.metrics.RecordLatency(q.Name, latency)
 
 	if err != nil {
-		r.metrics.IncrementUnboundErrors()
-		log.Printf("Unbound resolution error for %s: %v", q.Name, err)
+		if ctx.Err() == nil {
+			r.metrics.IncrementUnboundErrors()
+			logging.Warnf(logging.CategoryResolver, "Unbound resolution error for %s: %v", q.Name, err)
+		}
 		// When an error occurs, unbound does not return a message.
 		// We'll construct a SERVFAIL to send back to the client.
 		msg := new(dns.Msg)
@@ -165,44 +382,89 @@ func (r *Resolver) exchange(ctx context.Context, req *dns.Msg) (*dns.Msg, error)
 		return msg, err
 	}
 
-	// Create a new response message from the result.
-	// We need to manually construct the dns.Msg.
-	msg := new(dns.Msg)
-	msg.SetReply(req)
-	msg.Rcode = result.Rcode
-
-	if result.Rcode == dns.RcodeNameError {
-		r.metrics.RecordNXDOMAIN(q.Name)
+	msg := result.AnswerPacket
+	if msg == nil {
+		// Unbound unpacks its answer for us; should that ever fail, answer with
+		// what the result carries.
+		msg = new(dns.Msg)
+		msg.Rcode = result.Rcode
+		if result.HaveData {
+			msg.Answer = result.Rr
+		}
 	}
-
-	// The unbound result gives us a flat list of RRs. We will add them
-	// to the Answer section.
-	if result.HaveData {
-		msg.Answer = result.Rr
+	// The packet is unbound's reply to its own query: make it the reply to req.
+	msg.Id = req.Id
+	msg.Response = true
+	msg.Opcode = req.Opcode
+	msg.RecursionDesired = req.RecursionDesired
+	msg.RecursionAvailable = true
+	msg.CheckingDisabled = req.CheckingDisabled
+	msg.Question = []dns.Question{q}
+	msg.Extra = withoutOPT(msg.Extra)
+
+	if msg.Rcode == dns.RcodeNameError {
+		r.metrics.RecordNXDOMAIN(q.Name)
 	}
 
 	if result.Bogus {
 		r.metrics.RecordDNSSECValidation("bogus")
-		log.Printf("DNSSEC validation for %s resulted in BOGUS.", q.Name)
+		logging.Warnf(logging.CategoryDNSSEC, "DNSSEC validation for %s resulted in BOGUS.", q.Name)
 		// The test expects an error for bogus domains. We'll return a SERVFAIL
 		// message that the calling handler can use, along with an error.
 		msg.Rcode = dns.RcodeServerFailure
-		return msg, errors.New("BOGUS: DNSSEC validation failed")
+		return msg, errBogus
 	} else if result.Secure {
 		r.metrics.RecordDNSSECValidation("secure")
-		log.Printf("DNSSEC validation for %s resulted in SECURE.", q.Name)
+		logging.Debugf(logging.CategoryDNSSEC, "DNSSEC validation for %s resulted in SECURE.", q.Name)
 		msg.AuthenticatedData = true
 	} else {
 		r.metrics.RecordDNSSECValidation("insecure")
-		log.Printf("DNSSEC validation for %s resulted in INSECURE.", q.Name)
+		logging.Debugf(logging.CategoryDNSSEC, "DNSSEC validation for %s resulted in INSECURE.", q.Name)
 		msg.AuthenticatedData = false
 	}
 
-	// Unlike the previous library, unbound doesn't return a fully-formed dns.Msg.
-	// We've constructed it from the pieces in the result.
 	return msg, nil
 }
 
+// lookup resolves q through unbound's asynchronous API, returning as soon as the
+// answer arrives or ctx is done. The Go binding runs each asynchronous lookup on
+// a goroutine of its own and has no ub_cancel, so a lookup given up on can't be
+// stopped inside libunbound: it is abandoned, and its answer dropped on arrival.
+func (r *Resolver) lookup(ctx context.Context, q dns.Question) (*unbound.Result, error) {
+	c := r.unbound.pick(q)
+	c.queries.Inc()
+	c.outstanding.Inc()
+
+	// Buffered, so that an abandoned lookup's goroutine can still deliver and exit.
+	done := make(chan *unbound.ResultError, 1)
+	c.u.ResolveAsync(q.Name, q.Qtype, q.Qclass, done)
+	select {
+	case res := <-done:
+		c.outstanding.Dec()
+		return res.Result, res.Error
+	case <-ctx.Done():
+		r.metrics.IncrementUnboundCancelled()
+		// The context stays busy with it all the same.
+		go func() {
+			<-done
+			c.outstanding.Dec()
+		}()
+		return nil, ctx.Err()
+	}
+}
+
+// withoutOPT returns rrs without the OPT record, which in unbound's answer
+// describes unbound's own upstream exchange rather than the client's.
+func withoutOPT(rrs []dns.RR) []dns.RR {
+	kept := rrs[:0]
+	for _, rr := range rrs {
+		if rr.Header().Rrtype != dns.TypeOPT {
+			kept = append(kept, rr)
+		}
+	}
+	return kept
+}
+
 // LookupWithoutCache performs a recursive DNS lookup for a given request, bypassing the cache.
 func (r *Resolver) LookupWithoutCache(ctx context.Context, req *dns.Msg) (*dns.Msg, error) {
 	return r.exchange(ctx, req)
@@ -210,5 +472,12 @@ func (r *Resolver) LookupWithoutCache(ctx context.Context, req *dns.Msg) (*dns.M
 
 // Close closes the resolver and frees resources.
 func (r *Resolver) Close() {
+	// Let the refreshes under way finish, so that none writes to the cache
+	// after it is closed.
+	r.refreshes.close()
+	r.workers.Wait()
+	if c, ok := r.backend.(interface{ Close() }); ok {
+		c.Close()
+	}
 	// Unbound doesn't need explicit cleanup in this implementation
 }
@@ -5,6 +5,7 @@ import (
 	"dns-resolver/internal/cache"
 	"dns-resolver/internal/config"
 	"dns-resolver/internal/metrics"
+	"fmt"
 	"testing"
 	"time"
 
@@ -15,7 +16,7 @@ func TestResolver_Resolve(t *testing.T) {
 	// Create a new cache and resolver for the test.
 	cfg := config.NewConfig()
 	m := metrics.NewMetrics()
-	c, err := cache.NewCache(cache.DefaultCacheSize, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
+	c, err := cache.NewCache(cache.DefaultMessageCacheSize, cache.DefaultRRsetCacheSize, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
 	if err != nil {
 		t.Fatalf("Failed to create cache: %v", err)
 	}
@@ -67,7 +68,7 @@ func TestResolver_Resolve_DNSSEC(t *testing.T) {
 	// Use a longer timeout for DNSSEC queries as they can be slower.
 	cfg.RequestTimeout = 20 * time.Second
 	m := metrics.NewMetrics()
-	c, err := cache.NewCache(cache.DefaultCacheSize, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
+	c, err := cache.NewCache(cache.DefaultMessageCacheSize, cache.DefaultRRsetCacheSize, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
 	if err != nil {
 		t.Fatalf("Failed to create cache: %v", err)
 	}
@@ -156,3 +157,142 @@ func TestResolver_Resolve_DNSSEC(t *testing.T) {
 		})
 	}
 }
+
+func TestRefreshQueue(t *testing.T) {
+	q := newRefreshQueue(2, metrics.NewMetrics())
+	keyFor := func(name string) *cache.Key {
+		k := cache.NewKey(dns.Question{Name: name, Qtype: dns.TypeA, Qclass: dns.ClassINET})
+		return &k
+	}
+	built := 0
+	req := func() *dns.Msg {
+		built++
+		return new(dns.Msg)
+	}
+
+	if !q.push(keyFor("cold.example."), refreshRevalidation, req) {
+		t.Fatal("Expected the first refresh to be queued")
+	}
+	if !q.push(keyFor("hot.example."), refreshRevalidation, req) {
+		t.Fatal("Expected a refresh of another key to be queued")
+	}
+	// Duplicates aren't queued but make the entry more urgent.
+	for i := 0; i < 3; i++ {
+		if q.push(keyFor("hot.example."), refreshRevalidation, req) {
+			t.Fatal("Expected a duplicate refresh to be dropped")
+		}
+	}
+	if q.push(keyFor("other.example."), refreshPrefetch, req) {
+		t.Fatal("Expected a refresh to be dropped when the queue is full")
+	}
+	if built != 2 {
+		t.Fatalf("Expected requests built only for queued refreshes, built %d", built)
+	}
+
+	task, ok := q.pop()
+	if !ok || task.key.Question().Name != "hot.example." {
+		t.Fatalf("Expected the most requested entry first, got %+v", task)
+	}
+	// A key being refreshed isn't queued again until it is done.
+	if q.push(keyFor("hot.example."), refreshRevalidation, req) {
+		t.Fatal("Expected a refresh of a running key to be dropped")
+	}
+	q.done(task)
+	if !q.push(keyFor("hot.example."), refreshRevalidation, req) {
+		t.Fatal("Expected a finished key to be queued again")
+	}
+
+	q.close()
+	if _, ok := q.pop(); ok {
+		t.Fatal("Expected pop to fail on a closed queue")
+	}
+}
+
+func TestFlightGroupCancelsAbandonedLookup(t *testing.T) {
+	var g flightGroup
+	started := make(chan struct{})
+	cancelled := make(chan error, 1)
+	lookup := func(ctx context.Context) (*dns.Msg, error) {
+		close(started)
+		<-ctx.Done()
+		cancelled <- ctx.Err()
+		return nil, ctx.Err()
+	}
+
+	ctx1, cancel1 := context.WithCancel(context.Background())
+	ctx2, cancel2 := context.WithCancel(context.Background())
+	errs := make(chan error, 2)
+	go func() {
+		_, led, _, err := g.do(ctx1, "k", time.Minute, lookup)
+		if !led {
+			t.Error("Expected the first caller to lead the lookup")
+		}
+		errs <- err
+	}()
+	<-started
+	go func() {
+		_, led, _, err := g.do(ctx2, "k", time.Minute, func(context.Context) (*dns.Msg, error) {
+			t.Error("Expected the second caller to join the running lookup")
+			return nil, nil
+		})
+		if led {
+			t.Error("Expected the second caller not to lead the lookup")
+		}
+		errs <- err
+	}()
+
+	for waiting := 0; waiting < 2; time.Sleep(time.Millisecond) {
+		g.mu.Lock()
+		waiting = g.flights["k"].waiters
+		g.mu.Unlock()
+	}
+
+	// The lookup carries on while anyone still waits for it.
+	cancel1()
+	if err := <-errs; err != context.Canceled {
+		t.Fatalf("Expected the first caller to give up, got %v", err)
+	}
+	select {
+	case <-cancelled:
+		t.Fatal("Expected the lookup to carry on for the second caller")
+	case <-time.After(50 * time.Millisecond):
+	}
+
+	cancel2()
+	<-errs
+	select {
+	case err := <-cancelled:
+		if err != context.Canceled {
+			t.Fatalf("Expected the lookup to be cancelled, got %v", err)
+		}
+	case <-time.After(time.Second):
+		t.Fatal("Expected the lookup to be cancelled once nobody waits for it")
+	}
+
+	// A later caller starts a new lookup.
+	msg, led, shared, err := g.do(context.Background(), "k", time.Minute, func(context.Context) (*dns.Msg, error) {
+		return new(dns.Msg), nil
+	})
+	if err != nil || msg == nil || !led || shared {
+		t.Fatalf("Expected a fresh lookup, got msg=%v led=%v shared=%v err=%v", msg, led, shared, err)
+	}
+}
+
+func TestUnboundPoolShardsByName(t *testing.T) {
+	p := &unboundPool{}
+	for i := 0; i < 8; i++ {
+		p.contexts = append(p.contexts, &unboundContext{})
+	}
+	a := p.pick(dns.Question{Name: "www.Example.com.", Qtype: dns.TypeA})
+	if p.pick(dns.Question{Name: "WWW.example.COM.", Qtype: dns.TypeAAAA}) != a {
+		t.Fatal("Expected every lookup of a name to go to the same context")
+	}
+
+	used := make(map[*unboundContext]bool)
+	for i := 0; i < 100; i++ {
+		used[p.pick(dns.Question{Name: fmt.Sprintf("host%d.example.", i), Qtype: dns.TypeA})] = true
+	}
+	if len(used) < len(p.contexts)/2 {
+		t.Fatalf("Expected names to spread over the contexts, %d of %d used", len(used), len(p.contexts))
+	}
+}
@@ -0,0 +1,113 @@
+package resolver
+
+import (
+	"log"
+	"os"
+	"os/exec"
+	"runtime"
+	"strconv"
+	"strings"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+
+	"github.com/cespare/xxhash/v2"
+	"github.com/miekg/dns"
+	"github.com/miekg/unbound"
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+const rootKeyPath = "/etc/unbound/root.key"
+
+// Cache budgets of the whole pool when the config doesn't set them.
+const (
+	defaultUnboundMsgCache   = 16 << 20
+	defaultUnboundRRsetCache = 32 << 20
+)
+
+// unboundPool is a set of independent libunbound contexts. A context serialises
+// its work on an internal lock, so a single one caps miss throughput however
+// many cores there are. Lookups are sharded over the contexts by a hash of their
+// question name, which keeps all lookups of a name, and the answers cached for
+// it, in one context.
+type unboundPool struct {
+	contexts []*unboundContext
+}
+
+// unboundContext is one libunbound context of the pool and its metrics.
+type unboundContext struct {
+	u           *unbound.Unbound
+	queries     prometheus.Counter
+	outstanding prometheus.Gauge
+}
+
+// newUnboundPool creates the configured number of contexts. The configured
+// message and RRset cache sizes are budgets for the whole pool, split evenly
+// between the contexts: each caches only the names sharded to it, so together
+// they hold as much as one context with the whole budget would.
+func newUnboundPool(cfg *config.Config, m *metrics.Metrics) *unboundPool {
+	// Ensure the root trust anchor exists and is up to date.
+	if _, err := os.Stat(rootKeyPath); os.IsNotExist(err) {
+		log.Printf("Root trust anchor not found at %s, attempting to generate it...", rootKeyPath)
+		cmd := exec.Command("unbound-anchor", "-a", rootKeyPath)
+		if err := cmd.Run(); err != nil {
+			log.Printf("Warning: failed to run unbound-anchor: %v", err)
+		}
+	}
+
+	n := cfg.UnboundContexts
+	if n <= 0 {
+		n = runtime.GOMAXPROCS(0)
+	}
+	msgCache, rrsetCache := cfg.UnboundMsgCache, cfg.UnboundRRsetCache
+	if msgCache <= 0 {
+		msgCache = defaultUnboundMsgCache
+	}
+	if rrsetCache <= 0 {
+		rrsetCache = defaultUnboundRRsetCache
+	}
+	msgCache, rrsetCache = msgCache/int64(n), rrsetCache/int64(n)
+
+	p := &unboundPool{contexts: make([]*unboundContext, n)}
+	for i := range p.contexts {
+		c := &unboundContext{u: newUnbound(msgCache, rrsetCache)}
+		c.queries, c.outstanding = m.UnboundContextMetrics(i, msgCache, rrsetCache)
+		p.contexts[i] = c
+	}
+	log.Printf("Resolving through %d unbound contexts with %d byte message and %d byte RRset caches each",
+		n, msgCache, rrsetCache)
+	return p
+}
+
+// newUnbound creates and configures a single libunbound context with caches of
+// the given sizes in bytes.
+func newUnbound(msgCache, rrsetCache int64) *unbound.Unbound {
+	u := unbound.New()
+
+	if err := u.AddTaFile(rootKeyPath); err != nil {
+		log.Printf("Warning: could not load root trust anchor: %v. DNSSEC validation might not be secure.", err)
+	}
+
+	// Configure Unbound options
+	u.SetOption("do-ip4:", "yes")
+	u.SetOption("do-ip6:", "yes")
+	u.SetOption("do-udp:", "yes")
+	u.SetOption("do-tcp:", "yes")
+	u.SetOption("harden-glue:", "yes")
+	u.SetOption("harden-dnssec-stripped:", "yes")
+	u.SetOption("use-caps-for-id:", "yes")
+	u.SetOption("prefetch:", "yes")
+	u.SetOption("qname-minimisation:", "yes")
+	u.SetOption("aggressive-nsec:", "yes")
+	u.SetOption("msg-cache-size:", strconv.FormatInt(msgCache, 10))
+	u.SetOption("rrset-cache-size:", strconv.FormatInt(rrsetCache, 10))
+	return u
+}
+
+// pick returns the context that looks up q.
+func (p *unboundPool) pick(q dns.Question) *unboundContext {
+	if len(p.contexts) == 1 {
+		return p.contexts[0]
+	}
+	return p.contexts[xxhash.Sum64String(strings.ToLower(q.Name))%uint64(len(p.contexts))]
+}
@@ -1,42 +1,205 @@
 package resolver
 
-import "context"
+import (
+	"container/heap"
+	"sync"
+	"sync/atomic"
 
-// WorkerPool is a simple worker pool to limit concurrency.
-type WorkerPool struct {
-	sem chan struct{}
+	"dns-resolver/internal/cache"
+	"dns-resolver/internal/metrics"
+
+	"github.com/cespare/xxhash/v2"
+	"github.com/miekg/dns"
+)
+
+// defaultRefreshQueueSize bounds the refresh queue when the config doesn't.
+const defaultRefreshQueueSize = 1024
+
+// Kinds of background refresh.
+const (
+	refreshRevalidation = "revalidation"
+	refreshPrefetch     = "prefetch"
+)
+
+// refreshTask is a background refresh of one cache entry.
+type refreshTask struct {
+	key   cache.Key
+	req   *dns.Msg
+	kind  string
+	hits  int           // requests for the entry while the task waited, its priority
+	dups  atomic.Uint32 // duplicate requests not yet counted in hits
+	seq   uint64        // queueing order, to break ties
+	index int           // position in the heap
 }
 
-// NewWorkerPool creates a new worker pool with the given size.
-func NewWorkerPool(size int) *WorkerPool {
+// pendingShards is the number of locks the pending set is split over; a power
+// of two.
+const pendingShards = 16
+
+// pendingShard is one part of the set of keys queued or being refreshed.
+type pendingShard struct {
+	mu    sync.Mutex
+	tasks map[cache.Key]*refreshTask
+	_     [48]byte // keep shards on their own cache lines
+}
+
+// refreshQueue schedules background revalidations and prefetches for a fixed
+// set of workers. An entry is queued at most once: while its refresh is queued
+// or running, further requests for it only raise its priority, so a hot stale
+// name costs one refresh rather than a goroutine per hit. The most requested
+// entries are refreshed first. When the queue is full new tasks are dropped.
+//
+// Stale hits on a hot name mostly find its refresh already pending. That check
+// takes only the lock of the key's shard and allocates nothing; the queue's own
+// lock is taken only to queue a new task.
+type refreshQueue struct {
+	pending [pendingShards]pendingShard
+	queued  atomic.Int64 // tasks in the heap, or about to be
+
+	mu      sync.Mutex
+	cond    sync.Cond
+	tasks   refreshHeap
+	size    int
+	seq     uint64
+	closed  atomic.Bool
+	metrics *metrics.Metrics
+}
+
+func newRefreshQueue(size int, m *metrics.Metrics) *refreshQueue {
 	if size <= 0 {
-		// If size is not positive, create a pool that doesn't limit concurrency.
-		// This is not ideal, but it's better than panicking.
-		// A better approach would be to return an error.
-		return &WorkerPool{}
+		size = defaultRefreshQueueSize
+	}
+	q := &refreshQueue{
+		size:    size,
+		metrics: m,
+	}
+	for i := range q.pending {
+		q.pending[i].tasks = make(map[cache.Key]*refreshTask)
+	}
+	q.cond.L = &q.mu
+	return q
+}
+
+func (q *refreshQueue) shard(key *cache.Key) *pendingShard {
+	return &q.pending[xxhash.Sum64(key.Bytes())&(pendingShards-1)]
+}
+
+// push queues a refresh of key and reports whether it did. A key that is
+// already queued or being refreshed isn't queued again. newReq builds the
+// request to refresh with; it is only called for a task that is queued.
+func (q *refreshQueue) push(key *cache.Key, kind string, newReq func() *dns.Msg) bool {
+	if q.closed.Load() {
+		return false
 	}
-	return &WorkerPool{
-		sem: make(chan struct{}, size),
+	sh := q.shard(key)
+	sh.mu.Lock()
+	if t, ok := sh.tasks[*key]; ok {
+		t.dups.Add(1)
+		sh.mu.Unlock()
+		q.metrics.IncrementRefreshDrops(kind, "duplicate")
+		return false
 	}
+	if q.queued.Add(1) > int64(q.size) {
+		q.queued.Add(-1)
+		sh.mu.Unlock()
+		q.metrics.IncrementRefreshDrops(kind, "full")
+		return false
+	}
+	t := &refreshTask{key: *key, kind: kind, hits: 1}
+	sh.tasks[*key] = t
+	sh.mu.Unlock()
+
+	t.req = newReq()
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	if q.closed.Load() {
+		return false
+	}
+	q.seq++
+	t.seq = q.seq
+	heap.Push(&q.tasks, t)
+	q.metrics.SetRefreshQueueDepth(len(q.tasks))
+	q.cond.Signal()
+	return true
 }
 
-// Acquire acquires a worker from the pool. It blocks until a worker is available or the context is canceled.
-func (p *WorkerPool) Acquire(ctx context.Context) error {
-	if p.sem == nil {
-		return nil // No limiting
+// pop takes the highest-priority task off the queue, waiting for one if
+// needed. It returns false once the queue is closed.
+func (q *refreshQueue) pop() (*refreshTask, bool) {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	for len(q.tasks) == 0 && !q.closed.Load() {
+		q.cond.Wait()
+	}
+	if q.closed.Load() {
+		return nil, false
+	}
+	// Count the duplicates pushed since the last pop. The queue is short and
+	// pops are paced by upstream lookups, so reordering it here is cheap.
+	reorder := false
+	for _, t := range q.tasks {
+		if d := t.dups.Swap(0); d > 0 {
+			t.hits += int(d)
+			reorder = true
+		}
 	}
-	select {
-	case <-ctx.Done():
-		return ctx.Err()
-	case p.sem <- struct{}{}:
-		return nil
+	if reorder {
+		heap.Init(&q.tasks)
 	}
+	t := heap.Pop(&q.tasks).(*refreshTask)
+	q.queued.Add(-1)
+	q.metrics.SetRefreshQueueDepth(len(q.tasks))
+	return t, true
+}
+
+// done marks t finished, so that its key can be queued again.
+func (q *refreshQueue) done(t *refreshTask) {
+	sh := q.shard(&t.key)
+	sh.mu.Lock()
+	delete(sh.tasks, t.key)
+	sh.mu.Unlock()
+}
+
+// close drops the queued tasks and stops the workers once their current
+// refreshes finish.
+func (q *refreshQueue) close() {
+	q.mu.Lock()
+	q.closed.Store(true)
+	q.tasks = nil
+	q.metrics.SetRefreshQueueDepth(0)
+	q.mu.Unlock()
+	q.cond.Broadcast()
 }
 
-// Release releases a worker back to the pool.
-func (p *WorkerPool) Release() {
-	if p.sem == nil {
-		return // No limiting
+// refreshHeap orders tasks by hits, then by age.
+type refreshHeap []*refreshTask
+
+func (h refreshHeap) Len() int { return len(h) }
+
+func (h refreshHeap) Less(i, j int) bool {
+	if h[i].hits != h[j].hits {
+		return h[i].hits > h[j].hits
 	}
-	<-p.sem
+	return h[i].seq < h[j].seq
+}
+
+func (h refreshHeap) Swap(i, j int) {
+	h[i], h[j] = h[j], h[i]
+	h[i].index = i
+	h[j].index = j
+}
+
+func (h *refreshHeap) Push(x interface{}) {
+	t := x.(*refreshTask)
+	t.index = len(*h)
+	*h = append(*h, t)
+}
+
+func (h *refreshHeap) Pop() interface{} {
+	old := *h
+	t := old[len(old)-1]
+	old[len(old)-1] = nil
+	t.index = -1
+	*h = old[:len(old)-1]
+	return t
 }
@@ -0,0 +1,351 @@
+package server
+
+import (
+	"encoding/binary"
+	"errors"
+	"log"
+	"net"
+	"sync"
+
+	"github.com/miekg/dns"
+	"github.com/prometheus/client_golang/prometheus"
+	"golang.org/x/net/ipv4"
+	"golang.org/x/net/ipv6"
+)
+
+// packetPool recycles the buffers used for inbound queries and outbound replies.
+var packetPool = sync.Pool{
+	New: func() interface{} {
+		b := make([]byte, dns.DefaultMsgSize)
+		return &b
+	},
+}
+
+// batchConn is the recvmmsg/sendmmsg view of a UDP socket. Both ipv4.PacketConn
+// and ipv6.PacketConn implement it; on platforms without the batch syscalls x/net
+// falls back to one message per call.
+type batchConn interface {
+	ReadBatch(ms []ipv4.Message, flags int) (int, error)
+	WriteBatch(ms []ipv4.Message, flags int) (int, error)
+}
+
+// udpBatch serves DNS on one UDP socket, reading and writing up to size packets
+// per system call. Queries are handled concurrently by s.handler and their
+// replies are funnelled into a single writer that flushes them with sendmmsg.
+type udpBatch struct {
+	conn     *net.UDPConn
+	bc       batchConn
+	handler  dns.Handler
+	size     int
+	received prometheus.Counter
+	replies  chan udpReply
+	done     chan struct{}
+
+	// fast, when set, gets first go at each raw packet and reports whether it
+	// answered it; otherwise the packet is unpacked and passed to handler.
+	fast func(pkt []byte, w dns.ResponseWriter) bool
+
+	// wildcard is set when the socket is bound to an unspecified address; replies
+	// then carry the query's destination as source so they leave from the
+	// address the client talked to.
+	wildcard bool
+	v4       bool
+}
+
+type udpReply struct {
+	buf  *[]byte
+	data []byte
+	addr net.Addr
+	oob  []byte
+}
+
+// newUDPBatch wraps conn for batched serving.
+func newUDPBatch(conn *net.UDPConn, handler dns.Handler, size int, received prometheus.Counter) *udpBatch {
+	b := &udpBatch{
+		conn:     conn,
+		handler:  handler,
+		size:     size,
+		received: received,
+		replies:  make(chan udpReply, size*4),
+		done:     make(chan struct{}),
+	}
+
+	local, _ := conn.LocalAddr().(*net.UDPAddr)
+	b.v4 = local == nil || local.IP.To4() != nil
+	b.wildcard = local == nil || local.IP.IsUnspecified()
+
+	if b.v4 {
+		pc := ipv4.NewPacketConn(conn)
+		if b.wildcard {
+			if err := pc.SetControlMessage(ipv4.FlagDst|ipv4.FlagInterface, true); err != nil {
+				b.wildcard = false
+			}
+		}
+		b.bc = pc
+	} else {
+		pc := ipv6.NewPacketConn(conn)
+		if b.wildcard {
+			if err := pc.SetControlMessage(ipv6.FlagDst|ipv6.FlagInterface, true); err != nil {
+				b.wildcard = false
+			}
+		}
+		b.bc = pc
+	}
+	return b
+}
+
+// Serve runs the read loop until the socket is closed.
+func (b *udpBatch) Serve() error {
+	defer close(b.done)
+	go b.writeLoop()
+
+	msgs := make([]ipv4.Message, b.size)
+	bufs := make([]*[]byte, b.size)
+	var oobs []oobSlot
+	if b.wildcard {
+		oobs = make([]oobSlot, b.size)
+	}
+	for i := range msgs {
+		bufs[i] = packetPool.Get().(*[]byte)
+		msgs[i].Buffers = [][]byte{*bufs[i]}
+		if b.wildcard {
+			msgs[i].OOB = b.newOOB()
+		}
+	}
+
+	for {
+		n, err := b.bc.ReadBatch(msgs, 0)
+		if err != nil {
+			if errors.Is(err, net.ErrClosed) {
+				return err
+			}
+			log.Printf("Failed to read UDP batch: %v", err)
+			continue
+		}
+		b.received.Add(float64(n))
+
+		for i := 0; i < n; i++ {
+			m := &msgs[i]
+			var oob []byte
+			if b.wildcard {
+				oob = b.replyOOB(&oobs[i], m.OOB[:m.NN])
+			}
+			go b.serve(bufs[i], m.N, m.Addr, oob)
+
+			// The handler owns the old buffer now; give the slot a fresh one.
+			bufs[i] = packetPool.Get().(*[]byte)
+			m.Buffers[0] = *bufs[i]
+		}
+	}
+}
+
+func (b *udpBatch) serve(buf *[]byte, n int, addr net.Addr, oob []byte) {
+	w := &batchResponseWriter{batch: b, remote: addr, oob: oob}
+	if b.fast != nil && b.fast((*buf)[:n], w) {
+		packetPool.Put(buf)
+		return
+	}
+
+	pkt := (*buf)[:n]
+	if n < 12 {
+		packetPool.Put(buf)
+		return
+	}
+	// Screen the header as dns.Server does, so that the handler only ever sees
+	// queries with exactly one question.
+	dh := dns.Header{
+		Id:      binary.BigEndian.Uint16(pkt),
+		Bits:    binary.BigEndian.Uint16(pkt[2:]),
+		Qdcount: binary.BigEndian.Uint16(pkt[4:]),
+		Ancount: binary.BigEndian.Uint16(pkt[6:]),
+		Nscount: binary.BigEndian.Uint16(pkt[8:]),
+		Arcount: binary.BigEndian.Uint16(pkt[10:]),
+	}
+	action := dns.DefaultMsgAcceptFunc(dh)
+	req := new(dns.Msg)
+	if action == dns.MsgAccept && req.Unpack(pkt) != nil {
+		action = dns.MsgReject
+	}
+	packetPool.Put(buf)
+	switch action {
+	case dns.MsgAccept:
+		b.handler.ServeDNS(w, req)
+	case dns.MsgReject:
+		w.Write(rejectReply(dh, dns.RcodeFormatError))
+	case dns.MsgRejectNotImplemented:
+		w.Write(rejectReply(dh, dns.RcodeNotImplemented))
+	}
+}
+
+// rejectReply returns the header-only reply dns.Server sends to a query it
+// rejects: FORMERR for a malformed one, NOTIMP for an opcode it doesn't serve.
+// FORMERR replies carry opcode QUERY, as miekg/dns's do.
+func rejectReply(dh dns.Header, rcode int) []byte {
+	const (
+		qr     = 1 << 15
+		opcode = 0xF << 11
+		rd     = 1 << 8
+		cd     = 1 << 4
+	)
+	bits := uint16(qr) | dh.Bits&(rd|cd) | uint16(rcode&0xF)
+	if rcode == dns.RcodeNotImplemented {
+		bits |= dh.Bits & opcode
+	}
+	reply := make([]byte, 12)
+	binary.BigEndian.PutUint16(reply, dh.Id)
+	binary.BigEndian.PutUint16(reply[2:], bits)
+	return reply
+}
+
+// writeLoop sends queued replies, draining whatever is ready into one sendmmsg call.
+func (b *udpBatch) writeLoop() {
+	msgs := make([]ipv4.Message, b.size)
+	pending := make([]*[]byte, b.size)
+	for i := range msgs {
+		msgs[i].Buffers = make([][]byte, 1)
+	}
+
+	for {
+		var r udpReply
+		select {
+		case r = <-b.replies:
+		case <-b.done:
+			return
+		}
+
+		n := 0
+		for {
+			msgs[n].Buffers[0] = r.data
+			msgs[n].Addr = r.addr
+			msgs[n].OOB = r.oob
+			pending[n] = r.buf
+			n++
+			if n == b.size || !b.nextReply(&r) {
+				break
+			}
+		}
+
+		b.flush(msgs[:n])
+		for i := 0; i < n; i++ {
+			packetPool.Put(pending[i])
+			pending[i] = nil
+			msgs[i].Buffers[0] = nil
+			msgs[i].Addr = nil
+			msgs[i].OOB = nil
+		}
+	}
+}
+
+// nextReply takes another queued reply without blocking.
+func (b *udpBatch) nextReply(r *udpReply) bool {
+	select {
+	case *r = <-b.replies:
+		return true
+	default:
+		return false
+	}
+}
+
+func (b *udpBatch) flush(msgs []ipv4.Message) {
+	for sent := 0; sent < len(msgs); {
+		n, err := b.bc.WriteBatch(msgs[sent:], 0)
+		if err != nil {
+			log.Printf("Failed to write UDP batch: %v", err)
+			// Skip the message the kernel refused and carry on with the rest.
+			n++
+		}
+		sent += n
+	}
+}
+
+func (b *udpBatch) enqueue(r udpReply) {
+	select {
+	case b.replies <- r:
+	case <-b.done:
+		packetPool.Put(r.buf)
+	}
+}
+
+func (b *udpBatch) newOOB() []byte {
+	if b.v4 {
+		return ipv4.NewControlMessage(ipv4.FlagDst | ipv4.FlagInterface)
+	}
+	return ipv6.NewControlMessage(ipv6.FlagDst | ipv6.FlagInterface)
+}
+
+// oobSlot holds one read slot's control message state across packets. Queued
+// replies keep pointing at reply until they are sent, so it is never written to
+// once built; a query to a different local address gets a new one.
+type oobSlot struct {
+	v4    ipv4.ControlMessage
+	v6    ipv6.ControlMessage
+	src   net.IP
+	reply []byte
+}
+
+// replyOOB returns the control message that makes a reply leave from the address
+// the query arrived on. Queries to the address the slot's last one went to share
+// its control message, so steady traffic builds none.
+func (b *udpBatch) replyOOB(s *oobSlot, oob []byte) []byte {
+	// Parse reuses Dst when it is long enough; zero it so that a packet without
+	// a destination isn't taken for the previous one's.
+	var dst net.IP
+	if b.v4 {
+		clear(s.v4.Dst)
+		if err := s.v4.Parse(oob); err != nil {
+			return nil
+		}
+		dst = s.v4.Dst
+	} else {
+		clear(s.v6.Dst)
+		if err := s.v6.Parse(oob); err != nil {
+			return nil
+		}
+		dst = s.v6.Dst
+	}
+	if dst == nil || dst.IsUnspecified() {
+		return nil
+	}
+
+	if s.reply == nil || !dst.Equal(s.src) {
+		s.src = append(s.src[:0], dst...)
+		if b.v4 {
+			s.reply = (&ipv4.ControlMessage{Src: s.src}).Marshal()
+		} else {
+			s.reply = (&ipv6.ControlMessage{Src: s.src}).Marshal()
+		}
+	}
+	return s.reply
+}
+
+// batchResponseWriter hands replies to the batch writer instead of writing them itself.
+type batchResponseWriter struct {
+	batch  *udpBatch
+	remote net.Addr
+	oob    []byte
+}
+
+func (w *batchResponseWriter) WriteMsg(m *dns.Msg) error {
+	buf := packetPool.Get().(*[]byte)
+	data, err := m.PackBuffer(*buf)
+	if err != nil {
+		packetPool.Put(buf)
+		return err
+	}
+	w.batch.enqueue(udpReply{buf: buf, data: data, addr: w.remote, oob: w.oob})
+	return nil
+}
+
+func (w *batchResponseWriter) Write(b []byte) (int, error) {
+	buf := packetPool.Get().(*[]byte)
+	data := append((*buf)[:0], b...)
+	w.batch.enqueue(udpReply{buf: buf, data: data, addr: w.remote, oob: w.oob})
+	return len(b), nil
+}
+
+func (w *batchResponseWriter) LocalAddr() net.Addr  { return w.batch.conn.LocalAddr() }
+func (w *batchResponseWriter) RemoteAddr() net.Addr { return w.remote }
+func (w *batchResponseWriter) Close() error         { return nil }
+func (w *batchResponseWriter) TsigStatus() error    { return nil }
+func (w *batchResponseWriter) TsigTimersOnly(bool)  {}
+func (w *batchResponseWriter) Hijack()              {}
@@ -0,0 +1,200 @@
+package server
+
+import (
+	"net"
+	"runtime"
+	"testing"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/miekg/dns"
+)
+
+// echoHandler answers every query with an empty NOERROR reply so the benchmarks
+// measure the socket path rather than resolution.
+var echoHandler = dns.HandlerFunc(func(w dns.ResponseWriter, r *dns.Msg) {
+	m := new(dns.Msg)
+	m.SetReply(r)
+	w.WriteMsg(m)
+})
+
+func benchmarkUDPServe(b *testing.B, serve func(conn *net.UDPConn)) {
+	conn, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		b.Fatalf("Failed to listen: %v", err)
+	}
+	defer conn.Close()
+	go serve(conn)
+
+	query := new(dns.Msg)
+	query.SetQuestion("example.com.", dns.TypeA)
+	wire, err := query.Pack()
+	if err != nil {
+		b.Fatalf("Failed to pack query: %v", err)
+	}
+	addr := conn.LocalAddr().String()
+
+	// Keep enough queries in flight for the batch loop to have something to batch.
+	b.SetParallelism(16)
+	b.ReportAllocs()
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		c, err := net.Dial("udp", addr)
+		if err != nil {
+			b.Error(err)
+			return
+		}
+		defer c.Close()
+		buf := make([]byte, dns.MinMsgSize)
+		for pb.Next() {
+			if _, err := c.Write(wire); err != nil {
+				b.Error(err)
+				return
+			}
+			c.SetReadDeadline(time.Now().Add(time.Second))
+			if _, err := c.Read(buf); err != nil {
+				b.Error(err)
+				return
+			}
+		}
+	})
+	b.ReportMetric(float64(b.N)/b.Elapsed().Seconds()/float64(runtime.GOMAXPROCS(0)), "pkts/s/core")
+}
+
+// BenchmarkUDPServe compares packets/sec per core of the one-syscall-per-packet
+// dns.Server loop with the recvmmsg/sendmmsg batch loop.
+func BenchmarkUDPServe(b *testing.B) {
+	m := metrics.NewMetrics()
+
+	b.Run("dns.Server", func(b *testing.B) {
+		benchmarkUDPServe(b, func(conn *net.UDPConn) {
+			server := &dns.Server{PacketConn: conn, Handler: echoHandler}
+			server.ActivateAndServe()
+		})
+	})
+
+	b.Run("batch", func(b *testing.B) {
+		benchmarkUDPServe(b, func(conn *net.UDPConn) {
+			newUDPBatch(conn, echoHandler, 64, m.ListenerReceiveCounter("udp-bench", 0)).Serve()
+		})
+	})
+}
+
+// TestUDPBatchRejectsMalformedQueries checks that the batch loop screens packets
+// as dns.Server does: a query without a question must get FORMERR rather than
+// reach the handler, which assumes there is one.
+func TestUDPBatchRejectsMalformedQueries(t *testing.T) {
+	conn, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		t.Fatalf("Failed to listen: %v", err)
+	}
+	defer conn.Close()
+
+	handled := make(chan struct{}, 1)
+	handler := dns.HandlerFunc(func(w dns.ResponseWriter, r *dns.Msg) {
+		handled <- struct{}{}
+	})
+	go newUDPBatch(conn, handler, 8, metrics.NewMetrics().ListenerReceiveCounter("udp-test", 0)).Serve()
+
+	c, err := net.Dial("udp", conn.LocalAddr().String())
+	if err != nil {
+		t.Fatalf("Failed to dial: %v", err)
+	}
+	defer c.Close()
+
+	for _, tc := range []struct {
+		name  string
+		flags uint16
+		rcode int
+	}{
+		{"empty question section", 0x0100, dns.RcodeFormatError},
+		{"update", uint16(dns.OpcodeUpdate) << 11, dns.RcodeNotImplemented},
+	} {
+		query := make([]byte, 12)
+		query[0], query[1] = 0xBE, 0xEF
+		query[2], query[3] = byte(tc.flags>>8), byte(tc.flags)
+		if _, err := c.Write(query); err != nil {
+			t.Fatalf("%s: failed to send: %v", tc.name, err)
+		}
+
+		reply := make([]byte, 512)
+		c.SetReadDeadline(time.Now().Add(2 * time.Second))
+		n, err := c.Read(reply)
+		if err != nil {
+			t.Fatalf("%s: no reply: %v", tc.name, err)
+		}
+		if n != 12 || reply[0] != 0xBE || reply[1] != 0xEF || reply[2]&0x80 == 0 {
+			t.Fatalf("%s: unexpected reply % x", tc.name, reply[:n])
+		}
+		if rcode := int(reply[3] & 0xF); rcode != tc.rcode {
+			t.Fatalf("%s: got rcode %d, want %d", tc.name, rcode, tc.rcode)
+		}
+	}
+
+	select {
+	case <-handled:
+		t.Fatal("A rejected query reached the handler")
+	default:
+	}
+}
+
+// TestUDPBatchFastPath checks that cache hits are answered by the fast path from
+// the raw packet and never reach the handler. The socket is bound to the
+// wildcard address so that replies also go through the per-slot control messages.
+func TestUDPBatchFastPath(t *testing.T) {
+	s, query := newHitServer(t)
+	wire, err := query.Pack()
+	if err != nil {
+		t.Fatalf("Failed to pack query: %v", err)
+	}
+
+	conn, err := net.ListenUDP("udp4", &net.UDPAddr{IP: net.IPv4zero})
+	if err != nil {
+		t.Fatalf("Failed to listen: %v", err)
+	}
+	defer conn.Close()
+
+	handled := make(chan struct{}, 1)
+	handler := dns.HandlerFunc(func(w dns.ResponseWriter, r *dns.Msg) {
+		handled <- struct{}{}
+	})
+	batch := newUDPBatch(conn, handler, 8, metrics.NewMetrics().ListenerReceiveCounter("udp-test", 0))
+	batch.fast = func(pkt []byte, w dns.ResponseWriter) bool {
+		return s.serveFast(pkt, w, metrics.ListenerUDP)
+	}
+	go batch.Serve()
+
+	port := conn.LocalAddr().(*net.UDPAddr).Port
+	c, err := net.DialUDP("udp4", nil, &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1), Port: port})
+	if err != nil {
+		t.Fatalf("Failed to dial: %v", err)
+	}
+	defer c.Close()
+
+	// More queries than slots, so that slots are reused.
+	buf := make([]byte, dns.DefaultMsgSize)
+	for i := 0; i < 20; i++ {
+		if _, err := c.Write(wire); err != nil {
+			t.Fatalf("Failed to send: %v", err)
+		}
+		c.SetReadDeadline(time.Now().Add(2 * time.Second))
+		n, err := c.Read(buf)
+		if err != nil {
+			t.Fatalf("Query %d: no reply: %v", i, err)
+		}
+		reply := new(dns.Msg)
+		if err := reply.Unpack(buf[:n]); err != nil {
+			t.Fatalf("Query %d: bad reply: %v", i, err)
+		}
+		if reply.Id != query.Id || reply.Rcode != dns.RcodeSuccess || len(reply.Answer) != 1 {
+			t.Fatalf("Query %d: unexpected reply %v", i, reply)
+		}
+	}
+
+	select {
+	case <-handled:
+		t.Fatal("A cache hit reached the handler")
+	default:
+	}
+}
@@ -0,0 +1,452 @@
+package server
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"os"
+	"strconv"
+	"time"
+
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+)
+
+// dnstap.proto field numbers and enum values.
+const (
+	dnstapFieldIdentity = 1
+	dnstapFieldVersion  = 2
+	dnstapFieldExtra    = 3
+	dnstapFieldMessage  = 14
+	dnstapFieldType     = 15
+
+	dnstapTypeMessage = 1
+
+	messageFieldType            = 1
+	messageFieldSocketFamily    = 2
+	messageFieldSocketProtocol  = 3
+	messageFieldQueryAddress    = 4
+	messageFieldResponseAddress = 5
+	messageFieldQueryPort       = 6
+	messageFieldResponsePort    = 7
+	messageFieldQueryTimeSec    = 8
+	messageFieldQueryTimeNsec   = 9
+	messageFieldQueryMessage    = 10
+	messageFieldResponseTimeSec = 12
+	messageFieldResponseTimeNs  = 13
+	messageFieldResponseMessage = 14
+
+	messageTypeClientQuery    = 5
+	messageTypeClientResponse = 6
+
+	socketFamilyINET  = 1
+	socketFamilyINET6 = 2
+)
+
+// dnstapProtocols maps listeners to dnstap's SocketProtocol.
+var dnstapProtocols = [metrics.ListenerCount]uint64{
+	metrics.ListenerUDP: 1,
+	metrics.ListenerTCP: 2,
+	metrics.ListenerDoT: 3,
+	metrics.ListenerDoH: 4,
+}
+
+// Frame Streams control frames.
+const (
+	fstrmControlAccept = 1
+	fstrmControlStart  = 2
+	fstrmControlStop   = 3
+	fstrmControlReady  = 4
+	fstrmControlFinish = 5
+
+	fstrmFieldContentType = 1
+)
+
+const dnstapContentType = "protobuf:dnstap.Dnstap"
+
+const (
+	// dnstapFileBackups is how many rotated dnstap files are kept.
+	dnstapFileBackups = 5
+	// dnstapRedialInterval is how long the output waits before reconnecting to a
+	// dnstap socket that went away. Frames are dropped meanwhile.
+	dnstapRedialInterval = 5 * time.Second
+	// dnstapWriteTimeout bounds a write to the socket, so that a reader that
+	// stopped reading is noticed.
+	dnstapWriteTimeout = 5 * time.Second
+)
+
+// dnstapOutput logs client queries and responses in dnstap format, as Frame
+// Streams data frames, to a unix socket or a rotating file. The query path
+// only encodes a frame and offers it to a bounded queue; a single goroutine
+// writes it out. When the queue is full, or the socket is down, frames are
+// dropped rather than slowing down queries.
+type dnstapOutput struct {
+	identity []byte
+	version  []byte
+	frames   chan []byte
+	sink     dnstapSink
+	metrics  *metrics.Metrics
+}
+
+// dnstapSink is where frames end up: open starts a stream, write adds a data
+// frame to it and flush pushes out what is buffered.
+type dnstapSink interface {
+	open() error
+	write(frame []byte) error
+	flush() error
+	close()
+}
+
+// newDnstapOutput returns the dnstap output configured in cfg, or nil if there
+// is none.
+func newDnstapOutput(cfg *config.Config, m *metrics.Metrics) *dnstapOutput {
+	var sink dnstapSink
+	switch {
+	case cfg.DnstapSocket != "":
+		sink = &dnstapSocket{path: cfg.DnstapSocket}
+	case cfg.DnstapFile != "":
+		sink = &dnstapFile{path: cfg.DnstapFile, maxSize: cfg.DnstapMaxFileSize}
+	default:
+		return nil
+	}
+	size := cfg.DnstapQueueSize
+	if size <= 0 {
+		size = 4096
+	}
+	identity := cfg.DnstapIdentity
+	if identity == "" {
+		identity, _ = os.Hostname()
+	}
+	d := &dnstapOutput{
+		identity: []byte(identity),
+		version:  []byte("ASTRACAT DNS Resolver"),
+		frames:   make(chan []byte, size),
+		sink:     sink,
+		metrics:  m,
+	}
+	go d.run()
+	return d
+}
+
+// dnstapEvent is what is logged about one query.
+type dnstapEvent struct {
+	listener     metrics.Listener
+	client       net.Addr
+	server       net.Addr
+	query        []byte // the client's query, packed
+	response     []byte // the response, packed; nil if there was none
+	queryTime    time.Time
+	responseTime time.Time
+	outcome      metrics.Outcome
+}
+
+// log queues a CLIENT_QUERY and, if there is a response, a CLIENT_RESPONSE
+// message for ev. The response carries the cache outcome and the time taken
+// in the dnstap extra field. The packets are copied.
+func (d *dnstapOutput) log(ev *dnstapEvent) {
+	d.queue(d.encode(nil, ev, messageTypeClientQuery))
+	if ev.response != nil {
+		d.queue(d.encode(nil, ev, messageTypeClientResponse))
+	}
+}
+
+func (d *dnstapOutput) queue(frame []byte) {
+	select {
+	case d.frames <- frame:
+	default:
+		d.metrics.IncrementDnstapDrops("queue_full")
+	}
+}
+
+// encode appends a Frame Streams data frame holding the dnstap message of type
+// typ for ev to dst.
+func (d *dnstapOutput) encode(dst []byte, ev *dnstapEvent, typ uint64) []byte {
+	start := len(dst)
+	dst = append(dst, 0, 0, 0, 0) // frame length
+
+	dst = appendBytesField(dst, dnstapFieldIdentity, d.identity)
+	dst = appendBytesField(dst, dnstapFieldVersion, d.version)
+	if typ == messageTypeClientResponse {
+		extra := make([]byte, 0, 48)
+		extra = append(extra, "outcome="...)
+		extra = append(extra, ev.outcome.String()...)
+		extra = append(extra, " latency_us="...)
+		extra = strconv.AppendInt(extra, ev.responseTime.Sub(ev.queryTime).Microseconds(), 10)
+		dst = appendBytesField(dst, dnstapFieldExtra, extra)
+	}
+	dst = appendVarintField(dst, dnstapFieldType, dnstapTypeMessage)
+
+	msg := d.encodeMessage(make([]byte, 0, 64+len(ev.query)+len(ev.response)), ev, typ)
+	dst = appendBytesField(dst, dnstapFieldMessage, msg)
+
+	binary.BigEndian.PutUint32(dst[start:], uint32(len(dst)-start-4))
+	return dst
+}
+
+func (d *dnstapOutput) encodeMessage(dst []byte, ev *dnstapEvent, typ uint64) []byte {
+	dst = appendVarintField(dst, messageFieldType, typ)
+	clientIP, clientPort := addrParts(ev.client)
+	serverIP, serverPort := addrParts(ev.server)
+	if clientIP != nil {
+		family := uint64(socketFamilyINET6)
+		if ip4 := clientIP.To4(); ip4 != nil {
+			family, clientIP = socketFamilyINET, ip4
+			if ip4 := serverIP.To4(); ip4 != nil {
+				serverIP = ip4
+			}
+		}
+		dst = appendVarintField(dst, messageFieldSocketFamily, family)
+	}
+	dst = appendVarintField(dst, messageFieldSocketProtocol, dnstapProtocols[ev.listener])
+	if clientIP != nil {
+		dst = appendBytesField(dst, messageFieldQueryAddress, clientIP)
+		dst = appendVarintField(dst, messageFieldQueryPort, uint64(clientPort))
+	}
+	if serverIP != nil && !serverIP.IsUnspecified() {
+		dst = appendBytesField(dst, messageFieldResponseAddress, serverIP)
+		dst = appendVarintField(dst, messageFieldResponsePort, uint64(serverPort))
+	}
+	dst = appendVarintField(dst, messageFieldQueryTimeSec, uint64(ev.queryTime.Unix()))
+	dst = appendFixed32Field(dst, messageFieldQueryTimeNsec, uint32(ev.queryTime.Nanosecond()))
+	dst = appendBytesField(dst, messageFieldQueryMessage, ev.query)
+	if typ == messageTypeClientResponse {
+		dst = appendVarintField(dst, messageFieldResponseTimeSec, uint64(ev.responseTime.Unix()))
+		dst = appendFixed32Field(dst, messageFieldResponseTimeNs, uint32(ev.responseTime.Nanosecond()))
+		dst = appendBytesField(dst, messageFieldResponseMessage, ev.response)
+	}
+	return dst
+}
+
+func addrParts(addr net.Addr) (net.IP, int) {
+	switch a := addr.(type) {
+	case *net.UDPAddr:
+		return a.IP, a.Port
+	case *net.TCPAddr:
+		return a.IP, a.Port
+	}
+	return nil, 0
+}
+
+func appendTag(dst []byte, field, wireType uint64) []byte {
+	return binary.AppendUvarint(dst, field<<3|wireType)
+}
+
+func appendVarintField(dst []byte, field, v uint64) []byte {
+	return binary.AppendUvarint(appendTag(dst, field, 0), v)
+}
+
+func appendFixed32Field(dst []byte, field uint64, v uint32) []byte {
+	return binary.LittleEndian.AppendUint32(appendTag(dst, field, 5), v)
+}
+
+func appendBytesField(dst []byte, field uint64, b []byte) []byte {
+	dst = binary.AppendUvarint(appendTag(dst, field, 2), uint64(len(b)))
+	return append(dst, b...)
+}
+
+// run writes queued frames to the sink, flushing whenever the queue runs dry.
+// While the sink can't be opened, frames are dropped and it is retried every
+// dnstapRedialInterval.
+func (d *dnstapOutput) run() {
+	var (
+		ready    bool
+		lastOpen time.Time
+	)
+	for frame := range d.frames {
+		if !ready && time.Since(lastOpen) >= dnstapRedialInterval {
+			lastOpen = time.Now()
+			if err := d.sink.open(); err != nil {
+				log.Printf("Failed to open dnstap output: %v", err)
+			} else {
+				ready = true
+			}
+		}
+		if !ready {
+			d.metrics.IncrementDnstapDrops("unavailable")
+			continue
+		}
+		if err := d.sink.write(frame); err != nil {
+			log.Printf("Failed to write dnstap frame: %v", err)
+			d.metrics.IncrementDnstapDrops("write_error")
+			d.sink.close()
+			ready = false
+			continue
+		}
+		d.metrics.IncrementDnstapFrames()
+		if len(d.frames) == 0 {
+			if err := d.sink.flush(); err != nil {
+				log.Printf("Failed to flush dnstap output: %v", err)
+				d.sink.close()
+				ready = false
+			}
+		}
+	}
+}
+
+// appendControl appends a Frame Streams control frame of type typ. READY and
+// START carry the dnstap content type; STOP and FINISH carry nothing.
+func appendControl(dst []byte, typ uint32) []byte {
+	body := binary.BigEndian.AppendUint32(nil, typ)
+	if typ != fstrmControlFinish && typ != fstrmControlStop {
+		body = binary.BigEndian.AppendUint32(body, fstrmFieldContentType)
+		body = binary.BigEndian.AppendUint32(body, uint32(len(dnstapContentType)))
+		body = append(body, dnstapContentType...)
+	}
+	dst = binary.BigEndian.AppendUint32(dst, 0) // escape: a control frame follows
+	dst = binary.BigEndian.AppendUint32(dst, uint32(len(body)))
+	return append(dst, body...)
+}
+
+// readControl reads a control frame and returns its type.
+func readControl(r io.Reader) (uint32, error) {
+	var hdr [8]byte
+	if _, err := io.ReadFull(r, hdr[:]); err != nil {
+		return 0, err
+	}
+	if binary.BigEndian.Uint32(hdr[:4]) != 0 {
+		return 0, errors.New("expected a frame streams control frame")
+	}
+	n := binary.BigEndian.Uint32(hdr[4:])
+	if n < 4 || n > 512 {
+		return 0, fmt.Errorf("bad frame streams control frame length %d", n)
+	}
+	body := make([]byte, n)
+	if _, err := io.ReadFull(r, body); err != nil {
+		return 0, err
+	}
+	return binary.BigEndian.Uint32(body), nil
+}
+
+// dnstapSocket is a bidirectional Frame Streams connection to a dnstap reader
+// on a unix socket.
+type dnstapSocket struct {
+	path string
+	conn net.Conn
+	w    *bufio.Writer
+}
+
+func (s *dnstapSocket) open() error {
+	conn, err := net.DialTimeout("unix", s.path, dnstapWriteTimeout)
+	if err != nil {
+		return err
+	}
+	conn.SetDeadline(time.Now().Add(dnstapWriteTimeout))
+	if _, err := conn.Write(appendControl(nil, fstrmControlReady)); err != nil {
+		conn.Close()
+		return err
+	}
+	typ, err := readControl(conn)
+	if err == nil && typ != fstrmControlAccept {
+		err = fmt.Errorf("dnstap reader answered READY with control frame %d", typ)
+	}
+	if err == nil {
+		_, err = conn.Write(appendControl(nil, fstrmControlStart))
+	}
+	if err != nil {
+		conn.Close()
+		return err
+	}
+	conn.SetDeadline(time.Time{})
+	s.conn, s.w = conn, bufio.NewWriterSize(conn, 64<<10)
+	return nil
+}
+
+func (s *dnstapSocket) write(frame []byte) error {
+	s.conn.SetWriteDeadline(time.Now().Add(dnstapWriteTimeout))
+	_, err := s.w.Write(frame)
+	return err
+}
+
+func (s *dnstapSocket) flush() error {
+	s.conn.SetWriteDeadline(time.Now().Add(dnstapWriteTimeout))
+	return s.w.Flush()
+}
+
+// close ends the stream with STOP and waits for the reader's FINISH, which tells
+// us it has taken every frame before it (Frame Streams, bidirectional mode).
+func (s *dnstapSocket) close() {
+	if s.conn == nil {
+		return
+	}
+	s.conn.SetDeadline(time.Now().Add(dnstapWriteTimeout))
+	s.w.Write(appendControl(nil, fstrmControlStop))
+	if err := s.w.Flush(); err == nil {
+		typ, err := readControl(s.conn)
+		if err == nil && typ != fstrmControlFinish {
+			err = fmt.Errorf("dnstap reader answered STOP with control frame %d", typ)
+		}
+		if err != nil {
+			log.Printf("Failed to finish dnstap stream: %v", err)
+		}
+	}
+	s.conn.Close()
+	s.conn, s.w = nil, nil
+}
+
+// dnstapFile is a unidirectional Frame Streams file. Once it grows past maxSize
+// it is closed with a STOP frame and rotated to path.1, path.2 and so on, and a
+// new one is started. An existing file is rotated away when the output opens,
+// since a finished stream can't be appended to.
+type dnstapFile struct {
+	path    string
+	maxSize int64 // 0 never rotates
+	f       *os.File
+	w       *bufio.Writer
+	size    int64
+}
+
+func (f *dnstapFile) open() error {
+	if st, err := os.Stat(f.path); err == nil && st.Size() > 0 {
+		f.rotate()
+	}
+	file, err := os.OpenFile(f.path, os.O_CREATE|os.O_WRONLY|os.O_TRUNC, 0o644)
+	if err != nil {
+		return err
+	}
+	f.f, f.w = file, bufio.NewWriterSize(file, 64<<10)
+	start := appendControl(nil, fstrmControlStart)
+	f.size = int64(len(start))
+	_, err = f.w.Write(start)
+	return err
+}
+
+func (f *dnstapFile) rotate() {
+	for i := dnstapFileBackups - 1; i > 0; i-- {
+		os.Rename(f.path+"."+strconv.Itoa(i), f.path+"."+strconv.Itoa(i+1))
+	}
+	if err := os.Rename(f.path, f.path+".1"); err != nil {
+		log.Printf("Failed to rotate dnstap file %s: %v", f.path, err)
+	}
+}
+
+func (f *dnstapFile) write(frame []byte) error {
+	if f.maxSize > 0 && f.size+int64(len(frame)) > f.maxSize {
+		f.close()
+		if err := f.open(); err != nil {
+			return err
+		}
+	}
+	f.size += int64(len(frame))
+	_, err := f.w.Write(frame)
+	return err
+}
+
+func (f *dnstapFile) flush() error {
+	return f.w.Flush()
+}
+
+func (f *dnstapFile) close() {
+	if f.f == nil {
+		return
+	}
+	f.w.Write(appendControl(nil, fstrmControlStop))
+	if err := f.w.Flush(); err != nil {
+		log.Printf("Failed to flush dnstap file %s: %v", f.path, err)
+	}
+	f.f.Close()
+	f.f, f.w = nil, nil
+}
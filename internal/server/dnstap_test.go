@@ -0,0 +1,148 @@
+package server
+
+import (
+	"encoding/binary"
+	"io"
+	"net"
+	"os"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/stretchr/testify/require"
+)
+
+// protoFields decodes the top level of a protobuf message into its fields:
+// varints as uint64, length-delimited and fixed32 fields as bytes.
+func protoFields(tb testing.TB, b []byte) map[uint64]interface{} {
+	tb.Helper()
+	fields := make(map[uint64]interface{})
+	for len(b) > 0 {
+		tag, n := binary.Uvarint(b)
+		require.Greater(tb, n, 0)
+		b = b[n:]
+		switch tag & 7 {
+		case 0:
+			v, n := binary.Uvarint(b)
+			require.Greater(tb, n, 0)
+			fields[tag>>3], b = v, b[n:]
+		case 2:
+			l, n := binary.Uvarint(b)
+			require.Greater(tb, n, 0)
+			fields[tag>>3], b = b[n:n+int(l)], b[n+int(l):]
+		case 5:
+			fields[tag>>3], b = b[:4], b[4:]
+		default:
+			tb.Fatalf("unexpected wire type %d", tag&7)
+		}
+	}
+	return fields
+}
+
+func TestDnstapFileFrames(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "dnstap.fstrm")
+	d := &dnstapOutput{identity: []byte("test"), version: []byte("v"), metrics: metrics.NewMetrics()}
+	ev := &dnstapEvent{
+		listener:     metrics.ListenerUDP,
+		client:       &net.UDPAddr{IP: net.IPv4(192, 0, 2, 1), Port: 5300},
+		server:       &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1), Port: 53},
+		query:        []byte{0x12, 0x34, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0},
+		response:     []byte{0x12, 0x34, 0x81, 0x80, 0, 1, 0, 0, 0, 0, 0, 0},
+		queryTime:    time.Unix(1700000000, 500),
+		responseTime: time.Unix(1700000000, 2000500),
+		outcome:      metrics.OutcomeHit,
+	}
+
+	sink := &dnstapFile{path: path}
+	require.NoError(t, sink.open())
+	require.NoError(t, sink.write(d.encode(nil, ev, messageTypeClientResponse)))
+	sink.close()
+
+	b, err := os.ReadFile(path)
+	require.NoError(t, err)
+
+	// START control frame with the dnstap content type.
+	require.Equal(t, uint32(0), binary.BigEndian.Uint32(b))
+	n := binary.BigEndian.Uint32(b[4:])
+	require.Equal(t, uint32(fstrmControlStart), binary.BigEndian.Uint32(b[8:]))
+	require.Equal(t, dnstapContentType, string(b[20:8+n]))
+	b = b[8+n:]
+
+	// The data frame.
+	n = binary.BigEndian.Uint32(b)
+	require.NotZero(t, n)
+	top := protoFields(t, b[4:4+n])
+	b = b[4+n:]
+	require.Equal(t, []byte("test"), top[dnstapFieldIdentity])
+	require.Equal(t, uint64(dnstapTypeMessage), top[dnstapFieldType])
+	require.Equal(t, []byte("outcome=hit latency_us=2000"), top[dnstapFieldExtra])
+
+	msg := protoFields(t, top[dnstapFieldMessage].([]byte))
+	require.Equal(t, uint64(messageTypeClientResponse), msg[messageFieldType])
+	require.Equal(t, uint64(socketFamilyINET), msg[messageFieldSocketFamily])
+	require.Equal(t, uint64(1), msg[messageFieldSocketProtocol])
+	require.Equal(t, []byte{192, 0, 2, 1}, msg[messageFieldQueryAddress])
+	require.Equal(t, uint64(5300), msg[messageFieldQueryPort])
+	require.Equal(t, uint64(1700000000), msg[messageFieldQueryTimeSec])
+	require.Equal(t, ev.query, msg[messageFieldQueryMessage])
+	require.Equal(t, ev.response, msg[messageFieldResponseMessage])
+
+	// STOP control frame.
+	require.Equal(t, uint32(0), binary.BigEndian.Uint32(b))
+	require.Equal(t, uint32(fstrmControlStop), binary.BigEndian.Uint32(b[8:]))
+	require.Len(t, b, 12)
+}
+
+func TestDnstapSocketHandshake(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "dnstap.sock")
+	l, err := net.Listen("unix", path)
+	require.NoError(t, err)
+	defer l.Close()
+
+	// A reader that accepts the stream, then answers STOP with FINISH.
+	controls := make(chan uint32, 4)
+	go func() {
+		conn, err := l.Accept()
+		if err != nil {
+			return
+		}
+		defer conn.Close()
+		for {
+			var hdr [4]byte
+			if _, err := io.ReadFull(conn, hdr[:]); err != nil {
+				return
+			}
+			if n := binary.BigEndian.Uint32(hdr[:]); n > 0 {
+				io.CopyN(io.Discard, conn, int64(n)) // a data frame
+				continue
+			}
+			var n [4]byte
+			io.ReadFull(conn, n[:])
+			body := make([]byte, binary.BigEndian.Uint32(n[:]))
+			io.ReadFull(conn, body)
+			typ := binary.BigEndian.Uint32(body)
+			controls <- typ
+			switch typ {
+			case fstrmControlReady:
+				conn.Write(appendControl(nil, fstrmControlAccept))
+			case fstrmControlStop:
+				conn.Write(appendControl(nil, fstrmControlFinish))
+				return
+			}
+		}
+	}()
+
+	sink := &dnstapSocket{path: path}
+	require.NoError(t, sink.open())
+	require.NoError(t, sink.write(binary.BigEndian.AppendUint32(nil, 3)))
+	require.NoError(t, sink.write([]byte("abc")))
+	sink.close()
+
+	// close waited for FINISH, so the reader has seen STOP by now.
+	require.Len(t, controls, 3)
+	for _, want := range []uint32{fstrmControlReady, fstrmControlStart, fstrmControlStop} {
+		require.Equal(t, want, <-controls)
+	}
+}
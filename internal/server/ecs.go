@@ -0,0 +1,167 @@
+package server
+
+import (
+	"context"
+	"net"
+	"strings"
+
+	"github.com/miekg/dns"
+)
+
+// ECS address families (RFC 7871, section 6).
+const (
+	ecsFamilyIPv4 = 1
+	ecsFamilyIPv6 = 2
+)
+
+// Source prefixes sent upstream when ECSIPv4Prefix or ECSIPv6Prefix isn't set,
+// as RFC 7871, section 11.1 recommends.
+const (
+	defaultECSIPv4Prefix = 24
+	defaultECSIPv6Prefix = 56
+)
+
+// ecsEnabled reports whether client subnets are forwarded. Without ECS
+// forwarders nothing upstream would see them, so they are ignored.
+func (s *Server) ecsEnabled() bool {
+	return s.config.ECSEnabled && len(s.config.ECSForwarders) > 0
+}
+
+// setClientSubnet adds the EDNS Client Subnet option for r to req, the upstream
+// request built by setUpstreamRequest, and reports whether it did. The subnet is
+// the one in r's own ECS option, returned as echo, or else, for names in
+// ECSZones only, the client's address remote; other queries go through the
+// resolver as usual. Either way the source prefix is capped at ECSIPv4Prefix or
+// ECSIPv6Prefix. A client that asks for no subnet to be used, with a source
+// prefix of zero, gets its wish (RFC 7871, section 7.1.2).
+func (s *Server) setClientSubnet(req, r *dns.Msg, remote net.Addr) (echo *dns.EDNS0_SUBNET, ok bool) {
+	if !s.ecsEnabled() {
+		return nil, false
+	}
+
+	var family uint16
+	var prefix uint8
+	var addr net.IP
+	if opt := r.IsEdns0(); opt != nil {
+		for _, o := range opt.Option {
+			if ecs, isECS := o.(*dns.EDNS0_SUBNET); isECS {
+				echo = ecs
+				family, prefix, addr = ecs.Family, ecs.SourceNetmask, ecs.Address
+				break
+			}
+		}
+	}
+	if echo == nil {
+		if !s.inECSZone(r.Question[0].Name) {
+			return nil, false
+		}
+		addr = remoteIP(remote)
+		if addr == nil || addr.IsUnspecified() {
+			return nil, false
+		}
+		if ip4 := addr.To4(); ip4 != nil {
+			family, prefix, addr = ecsFamilyIPv4, 32, ip4
+		} else {
+			family, prefix = ecsFamilyIPv6, 128
+		}
+	}
+
+	v4Prefix, v6Prefix := s.config.ECSIPv4Prefix, s.config.ECSIPv6Prefix
+	if v4Prefix == 0 {
+		v4Prefix = defaultECSIPv4Prefix
+	}
+	if v6Prefix == 0 {
+		v6Prefix = defaultECSIPv6Prefix
+	}
+	switch family {
+	case ecsFamilyIPv4:
+		addr = addr.To4()
+		if prefix > v4Prefix {
+			prefix = v4Prefix
+		}
+	case ecsFamilyIPv6:
+		addr = addr.To16()
+		if prefix > v6Prefix {
+			prefix = v6Prefix
+		}
+	default:
+		addr = nil
+	}
+	if addr == nil {
+		return nil, false
+	}
+
+	bits := len(addr) * 8
+	opt := req.IsEdns0()
+	opt.Option = append(opt.Option, &dns.EDNS0_SUBNET{
+		Code:          dns.EDNS0SUBNET,
+		Family:        family,
+		SourceNetmask: prefix,
+		Address:       addr.Mask(net.CIDRMask(int(prefix), bits)),
+	})
+	return echo, true
+}
+
+// inECSZone reports whether name is in one of the ECSZones.
+func (s *Server) inECSZone(name string) bool {
+	name = strings.ToLower(name)
+	for _, zone := range s.config.ECSZones {
+		zone = strings.ToLower(dns.Fqdn(zone))
+		if zone == "." || name == zone || strings.HasSuffix(name, "."+zone) {
+			return true
+		}
+	}
+	return false
+}
+
+func remoteIP(addr net.Addr) net.IP {
+	switch a := addr.(type) {
+	case *net.UDPAddr:
+		return a.IP
+	case *net.TCPAddr:
+		return a.IP
+	}
+	return nil
+}
+
+// resolveECS resolves req, which carries an ECS option, and packs the answer
+// into buf. Clients that sent an ECS option, echo, get it back with the scope of
+// the answer (RFC 7871, section 7.2.2); others get no OPT record, like every
+// other answer.
+func (s *Server) resolveECS(ctx context.Context, req *dns.Msg, echo *dns.EDNS0_SUBNET, buf []byte) ([]byte, error) {
+	msg, err := s.resolver.Resolve(ctx, req)
+	if err != nil {
+		return nil, err
+	}
+
+	var scope uint8
+	extra := msg.Extra[:0]
+	for _, rr := range msg.Extra {
+		opt, isOPT := rr.(*dns.OPT)
+		if !isOPT {
+			extra = append(extra, rr)
+			continue
+		}
+		for _, o := range opt.Option {
+			if ecs, isECS := o.(*dns.EDNS0_SUBNET); isECS {
+				scope = ecs.SourceScope
+			}
+		}
+	}
+	msg.Extra = extra
+
+	if echo != nil {
+		opt := &dns.OPT{Hdr: dns.RR_Header{Name: ".", Rrtype: dns.TypeOPT}}
+		opt.SetUDPSize(dns.DefaultMsgSize)
+		opt.Option = []dns.EDNS0{&dns.EDNS0_SUBNET{
+			Code:          dns.EDNS0SUBNET,
+			Family:        echo.Family,
+			SourceNetmask: echo.SourceNetmask,
+			SourceScope:   scope,
+			Address:       echo.Address,
+		}}
+		msg.Extra = append(msg.Extra, opt)
+	}
+	msg.Id = req.Id
+	return msg.PackBuffer(buf)
+}
@@ -0,0 +1,58 @@
+package server
+
+import (
+	"net"
+	"testing"
+
+	"dns-resolver/internal/config"
+
+	"github.com/miekg/dns"
+	"github.com/stretchr/testify/assert"
+	"github.com/stretchr/testify/require"
+)
+
+func TestSetClientSubnet(t *testing.T) {
+	s := &Server{config: &config.Config{
+		ECSEnabled:    true,
+		ECSForwarders: []string{"192.0.2.53:53"},
+		ECSZones:      []string{"cdn.example"},
+	}}
+	remote := &net.UDPAddr{IP: net.IPv4(198, 51, 100, 77), Port: 5300}
+	subnet := func(name string, clientECS *dns.EDNS0_SUBNET) (*dns.EDNS0_SUBNET, bool) {
+		r := new(dns.Msg)
+		r.SetQuestion(name, dns.TypeA)
+		if clientECS != nil {
+			r.SetEdns0(1232, false)
+			r.IsEdns0().Option = append(r.IsEdns0().Option, clientECS)
+		}
+		req := new(dns.Msg)
+		setUpstreamRequest(req, r)
+		if _, ok := s.setClientSubnet(req, r, remote); !ok {
+			return nil, false
+		}
+		opt := req.IsEdns0()
+		require.NotNil(t, opt)
+		require.Len(t, opt.Option, 1)
+		return opt.Option[0].(*dns.EDNS0_SUBNET), true
+	}
+
+	// Clients that send no ECS keep to the normal path outside the ECS zones.
+	_, ok := subnet("www.example.com.", nil)
+	assert.False(t, ok)
+
+	// Inside them, their address goes upstream, under the default prefix.
+	ecs, ok := subnet("img.CDN.example.", nil)
+	if assert.True(t, ok) {
+		assert.Equal(t, uint8(24), ecs.SourceNetmask)
+		assert.Equal(t, net.IPv4(198, 51, 100, 0).To4(), ecs.Address)
+	}
+
+	// A client's own ECS is forwarded for any name.
+	ecs, ok = subnet("www.example.com.", &dns.EDNS0_SUBNET{
+		Code: dns.EDNS0SUBNET, Family: ecsFamilyIPv4, SourceNetmask: 32, Address: net.IPv4(203, 0, 113, 9).To4(),
+	})
+	if assert.True(t, ok) {
+		assert.Equal(t, uint8(24), ecs.SourceNetmask)
+		assert.Equal(t, net.IPv4(203, 0, 113, 0).To4(), ecs.Address)
+	}
+}
@@ -0,0 +1,130 @@
+package server
+
+import (
+	"context"
+	"fmt"
+	"log"
+	"net"
+	"runtime"
+	"time"
+
+	"dns-resolver/internal/metrics"
+
+	"github.com/miekg/dns"
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// listenerSockets returns how many sockets each plain DNS protocol is sharded over.
+func (s *Server) listenerSockets() int {
+	if !reusePortSupported {
+		return 1
+	}
+	if s.config.ListenerSockets > 0 {
+		return s.config.ListenerSockets
+	}
+	return runtime.GOMAXPROCS(0)
+}
+
+// listenerFor returns the listener of a plain DNS protocol, "udp" or "tcp".
+func listenerFor(proto string) metrics.Listener {
+	if proto == "udp" {
+		return metrics.ListenerUDP
+	}
+	return metrics.ListenerTCP
+}
+
+// batchUDP reports whether UDP is served by the recvmmsg/sendmmsg loop instead of dns.Server.
+func (s *Server) batchUDP(proto string) bool {
+	return proto == "udp" && s.config.UDPBatchSize > 1
+}
+
+// openSocket binds one listener socket on ListenAddr and returns the function that
+// serves it, and one that closes it if it is never served. With reusePort set the
+// socket is opened with SO_REUSEPORT so that several of them can share the address.
+func (s *Server) openSocket(proto string, socket int, reusePort bool) (serve, closeSocket func() error, err error) {
+	var lc net.ListenConfig
+	if reusePort {
+		lc.Control = reusePortControl
+	}
+
+	if s.batchUDP(proto) {
+		pc, err := lc.ListenPacket(context.Background(), proto, s.config.ListenAddr)
+		if err != nil {
+			return nil, nil, err
+		}
+		conn, ok := pc.(*net.UDPConn)
+		if !ok {
+			pc.Close()
+			return nil, nil, fmt.Errorf("unexpected packet conn type %T", pc)
+		}
+		batch := newUDPBatch(conn, s.handlers[metrics.ListenerUDP], s.config.UDPBatchSize, s.metrics.ListenerReceiveCounter(proto, socket))
+		batch.fast = func(pkt []byte, w dns.ResponseWriter) bool {
+			return s.serveFast(pkt, w, metrics.ListenerUDP)
+		}
+		return batch.Serve, conn.Close, nil
+	}
+
+	server := &dns.Server{
+		Net:            proto,
+		Handler:        s.handlers[listenerFor(proto)],
+		DecorateReader: s.countingReader(proto, socket),
+	}
+	switch proto {
+	case "udp":
+		pc, err := lc.ListenPacket(context.Background(), proto, s.config.ListenAddr)
+		if err != nil {
+			return nil, nil, err
+		}
+		server.PacketConn = pc
+		closeSocket = pc.Close
+	default:
+		l, err := lc.Listen(context.Background(), proto, s.config.ListenAddr)
+		if err != nil {
+			return nil, nil, err
+		}
+		server.Listener = l
+		closeSocket = l.Close
+	}
+	return server.ActivateAndServe, closeSocket, nil
+}
+
+// serveSocket runs the read loop of a single listener socket, optionally pinned to a CPU.
+func (s *Server) serveSocket(serve func() error, proto string, socket int) {
+	if s.config.ListenerCPUAffinity {
+		if err := pinToCPU(socket); err != nil {
+			log.Printf("Failed to pin %s socket %d: %v", proto, socket, err)
+		}
+	}
+	if err := serve(); err != nil {
+		log.Printf("%s socket %d stopped: %v", proto, socket, err)
+	}
+}
+
+// countingReader returns a dns.DecorateReader that counts messages read from one socket.
+func (s *Server) countingReader(proto string, socket int) dns.DecorateReader {
+	received := s.metrics.ListenerReceiveCounter(proto, socket)
+	return func(r dns.Reader) dns.Reader {
+		return &countingReader{Reader: r, received: received}
+	}
+}
+
+type countingReader struct {
+	dns.Reader
+	received prometheus.Counter
+}
+
+func (r *countingReader) ReadTCP(conn net.Conn, timeout time.Duration) ([]byte, error) {
+	b, err := r.Reader.ReadTCP(conn, timeout)
+	if err == nil {
+		r.received.Inc()
+	}
+	return b, err
+}
+
+func (r *countingReader) ReadUDP(conn *net.UDPConn, timeout time.Duration) ([]byte, *dns.SessionUDP, error) {
+	b, session, err := r.Reader.ReadUDP(conn, timeout)
+	if err == nil {
+		r.received.Inc()
+	}
+	return b, session, err
+}
@@ -0,0 +1,61 @@
+//go:build linux
+
+package server
+
+import (
+	"fmt"
+	"runtime"
+	"syscall"
+
+	"golang.org/x/sys/unix"
+)
+
+// reusePortSupported reports whether listeners can be sharded over several
+// SO_REUSEPORT sockets on this platform.
+const reusePortSupported = true
+
+// reusePortControl sets SO_REUSEPORT on a socket before it is bound, so that
+// several sockets can share ListenAddr and the kernel spreads flows across them.
+func reusePortControl(network, address string, c syscall.RawConn) error {
+	var sockErr error
+	if err := c.Control(func(fd uintptr) {
+		sockErr = unix.SetsockoptInt(int(fd), unix.SOL_SOCKET, unix.SO_REUSEPORT, 1)
+	}); err != nil {
+		return err
+	}
+	return sockErr
+}
+
+// pinToCPU locks the calling goroutine to its OS thread and restricts that
+// thread to the n-th CPU (modulo the count) the process is allowed to run on.
+func pinToCPU(n int) error {
+	var allowed unix.CPUSet
+	if err := unix.SchedGetaffinity(0, &allowed); err != nil {
+		return fmt.Errorf("failed to read CPU affinity: %w", err)
+	}
+	count := allowed.Count()
+	if count == 0 {
+		return fmt.Errorf("no CPUs in affinity mask")
+	}
+
+	target := n % count
+	for cpu := 0; cpu < 8*1024; cpu++ {
+		if !allowed.IsSet(cpu) {
+			continue
+		}
+		if target > 0 {
+			target--
+			continue
+		}
+
+		var set unix.CPUSet
+		set.Set(cpu)
+		runtime.LockOSThread()
+		if err := unix.SchedSetaffinity(0, &set); err != nil {
+			runtime.UnlockOSThread()
+			return fmt.Errorf("failed to pin to CPU %d: %w", cpu, err)
+		}
+		return nil
+	}
+	return fmt.Errorf("CPU index %d not found in affinity mask", n)
+}
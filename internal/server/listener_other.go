@@ -0,0 +1,17 @@
+//go:build !linux
+
+package server
+
+import "syscall"
+
+// reusePortSupported reports whether listeners can be sharded over several
+// SO_REUSEPORT sockets on this platform.
+const reusePortSupported = false
+
+func reusePortControl(network, address string, c syscall.RawConn) error {
+	return nil
+}
+
+func pinToCPU(n int) error {
+	return nil
+}
@@ -1,7 +1,6 @@
 package server
 
 import (
-	"context"
 	"crypto/tls"
 	"encoding/base64"
 	"io"
@@ -9,8 +8,11 @@ import (
 	"net"
 	"net/http"
 	"sync"
+	"time"
 
 	"dns-resolver/internal/config"
+	"dns-resolver/internal/dnswire"
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/metrics"
 	"dns-resolver/internal/plugins"
 	"dns-resolver/internal/resolver"
@@ -22,13 +24,27 @@ var msgPool = sync.Pool{
 		return new(dns.Msg)
 	},
 }
+
+var queryPool = sync.Pool{
+	New: func() interface{} {
+		return new(dnswire.Query)
+	},
+}
+
+var pluginContextPool = sync.Pool{
+	New: func() interface{} {
+		return new(plugins.PluginContext)
+	},
+}
+
 // Server holds the server state.
 type Server struct {
 	config        *config.Config
-	handler       dns.Handler
+	handlers      [metrics.ListenerCount]dns.Handler // by the listener they serve
 	metrics       *metrics.Metrics
 	resolver      resolver.ResolverInterface
 	pluginManager *plugins.PluginManager
+	dnstap        *dnstapOutput // nil unless dnstap logging is configured
 }
 
 // NewServer creates a new server.
@@ -38,54 +54,175 @@ func NewServer(cfg *config.Config, m *metrics.Metrics, res resolver.ResolverInte
 		metrics:       m,
 		resolver:      res,
 		pluginManager: pm,
+		dnstap:        newDnstapOutput(cfg, m),
 	}
 	s.buildAndSetHandler()
 	return s
 }
 
 func (s *Server) buildAndSetHandler() {
-	handler := dns.HandlerFunc(func(w dns.ResponseWriter, r *dns.Msg) {
+	for l := range s.handlers {
+		s.handlers[l] = s.metricsWrapper(s.newHandler(metrics.Listener(l)))
+	}
+}
+
+// newHandler returns the handler for queries arriving on listener l. It times
+// the stages of each query for the per-listener latency histograms.
+func (s *Server) newHandler(l metrics.Listener) dns.Handler {
+	return dns.HandlerFunc(func(w dns.ResponseWriter, r *dns.Msg) {
+		trace := s.metrics.StartTrace(l)
+		defer s.metrics.FinishTrace(trace)
+
 		if len(r.Question) > 0 {
-			s.metrics.RecordQueryType(dns.TypeToString[r.Question[0].Qtype])
+			s.metrics.RecordQueryType(r.Question[0].Qtype)
 		}
 
 		// Execute request plugins
-		pluginCtx := &plugins.PluginContext{ResponseWriter: w}
+		start := time.Now()
+		pluginCtx := pluginContextPool.Get().(*plugins.PluginContext)
+		*pluginCtx = plugins.PluginContext{ResponseWriter: w}
 		s.pluginManager.ExecutePlugins(pluginCtx, r)
-
-		if pluginCtx.Stop {
+		stop := pluginCtx.Stop
+		*pluginCtx = plugins.PluginContext{}
+		pluginContextPool.Put(pluginCtx)
+		trace.Stage(metrics.StagePlugins, time.Since(start))
+
+		if stop {
+			trace.SetOutcome(metrics.OutcomePlugin)
+			s.tapMsg(l, w, r, nil, trace)
 			return
 		}
 
 		req := msgPool.Get().(*dns.Msg)
-		defer func() {
-			*req = dns.Msg{}
-			msgPool.Put(req)
-		}()
-
-		req.SetQuestion(r.Question[0].Name, r.Question[0].Qtype)
-		req.RecursionDesired = true
-		req.SetEdns0(4096, true)
-
-		ctx, cancel := context.WithTimeout(context.Background(), s.config.RequestTimeout)
-		defer cancel()
-
-		msg, err := s.resolver.Resolve(ctx, req)
+		defer msgPool.Put(req)
+		setUpstreamRequest(req, r)
+
+		buf := packetPool.Get().(*[]byte)
+		defer packetPool.Put(buf)
+
+		// The resolver applies RequestTimeout to misses itself, so cache hits
+		// don't pay for a timer.
+		var wire []byte
+		var err error
+		if echo, ok := s.setClientSubnet(req, r, w.RemoteAddr()); ok {
+			wire, err = s.resolveECS(trace, req, echo, *buf)
+		} else {
+			wire, err = s.resolver.ResolveWire(trace, req, *buf)
+		}
 		if err != nil {
-			log.Printf("Failed to resolve %s: %v", req.Question[0].Name, err)
-			s.metrics.RecordResponseCode(dns.RcodeToString[dns.RcodeServerFailure])
+			logging.Warnf(logging.CategoryQuery, "Failed to resolve %s: %v", req.Question[0].Name, err)
+			s.metrics.RecordResponseCode(dns.RcodeServerFailure)
 			dns.HandleFailed(w, r)
+			s.tapMsg(l, w, r, nil, trace)
 			return
 		}
 
-		s.metrics.RecordResponseCode(dns.RcodeToString[msg.Rcode])
-		msg.Id = r.Id
+		s.metrics.RecordResponseCode(int(wire[3] & 0x0F))
 
-		if err := w.WriteMsg(msg); err != nil {
-			log.Printf("Failed to write response: %v", err)
+		start = time.Now()
+		if _, err := w.Write(wire); err != nil {
+			logging.Warnf(logging.CategoryQuery, "Failed to write response: %v", err)
 		}
+		trace.Stage(metrics.StageWrite, time.Since(start))
+		s.tapMsg(l, w, r, wire, trace)
+	})
+}
+
+// tapMsg logs query r, and the response if there is one, to dnstap.
+func (s *Server) tapMsg(l metrics.Listener, w dns.ResponseWriter, r *dns.Msg, response []byte, trace *metrics.QueryTrace) {
+	if s.dnstap == nil {
+		return
+	}
+	query, err := r.Pack()
+	if err != nil {
+		return
+	}
+	s.tap(l, w, query, response, trace)
+}
+
+// tap logs a packed query, and its response if there is one, to dnstap.
+func (s *Server) tap(l metrics.Listener, w dns.ResponseWriter, query, response []byte, trace *metrics.QueryTrace) {
+	s.dnstap.log(&dnstapEvent{
+		listener:     l,
+		client:       w.RemoteAddr(),
+		server:       w.LocalAddr(),
+		query:        query,
+		response:     response,
+		queryTime:    trace.Start(),
+		responseTime: time.Now(),
+		outcome:      trace.Outcome(),
 	})
-	s.handler = s.metricsWrapper(handler)
+}
+
+// setUpstreamRequest turns the pooled req into the recursive query sent upstream
+// for r: same ID and question, RD set, r's CD bit and EDNS0 with r's DO bit, so
+// that it has the same cache key as r. It reuses the question
+// slice and OPT record req kept from its previous use, so it doesn't allocate once
+// the pool is warm.
+func setUpstreamRequest(req, r *dns.Msg) {
+	var opt *dns.OPT
+	if len(req.Extra) == 1 {
+		opt, _ = req.Extra[0].(*dns.OPT)
+	}
+	if opt == nil {
+		opt = &dns.OPT{Hdr: dns.RR_Header{Name: ".", Rrtype: dns.TypeOPT}}
+	}
+	opt.Hdr.Ttl = 0
+	opt.Option = opt.Option[:0]
+	opt.SetUDPSize(4096)
+	clientOpt := r.IsEdns0()
+	opt.SetDo(clientOpt != nil && clientOpt.Do())
+
+	q := r.Question[0]
+	*req = dns.Msg{
+		MsgHdr:   dns.MsgHdr{Id: r.Id, Opcode: dns.OpcodeQuery, RecursionDesired: true, CheckingDisabled: r.CheckingDisabled},
+		Question: append(req.Question[:0], dns.Question{Name: q.Name, Qtype: q.Qtype, Qclass: dns.ClassINET}),
+		Extra:    append(req.Extra[:0], opt),
+	}
+}
+
+// serveFast answers a raw query straight from the cache without unpacking it into
+// a dns.Msg. It reports false, having written nothing, when the packet is not a
+// plain query, a plugin wants to see it, or the answer is not cached; the caller
+// then takes the full path. l is the listener the packet arrived on.
+func (s *Server) serveFast(pkt []byte, w dns.ResponseWriter, l metrics.Listener) bool {
+	// Plugins and the resolver see the query through interfaces, which would move
+	// a stack copy to the heap; take one from the pool instead.
+	q := queryPool.Get().(*dnswire.Query)
+	defer queryPool.Put(q)
+	if !dnswire.ParseQuery(pkt, q) || s.pluginManager.Intercepts(q) {
+		return false
+	}
+	if q.ECS && s.ecsEnabled() {
+		// The answer must echo the client's subnet.
+		return false
+	}
+
+	buf := packetPool.Get().(*[]byte)
+	defer packetPool.Put(buf)
+
+	trace := s.metrics.StartTrace(l)
+	wire, ok := s.resolver.ResolveCached(trace, q, pkt, *buf)
+	if !ok {
+		// The full path traces the query from the start.
+		s.metrics.DiscardTrace(trace)
+		return false
+	}
+
+	s.metrics.IncrementQueries()
+	s.metrics.RecordQueryType(q.Qtype)
+	s.metrics.RecordResponseCode(int(wire[3] & 0x0F))
+
+	start := time.Now()
+	if _, err := w.Write(wire); err != nil {
+		logging.Warnf(logging.CategoryQuery, "Failed to write response: %v", err)
+	}
+	trace.Stage(metrics.StageWrite, time.Since(start))
+	if s.dnstap != nil {
+		s.tap(l, w, pkt, wire, trace)
+	}
+	s.metrics.FinishTrace(trace)
+	return true
 }
 
 // ListenAndServe starts the DNS server.
@@ -105,11 +242,39 @@ func (s *Server) ListenAndServe() {
 	select {} // Block forever
 }
 
+// startListener starts the plain DNS listener for one protocol. When more than one
+// socket is configured, each gets its own SO_REUSEPORT socket and read loop and the
+// kernel spreads incoming flows across them. UDP sockets use the batched
+// recvmmsg/sendmmsg loop when UDPBatchSize is set.
 func (s *Server) startListener(net string) {
-	server := &dns.Server{Addr: s.config.ListenAddr, Net: net, Handler: s.handler}
-	log.Printf("Starting %s listener on %s", net, s.config.ListenAddr)
-	if err := server.ListenAndServe(); err != nil {
-		log.Printf("Failed to start %s listener: %s", net, err)
+	sockets := s.listenerSockets()
+	if sockets <= 1 && !s.batchUDP(net) {
+		server := &dns.Server{Addr: s.config.ListenAddr, Net: net, Handler: s.handlers[listenerFor(net)], DecorateReader: s.countingReader(net, 0)}
+		log.Printf("Starting %s listener on %s", net, s.config.ListenAddr)
+		if err := server.ListenAndServe(); err != nil {
+			log.Printf("Failed to start %s listener: %s", net, err)
+		}
+		return
+	}
+
+	log.Printf("Starting %s listener on %s with %d sockets (batched: %t)", net, s.config.ListenAddr, sockets, s.batchUDP(net))
+	// Bind every socket before serving any, so that a failure leaves none behind.
+	serves := make([]func() error, 0, sockets)
+	closes := make([]func() error, 0, sockets)
+	for i := 0; i < sockets; i++ {
+		serve, closeSocket, err := s.openSocket(net, i, sockets > 1)
+		if err != nil {
+			log.Printf("Failed to start %s socket %d: %s", net, i, err)
+			for _, c := range closes {
+				c()
+			}
+			return
+		}
+		serves = append(serves, serve)
+		closes = append(closes, closeSocket)
+	}
+	for i, serve := range serves {
+		go s.serveSocket(serve, net, i)
 	}
 }
 
@@ -123,7 +288,7 @@ func (s *Server) startDoT() {
 	server := &dns.Server{
 		Addr:    s.config.DoTAddr,
 		Net:     "tcp-tls",
-		Handler: s.handler,
+		Handler: s.handlers[metrics.ListenerDoT],
 		TLSConfig: &tls.Config{
 			Certificates: []tls.Certificate{cert},
 		},
@@ -174,6 +339,11 @@ func (s *Server) handleDoH(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
+	rw := &dohResponseWriter{w: w, r: r}
+	if s.serveFast(body, rw, metrics.ListenerDoH) {
+		return
+	}
+
 	msg := new(dns.Msg)
 	if err := msg.Unpack(body); err != nil {
 		http.Error(w, "Failed to unpack DNS message", http.StatusBadRequest)
@@ -181,7 +351,7 @@ func (s *Server) handleDoH(w http.ResponseWriter, r *http.Request) {
 	}
 
 	// Internal handler logic - use the same handler as UDP/TCP to ensure metrics and plugins are run
-	s.handler.ServeDNS(&dohResponseWriter{w: w, r: r}, msg)
+	s.handlers[metrics.ListenerDoH].ServeDNS(rw, msg)
 }
 
 type dohResponseWriter struct {
@@ -195,14 +365,14 @@ func (d *dohResponseWriter) WriteMsg(m *dns.Msg) error {
 	if err != nil {
 		return err
 	}
-	d.w.Header().Set("Content-Type", "application/dns-message")
-	// Set standard DoH headers
-	d.w.Header().Set("Cache-Control", "max-age=0")
-	_, err = d.w.Write(b)
+	_, err = d.Write(b)
 	return err
 }
 
 func (d *dohResponseWriter) Write(b []byte) (int, error) {
+	d.w.Header().Set("Content-Type", "application/dns-message")
+	// Set standard DoH headers
+	d.w.Header().Set("Cache-Control", "max-age=0")
 	return d.w.Write(b)
 }
 
@@ -212,6 +382,9 @@ func (d *dohResponseWriter) LocalAddr() net.Addr {
 }
 
 func (d *dohResponseWriter) RemoteAddr() net.Addr {
+	if addr, err := net.ResolveTCPAddr("tcp", d.r.RemoteAddr); err == nil {
+		return addr
+	}
 	addr, _ := net.ResolveTCPAddr("tcp", "0.0.0.0:0")
 	return addr
 }
@@ -0,0 +1,127 @@
+package server
+
+import (
+	"net"
+	"testing"
+
+	"dns-resolver/internal/cache"
+	"dns-resolver/internal/config"
+	"dns-resolver/internal/metrics"
+	"dns-resolver/internal/plugins"
+	"dns-resolver/internal/resolver"
+	"dns-resolver/plugins/authoritative"
+
+	"github.com/miekg/dns"
+	"github.com/stretchr/testify/require"
+)
+
+// hitPathAllocBudget is the number of heap allocations a cache hit may make on its
+// way through the server. Raising it needs a good reason.
+const hitPathAllocBudget = 0
+
+// discardWriter is a dns.ResponseWriter that keeps only the size of the last reply.
+type discardWriter struct {
+	written int
+}
+
+func (w *discardWriter) LocalAddr() net.Addr  { return &net.UDPAddr{} }
+func (w *discardWriter) RemoteAddr() net.Addr { return &net.UDPAddr{} }
+func (w *discardWriter) WriteMsg(m *dns.Msg) error {
+	_, err := m.Pack()
+	return err
+}
+func (w *discardWriter) Write(b []byte) (int, error) {
+	w.written = len(b)
+	return len(b), nil
+}
+func (w *discardWriter) Close() error        { return nil }
+func (w *discardWriter) TsigStatus() error   { return nil }
+func (w *discardWriter) TsigTimersOnly(bool) {}
+func (w *discardWriter) Hijack()             {}
+
+// newHitServer returns a server whose cache already holds the answer to the
+// returned query. An authoritative plugin that doesn't own the name sits in the
+// plugin chain, as it does in production.
+func newHitServer(tb testing.TB) (*Server, *dns.Msg) {
+	tb.Helper()
+
+	cfg := config.NewConfig()
+	m := metrics.NewMetrics()
+	c, err := cache.NewCache(1<<20, 1<<20, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
+	require.NoError(tb, err)
+	tb.Cleanup(c.Close)
+
+	res, err := resolver.NewResolver(resolver.ResolverTypeUnbound, cfg, c, m)
+	require.NoError(tb, err)
+
+	auth := authoritative.New("")
+	require.NoError(tb, auth.AddZone("example.org."))
+	pm := plugins.NewPluginManager()
+	pm.Register(auth)
+
+	query := new(dns.Msg)
+	query.SetQuestion("hit.example.com.", dns.TypeA)
+	query.SetEdns0(4096, true)
+
+	reply := new(dns.Msg)
+	reply.SetReply(query)
+	rr, err := dns.NewRR("hit.example.com. 3600 IN A 192.0.2.1")
+	require.NoError(tb, err)
+	reply.Answer = append(reply.Answer, rr)
+
+	key := cache.KeyFromMsg(query)
+	c.Set(&key, reply, 0)
+	c.Wait()
+
+	return NewServer(cfg, m, res, pm), query
+}
+
+func TestCacheHitPathDoesNotAllocate(t *testing.T) {
+	s, query := newHitServer(t)
+	wire, err := query.Pack()
+	require.NoError(t, err)
+	w := &discardWriter{}
+
+	s.handlers[metrics.ListenerUDP].ServeDNS(w, query)
+	require.NotZero(t, w.written, "expected the handler to answer from the cache")
+	allocs := testing.AllocsPerRun(100, func() { s.handlers[metrics.ListenerUDP].ServeDNS(w, query) })
+	require.LessOrEqual(t, allocs, float64(hitPathAllocBudget), "handler allocations per cache hit")
+
+	w.written = 0
+	require.True(t, s.serveFast(wire, w, metrics.ListenerUDP), "expected the fast path to answer from the cache")
+	allocs = testing.AllocsPerRun(100, func() { s.serveFast(wire, w, metrics.ListenerUDP) })
+	require.LessOrEqual(t, allocs, float64(hitPathAllocBudget), "fast path allocations per cache hit")
+}
+
+// BenchmarkCacheHitPath measures a cache hit through the dns.Msg handler and the
+// wire fast path. It fails if either allocates more than hitPathAllocBudget.
+func BenchmarkCacheHitPath(b *testing.B) {
+	s, query := newHitServer(b)
+	wire, err := query.Pack()
+	require.NoError(b, err)
+	w := &discardWriter{}
+
+	run := func(b *testing.B, serve func()) {
+		serve()
+		if w.written == 0 {
+			b.Fatal("expected a cache hit")
+		}
+		if allocs := testing.AllocsPerRun(100, serve); allocs > hitPathAllocBudget {
+			b.Fatalf("cache hit made %.0f allocations, budget is %d", allocs, hitPathAllocBudget)
+		}
+		b.ReportAllocs()
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			serve()
+		}
+	}
+
+	b.Run("handler", func(b *testing.B) {
+		w.written = 0
+		run(b, func() { s.handlers[metrics.ListenerUDP].ServeDNS(w, query) })
+	})
+	b.Run("fast", func(b *testing.B) {
+		w.written = 0
+		run(b, func() { s.serveFast(wire, w, metrics.ListenerUDP) })
+	})
+}
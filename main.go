@@ -9,6 +9,7 @@ import (
 
 	"dns-resolver/internal/cache"
 	"dns-resolver/internal/config"
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/metrics"
 	"dns-resolver/internal/plugins"
 	"dns-resolver/internal/resolver"
@@ -39,12 +40,38 @@ func main() {
 	// Initialize metrics
 	m := metrics.NewMetrics()
 
+	// Query-path messages go through the asynchronous logger to the same file.
+	logger, err := logging.New(cfg, logFile, m)
+	if err != nil {
+		log.Fatalf("Failed to start logger: %v", err)
+	}
+	defer logger.Close()
+	logging.Init(logger)
+
 	// Create cache and resolver
-	c, err := cache.NewCache(cfg.CacheSize, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
+	c, err := cache.NewCache(cfg.MessageCacheBytes, cfg.RRsetCacheBytes, cfg.CacheMinTTL, cfg.CacheMaxTTL, m)
 	if err != nil {
 		log.Fatalf("Failed to create cache: %v", err)
 	}
 	defer c.Close()
+	c.SetServeStale(cfg.ServeStaleMax, cfg.ServeStaleTTL)
+	c.SetPrefetch(cfg.PrefetchMinHits)
+
+	// Warm the cache from its journal before serving, then keep journaling.
+	if cfg.LMDBPath != "" {
+		journal, err := cache.OpenJournal(cfg.LMDBPath, m)
+		if err != nil {
+			log.Printf("Cache journal disabled: %v", err)
+		} else {
+			start := time.Now()
+			n, err := c.Restore(journal)
+			if err != nil {
+				log.Printf("Failed to restore cache from journal: %v", err)
+			}
+			log.Printf("Restored %d cache entries from %s in %v", n, cfg.LMDBPath, time.Since(start))
+			c.SetJournal(journal)
+		}
+	}
 	
 	// Create resolver based on configuration
 	res, err := resolver.NewResolver(resolver.ResolverType(cfg.ResolverType), cfg, c, m)
@@ -58,7 +85,7 @@ func main() {
 		ticker := time.NewTicker(2 * time.Second)
 		defer ticker.Stop()
 		for range ticker.C {
-			m.UpdateCacheStats(c.GetCacheMetrics())
+			m.UpdateCacheTierStats(c.TierStats())
 		}
 	}()
 
@@ -22,6 +22,8 @@ import (
 	"sync"
 	"time"
 
+	"dns-resolver/internal/dnswire"
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/plugins"
 	"github.com/miekg/dns"
 )
@@ -188,6 +190,29 @@ func (p *AuthoritativePlugin) findZone(qName string) (*Zone, bool) {
 	return best, true
 }
 
+// Intercepts reports whether q falls under one of the hosted zones, using the
+// same suffix match as findZone without allocating.
+func (p *AuthoritativePlugin) Intercepts(q *dnswire.Query) bool {
+	var buf [dnswire.MaxPresentationLen]byte
+	name := q.AppendName(buf[:0])
+
+	p.mu.RLock()
+	defer p.mu.RUnlock()
+	for _, z := range p.zones {
+		if hasSuffix(name, z.Name) {
+			return true
+		}
+	}
+	return false
+}
+
+func hasSuffix(name []byte, suffix string) bool {
+	if len(suffix) > len(name) {
+		return false
+	}
+	return string(name[len(name)-len(suffix):]) == suffix
+}
+
 // Execute handles incoming queries. It returns nil to allow the chain to continue
 // when not authoritative for the qname. When authoritative it writes a reply
 // and sets ctx.Stop = true to halt further processing.
@@ -202,7 +227,7 @@ func (p *AuthoritativePlugin) Execute(ctx *plugins.PluginContext, msg *dns.Msg)
 		return nil
 	}
 
-	log.Printf("[%s] authoritative handling for %s (qtype=%d)", p.Name(), q.Name, q.Qtype)
+	logging.Debugf(logging.CategoryPlugin, "[%s] authoritative handling for %s (qtype=%d)", p.Name(), q.Name, q.Qtype)
 
 	if q.Qtype == dns.TypeAXFR {
 		p.handleAXFR(ctx, msg, zone)
@@ -1,8 +1,8 @@
 package example_logger
 
 import (
-	"log"
-
+	"dns-resolver/internal/dnswire"
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/plugins"
 	"github.com/miekg/dns"
 )
@@ -19,11 +19,17 @@ func (p *LoggerPlugin) Name() string {
 func (p *LoggerPlugin) Execute(ctx *plugins.PluginContext, msg *dns.Msg) error {
 	if len(msg.Question) > 0 {
 		question := msg.Question[0]
-		log.Printf("[Plugin %s] Received query for %s, type %s", p.Name(), question.Name, dns.TypeToString[question.Qtype])
+		logging.Infof(logging.CategoryPlugin, "[Plugin %s] Received query for %s, type %s", p.Name(), question.Name, dns.TypeToString[question.Qtype])
 	}
 	return nil
 }
 
+// Intercepts lets queries answered from the cache bypass the plugin chain, so
+// the logger only sees queries that take the full path.
+func (p *LoggerPlugin) Intercepts(q *dnswire.Query) bool {
+	return false
+}
+
 // New returns a new instance of the LoggerPlugin.
 func New() *LoggerPlugin {
 	return &LoggerPlugin{}
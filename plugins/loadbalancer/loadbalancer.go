@@ -1,6 +1,7 @@
 package loadbalancer
 
 import (
+	"dns-resolver/internal/logging"
 	"dns-resolver/internal/plugins"
 	"github.com/miekg/dns"
 	"log"
@@ -63,11 +64,11 @@ func (p *LoadBalancerPlugin) Execute(ctx *plugins.PluginContext, msg *dns.Msg) e
 		return nil // No pool for this domain, continue chain
 	}
 
-	log.Printf("[%s] handling request for %s", p.Name(), q.Name)
+	logging.Debugf(logging.CategoryPlugin, "[%s] handling request for %s", p.Name(), q.Name)
 
 	backend, err := p.selectBackend(pool, ctx.ResponseWriter.RemoteAddr().String())
 	if err != nil {
-		log.Printf("[%s] error selecting backend for %s: %v", p.Name(), q.Name, err)
+		logging.Warnf(logging.CategoryPlugin, "[%s] error selecting backend for %s: %v", p.Name(), q.Name, err)
 		return nil // Or handle error appropriately
 	}
 
@@ -77,7 +78,7 @@ func (p *LoadBalancerPlugin) Execute(ctx *plugins.PluginContext, msg *dns.Msg) e
 	// Create an A or AAAA record based on the backend address
 	ip := net.ParseIP(backend.Address)
 	if ip == nil {
-		log.Printf("[%s] invalid IP address for backend %s", p.Name(), backend.Address)
+		logging.Warnf(logging.CategoryPlugin, "[%s] invalid IP address for backend %s", p.Name(), backend.Address)
 		return nil
 	}
 